@@ -3,7 +3,10 @@
 
 #include "stdafx.h"
 #include "cFarmodbus.h"
+#include "cSimodbus.h"
+#ifdef _WIN32
 #include "Serial.h"
+#endif
 
 	// construct the modbus farm
 	raven::farmodbus::cFarmodbus theModbusFarm;
@@ -46,6 +49,1598 @@ void TestStation()
 		exit(1);
 	}
 
+	// registers far apart should be read in separate transactions
+	raven::farmodbus::cStation station3( 1, port );
+	station3.Query( v, 1, 1 );
+	station3.Query( v, 250, 1 );
+	if( station3.getPlanSize() != 2 ||
+		! station3.CheckPolledRegisters( 0, 1, 1 ) ||
+		! station3.CheckPolledRegisters( 1, 250, 1 ) ) {
+		printf("Failed TestStation #6\n");
+		exit(1);
+	}
+
+	// a block longer than the modbus limit should be split
+	raven::farmodbus::cStation station4( 1, port );
+	station4.Query( v, 0, 200 );
+	if( station4.getPlanSize() != 2 ||
+		! station4.CheckPolledRegisters( 0, 0, 125 ) ||
+		! station4.CheckPolledRegisters( 1, 125, 75 ) ) {
+		printf("Failed TestStation #7\n");
+		exit(1);
+	}
+
+	// registers high in the address space
+	raven::farmodbus::cStation station5( 1, port );
+	if( station5.Query( v, 30000, 2 ) != raven::farmodbus::not_ready ) {
+		printf("Failed TestStation #8\n");
+		exit(1);
+	}
+	std::vector< raven::farmodbus::cPollRange > due;
+	station5.Due( due, boost::chrono::steady_clock::now() );
+	unsigned char pdu[256];
+	station5.ReadRequest( pdu, due[0] );
+	if( pdu[1] != 30000 >> 8 || pdu[2] != ( 0xFF & 30000 ) ) {
+		printf("Failed TestStation #9\n");
+		exit(1);
+	}
+
+	// request frame assembled when the plan was made
+	unsigned short crc = raven::farmodbus::cPort::CyclicalRedundancyCheck( due[0].frame, 6 );
+	if( due[0].frame[0] != 1 || memcmp( due[0].frame + 1, pdu, 5 ) ||
+		due[0].frame[6] != crc >> 8 || due[0].frame[7] != ( 0xFF & crc ) ) {
+		printf("Failed TestStation #19\n");
+		exit(1);
+	}
+	unsigned char reply[] = { pdu[0], 4, 0x12, 0x34, 0x00, 0x05 };
+	station5.Decode( reply, 6, due[0] );
+	if( station5.Query( v, 30000, 2 ) != raven::farmodbus::OK ||
+		v[0] != 0x1234 || v[1] != 5 ) {
+		printf("Failed TestStation #10\n");
+		exit(1);
+	}
+
+	// registers with different poll periods are read separately,
+	// each on its own fixed rate schedule
+	raven::farmodbus::cStation station6( 1, port );
+	station6.setPeriod( 1000 );
+	station6.setPeriod( 10, 2, 100 );
+	station6.Query( v, 1, 2 );
+	station6.Query( v, 10, 2 );
+	if( station6.getPlanSize() != 2 ) {
+		printf("Failed TestStation #11\n");
+		exit(1);
+	}
+	boost::chrono::steady_clock::time_point t0 = boost::chrono::steady_clock::now();
+	due.clear();
+	station6.Due( due, t0 );
+	if( due.size() != 2 ) {
+		printf("Failed TestStation #12\n");
+		exit(1);
+	}
+	due.clear();
+	station6.Due( due, t0 + boost::chrono::milliseconds( 150 ) );
+	if( due.size() != 1 || due[0].first != 10 ) {
+		printf("Failed TestStation #13\n");
+		exit(1);
+	}
+	due.clear();
+	station6.Due( due, t0 + boost::chrono::milliseconds( 350 ) );
+	if( due.size() != 1 || station6.getOverrunCount() != 1 ) {
+		printf("Failed TestStation #14\n");
+		exit(1);
+	}
+
+	// a zero period polls as fast as it can, all in one block,
+	// and a long stall is skipped in one step
+	station6.setPeriod( 0 );
+	station6.setPeriod( 10, 2, 0 );
+	due.clear();
+	station6.Due( due, t0 );
+	int overruns = station6.getOverrunCount();
+	due.clear();
+	station6.Due( due, t0 + boost::chrono::hours( 1 ) );
+	if( due.size() != 1 || station6.getOverrunCount() != overruns + 1 ) {
+		printf("Failed TestStation #28\n");
+		exit(1);
+	}
+
+	// snapshot across a page boundary, with the epoch of the update
+	raven::farmodbus::cStation station7( 1, port );
+	station7.Query( v, 254, 4 );
+	due.clear();
+	station7.Due( due, boost::chrono::steady_clock::now() );
+	unsigned char reply4[] = { pdu[0], 8, 0, 1, 0, 2, 0, 3, 0, 4 };
+	station7.Decode( reply4, 10, due[0] );
+	unsigned int epoch1, epoch2;
+	if( station7.Snapshot( v, 254, 4, epoch1 ) != raven::farmodbus::OK ||
+		v[0] != 1 || v[3] != 4 ) {
+		printf("Failed TestStation #15\n");
+		exit(1);
+	}
+	station7.Snapshot( v, 254, 4, epoch2 );
+	reply4[9] = 5;
+	station7.Decode( reply4, 10, due[0] );
+	unsigned int epoch3;
+	station7.Snapshot( v, 254, 4, epoch3 );
+	if( epoch2 != epoch1 || epoch3 == epoch1 || v[3] != 5 ) {
+		printf("Failed TestStation #16\n");
+		exit(1);
+	}
+
+	// negative values keep their bits
+	reply4[2] = 0xFF;
+	reply4[3] = 0xFE;
+	reply4[4] = 0x80;
+	reply4[5] = 0x00;
+	station7.Decode( reply4, 10, due[0] );
+	station7.Query( v, 254, 4 );
+	if( v[0] != 0xFFFE || v[1] != 0x8000 ) {
+		printf("Failed TestStation #17\n");
+		exit(1);
+	}
+
+	// long replies, decoded several registers at a time, across a page boundary
+	raven::farmodbus::cStation station8( 1, port );
+	station8.Query( v, 230, 125 );
+	due.clear();
+	station8.Due( due, boost::chrono::steady_clock::now() );
+	unsigned char reply5[ 2 + 2 * 125 ];
+	reply5[0] = pdu[0];
+	reply5[1] = 2 * 125;
+	for( int k = 0; k < 125; k++ ) {
+		reply5[ 2 + 2 * k ] = (unsigned char)( 0x80 + k );
+		reply5[ 3 + 2 * k ] = (unsigned char) k;
+	}
+	station8.Decode( reply5, sizeof( reply5 ), due[0] );
+	if( station8.Query( v, 230, 125 ) != raven::farmodbus::OK ) {
+		printf("Failed TestStation #18\n");
+		exit(1);
+	}
+	for( int k = 0; k < 125; k++ ) {
+		if( v[k] != ( ( ( 0x80 + k ) & 0xFF ) << 8 | k ) ) {
+			printf("Failed TestStation #18 register %d\n", 230 + k );
+			exit(1);
+		}
+	}
+
+	// timeout adapts to the round trip time, between floor and ceiling
+	if( station8.getTimeout() != 6000 ) {
+		printf("Failed TestStation #20\n");
+		exit(1);
+	}
+	station8.RoundTrip( 100000 );
+	int srtt, rttvar, timeout;
+	station8.getRoundTrip( srtt, rttvar, timeout );
+	if( srtt != 100000 || rttvar != 50000 || timeout != 300 ) {
+		printf("Failed TestStation #21\n");
+		exit(1);
+	}
+	for( int k = 0; k < 50; k++ )
+		station8.RoundTrip( 15000 );
+	station8.TimedOut();
+	if( station8.getTimeout() != 400 ) {
+		printf("Failed TestStation #22\n");
+		exit(1);
+	}
+	for( int k = 0; k < 10; k++ )
+		station8.TimedOut();
+	if( station8.getTimeout() != 6000 ) {
+		printf("Failed TestStation #23\n");
+		exit(1);
+	}
+
+	// a station that stops answering is probed, not polled, until it answers
+	if( station8.getHealth() != raven::farmodbus::down ) {
+		printf("Failed TestStation #24\n");
+		exit(1);
+	}
+	std::vector< raven::farmodbus::cPollRange > probe;
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+	station8.Due( probe, now );
+	if( probe.size() ) {
+		printf("Failed TestStation #25\n");
+		exit(1);
+	}
+	station8.Due( probe, now + boost::chrono::milliseconds( 1000 ) );
+	if( probe.size() != 1 ) {
+		printf("Failed TestStation #26\n");
+		exit(1);
+	}
+	station8.RoundTrip( 15000 );
+	probe.clear();
+	station8.Due( probe, boost::chrono::steady_clock::now() );
+	if( station8.getHealth() != raven::farmodbus::healthy ||
+		(int) probe.size() != station8.getPlanSize() ) {
+		printf("Failed TestStation #27\n");
+		exit(1);
+	}
+
+	// a station with its own limit on the registers in one read
+	raven::farmodbus::cStation station9( 1, port );
+	station9.Query( v, 0, 120 );
+	station9.setMaxReadCount( 50 );
+	if( station9.getPlanSize() != 3 ||
+		! station9.CheckPolledRegisters( 0, 0, 50 ) ||
+		! station9.CheckPolledRegisters( 2, 100, 20 ) ) {
+		printf("Failed TestStation #29\n");
+		exit(1);
+	}
+	station9.setMaxReadCount( 0 );
+	if( ! station9.CheckPolledRegisters( 0, 120 ) ) {
+		printf("Failed TestStation #30\n");
+		exit(1);
+	}
+
+}
+
+void TestCRC()
+{
+	// example frame, read 10 input registers from station 1
+	unsigned char frame[] = { 1, 4, 0, 0, 0, 10 };
+	if( raven::farmodbus::cPort::CyclicalRedundancyCheck( frame, 6 ) != 0x700D ) {
+		printf("Failed TestCRC #1\n");
+		exit(1);
+	}
+
+	// every method gives the same result, whatever the length
+	unsigned char msg[256];
+	for( int k = 0; k < 256; k++ )
+		msg[k] = (unsigned char)( k * 7 + 3 );
+	for( int len = 0; len <= 256; len++ ) {
+		unsigned short crc = raven::farmodbus::cPort::CyclicalRedundancyCheckBytewise( msg, len );
+		if( raven::farmodbus::cPort::CyclicalRedundancyCheckSlice4( msg, len ) != crc ||
+			raven::farmodbus::cPort::CyclicalRedundancyCheckSlice8( msg, len ) != crc ||
+			raven::farmodbus::cPort::CyclicalRedundancyCheck( msg, len ) != crc ) {
+			printf("Failed TestCRC #2 length %d\n", len );
+			exit(1);
+		}
+	}
+}
+
+void TestReplyLength()
+{
+	unsigned char read[] = { 1, 4, 20 };
+	unsigned char write[] = { 1, 16 };
+	unsigned char exception[] = { 1, 0x84 };
+	unsigned char unknown[] = { 1, 43 };
+	if( raven::farmodbus::cPort::ReplyLength( read, 2 ) != 0 ||
+		raven::farmodbus::cPort::ReplyLength( read, 3 ) != 25 ) {
+		printf("Failed TestReplyLength #1\n");
+		exit(1);
+	}
+	if( raven::farmodbus::cPort::ReplyLength( write, 2 ) != 8 ||
+		raven::farmodbus::cPort::ReplyLength( exception, 2 ) != 5 ||
+		raven::farmodbus::cPort::ReplyLength( unknown, 2 ) != -1 ) {
+		printf("Failed TestReplyLength #2\n");
+		exit(1);
+	}
+}
+
+void TestEndpoint()
+{
+	std::string host, service;
+	if( ! raven::farmodbus::cPort::ParseEndpoint( "192.168.1.10:502", host, service ) ||
+		host != "192.168.1.10" || service != "502" ) {
+		printf("Failed TestEndpoint #1\n");
+		exit(1);
+	}
+	if( ! raven::farmodbus::cPort::ParseEndpoint( "[fe80::1]:5020", host, service ) ||
+		host != "fe80::1" || service != "5020" ) {
+		printf("Failed TestEndpoint #2\n");
+		exit(1);
+	}
+	if( raven::farmodbus::cPort::ParseEndpoint( "gateway", host, service ) ||
+		raven::farmodbus::cPort::ParseEndpoint( "gateway:", host, service ) ||
+		raven::farmodbus::cPort::ParseEndpoint( ":502", host, service ) ||
+		raven::farmodbus::cPort::ParseEndpoint( "fe80::1:502", host, service ) ) {
+		printf("Failed TestEndpoint #3\n");
+		exit(1);
+	}
+}
+
+/**
+
+  Receive exactly a number of bytes from a socket
+
+  @return false if the connection closed first
+
+*/
+bool ReceiveAll( SOCKET s, unsigned char * buffer, int length )
+{
+	int have = 0;
+	while( have < length ) {
+		int n = recv( s, (char *) buffer + have, length - have, 0 );
+		if( n <= 0 )
+			return false;
+		have += n;
+	}
+	return true;
+}
+
+/**
+
+  Accept a connection, as a Modbus TCP gateway, and answer read requests,
+  with every register holding the unit ID of the station asked
+
+  @param[in] listener the listening socket
+  @param[in] count number of requests to answer
+  @param[out] unit the unit ID of each request answered
+  @param[out] connection the accepted socket
+
+*/
+void GatewayConnection( SOCKET listener, int count, std::vector< int >* unit, SOCKET* connection )
+{
+	SOCKET s = accept( listener, 0, 0 );
+	*connection = s;
+	if( s == INVALID_SOCKET )
+		return;
+	for( int k = 0; k < count; k++ ) {
+		unsigned char request[12];
+		if( ! ReceiveAll( s, request, 12 ) )
+			return;
+		unit->push_back( request[6] );
+		int reg_count = request[10] << 8 | request[11];
+		unsigned char reply[260];
+		memcpy( reply, request, 8 );		// transaction ID, protocol ID, unit ID and function code
+		reply[4] = ( 3 + 2 * reg_count ) >> 8;
+		reply[5] = 0xFF & ( 3 + 2 * reg_count );
+		reply[8] = 2 * reg_count;
+		for( int r = 0; r < reg_count; r++ ) {
+			reply[9+2*r] = 0;
+			reply[10+2*r] = request[6];
+		}
+		int length = 9 + 2 * reg_count;
+		if( send( s, (const char *) reply, length, 0 ) != length )
+			return;
+	}
+}
+
+/**
+
+  Listen on a loopback port chosen by the system
+
+  @param[out] endpoint the address to connect, as "127.0.0.1:port"
+
+  @return the listening socket, INVALID_SOCKET if none
+
+*/
+SOCKET LoopbackListener( char * endpoint )
+{
+	SOCKET listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	sockaddr_in address;
+	memset( &address, 0, sizeof( address ) );
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	address.sin_port = 0;
+	socklen_t address_length = sizeof( address );
+	if( listener == INVALID_SOCKET ||
+		bind( listener, (sockaddr *) &address, sizeof( address ) ) ||
+		listen( listener, 4 ) ||
+		getsockname( listener, (sockaddr *) &address, &address_length ) )
+		return INVALID_SOCKET;
+	sprintf( endpoint, "127.0.0.1:%d", ntohs( address.sin_port ) );
+	return listener;
+}
+
+/**
+
+  Accept connections and answer read requests, sending each reply in two
+  pieces with a pause between, as a slow gateway would.
+  Every register holds its own address.
+
+  @param[in] listener the listening socket
+  @param[in] mbap true for Modbus TCP framing, false for RTU frames over TCP
+  @param[in] split number of bytes sent in the first piece of each reply
+  @param[in] connections number of connections to accept, one after the other
+  @param[in] count number of requests to answer on each connection, before closing it
+
+*/
+void SegmentedDevice( SOCKET listener, bool mbap, int split, int connections, int count )
+{
+	for( int c = 0; c < connections; c++ ) {
+		SOCKET s = accept( listener, 0, 0 );
+		if( s == INVALID_SOCKET )
+			return;
+		for( int k = 0; k < count; k++ ) {
+			unsigned char request[12];
+			int request_length = mbap ? 12 : 8;
+			if( ! ReceiveAll( s, request, request_length ) )
+				break;
+			unsigned char * pdu = mbap ? request + 7 : request + 1;
+			int first = pdu[1] << 8 | pdu[2];
+			int reg_count = pdu[3] << 8 | pdu[4];
+			if( reg_count > 125 )
+				break;
+			unsigned char reply[260];
+			int length = 0;
+			if( mbap ) {
+				memcpy( reply, request, 7 );	// transaction ID, protocol ID, unit ID
+				reply[4] = ( 3 + 2 * reg_count ) >> 8;
+				reply[5] = 0xFF & ( 3 + 2 * reg_count );
+				length = 7;
+			} else {
+				reply[length++] = request[0];
+			}
+			reply[length++] = pdu[0];
+			reply[length++] = 2 * reg_count;
+			for( int r = 0; r < reg_count; r++ ) {
+				reply[length++] = ( first + r ) >> 8;
+				reply[length++] = 0xFF & ( first + r );
+			}
+			if( ! mbap ) {
+				unsigned short crc = raven::farmodbus::cPort::CyclicalRedundancyCheck( reply, length );
+				reply[length++] = crc >> 8;
+				reply[length++] = 0xFF & crc;
+			}
+			if( send( s, (const char *) reply, split, 0 ) != split )
+				break;
+			Sleep( 50 );
+			if( send( s, (const char *) reply + split, length - split, 0 ) != length - split )
+				break;
+		}
+		closesocket( s );
+	}
+}
+
+/**
+
+  Accept a connection, as a Modbus TCP gateway, and answer read requests,
+  with every register holding the unit ID of the station asked.
+  Before each reply come two that do not match the request,
+  with the same transaction ID but another unit ID, or another function code,
+  and every register holding 99.
+
+  @param[in] listener the listening socket
+  @param[in] count number of requests to answer, then the connection is closed
+
+*/
+void DecoyGateway( SOCKET listener, int count )
+{
+	SOCKET s = accept( listener, 0, 0 );
+	if( s == INVALID_SOCKET )
+		return;
+	for( int k = 0; k < count; k++ ) {
+		unsigned char request[12];
+		if( ! ReceiveAll( s, request, 12 ) )
+			break;
+		int reg_count = request[10] << 8 | request[11];
+		if( reg_count > 125 )
+			break;
+		unsigned char reply[3][260];
+		for( int r = 0; r < 3; r++ ) {
+			memcpy( reply[r], request, 8 );		// transaction ID, protocol ID, unit ID and function code
+			reply[r][4] = ( 3 + 2 * reg_count ) >> 8;
+			reply[r][5] = 0xFF & ( 3 + 2 * reg_count );
+			reply[r][8] = 2 * reg_count;
+			for( int v = 0; v < reg_count; v++ ) {
+				reply[r][9+2*v] = 0;
+				reply[r][10+2*v] = r == 2 ? request[6] : 99;
+			}
+		}
+		reply[0][6]++;		// another station
+		reply[1][7]++;		// another command
+		int length = 9 + 2 * reg_count;
+		bool sent = true;
+		for( int r = 0; r < 3; r++ )
+			sent = sent && send( s, (const char *) reply[r], length, 0 ) == length;
+		if( ! sent )
+			break;
+	}
+	closesocket( s );
+}
+
+/**
+
+  Accept a connection, as a Modbus TCP gateway, and answer read requests
+  too late, with every register holding its own address
+
+  @param[in] listener the listening socket
+  @param[in] stale number of replies to the first request sent 100 msecs apart,
+				all with the wrong transaction ID, 0 to send the first reply's
+				header at once and its PDU 400 msecs later, then answer a
+				second request in full
+
+*/
+void StallingGateway( SOCKET listener, int stale )
+{
+	SOCKET s = accept( listener, 0, 0 );
+	if( s == INVALID_SOCKET )
+		return;
+	int answer = stale ? stale : 2;
+	unsigned char request[12];
+	for( int k = 0; k < answer; k++ ) {
+		if( ( ! stale || k == 0 ) && ! ReceiveAll( s, request, 12 ) )
+			break;
+		int first = request[8] << 8 | request[9];
+		int reg_count = request[10] << 8 | request[11];
+		if( reg_count > 125 )
+			break;
+		unsigned char reply[260];
+		memcpy( reply, request, 8 );		// transaction ID, protocol ID, unit ID and function code
+		reply[4] = ( 3 + 2 * reg_count ) >> 8;
+		reply[5] = 0xFF & ( 3 + 2 * reg_count );
+		reply[8] = 2 * reg_count;
+		for( int r = 0; r < reg_count; r++ ) {
+			reply[9+2*r] = ( first + r ) >> 8;
+			reply[10+2*r] = 0xFF & ( first + r );
+		}
+		int length = 9 + 2 * reg_count;
+		int split = length;
+		if( stale ) {
+			reply[1] += 1 + k;		// another transaction
+			Sleep( 100 );
+		} else if( k == 0 ) {
+			split = 7;
+		}
+		if( send( s, (const char *) reply, split, 0 ) != split )
+			break;
+		if( split < length ) {
+			Sleep( 400 );
+			if( send( s, (const char *) reply + split, length - split, 0 ) != length - split )
+				break;
+		}
+	}
+	closesocket( s );
+}
+
+void TestGateway()
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+#endif
+
+	// a gateway listening on a loopback port chosen by the system
+	char endpoint[ 50 ];
+	SOCKET listener = LoopbackListener( endpoint );
+	if( listener == INVALID_SOCKET ) {
+		printf("Failed TestGateway #1, no loopback socket\n");
+		exit(1);
+	}
+
+	// two connections, each answering the two stations it carries
+	std::vector< int > unit[2];
+	SOCKET connection[2];
+	boost::thread gateway0( boost::bind( &GatewayConnection, listener, 2, &unit[0], &connection[0] ) );
+	boost::thread gateway1( boost::bind( &GatewayConnection, listener, 2, &unit[1], &connection[1] ) );
+
+	raven::farmodbus::port_handle_t port;
+	if( theModbusFarm.AddModbusTCP( port, endpoint, 1, 2 ) != raven::farmodbus::OK ) {
+		printf("Failed TestGateway #2\n");
+		exit(1);
+	}
+	raven::farmodbus::station_handle_t station[4];
+	unsigned short value;
+	for( int k = 0; k < 4; k++ ) {
+		theModbusFarm.Add( station[k], port, k + 1 );
+		theModbusFarm.Query( value, station[k], 0 );
+	}
+	if( ! gateway0.try_join_for( boost::chrono::seconds( 5 ) ) ||
+		! gateway1.try_join_for( boost::chrono::seconds( 5 ) ) ) {
+		printf("Failed TestGateway #3, not polled\n");
+		exit(1);
+	}
+
+	// stations are shared out by unit ID, each to one connection
+	for( int k = 0; k < 2; k++ ) {
+		if( unit[k].size() != 2 ||
+			unit[k][0] == unit[k][1] ||
+			( unit[k][0] & 1 ) != ( unit[k][1] & 1 ) ) {
+			printf("Failed TestGateway #4\n");
+			exit(1);
+		}
+	}
+	if( ( unit[0][0] & 1 ) == ( unit[1][0] & 1 ) ) {
+		printf("Failed TestGateway #4\n");
+		exit(1);
+	}
+
+	// every station was polled through its own connection
+	Sleep( 100 );
+	bool connected;
+	int connects;
+	theModbusFarm.getConnection( connected, connects, port );
+	for( int k = 0; k < 4; k++ ) {
+		if( theModbusFarm.Query( value, station[k], 0 ) != raven::farmodbus::OK ||
+			value != k + 1 ) {
+			printf("Failed TestGateway #5 station %d\n", k + 1 );
+			exit(1);
+		}
+	}
+	if( ! connected || connects != 2 ) {
+		printf("Failed TestGateway #6\n");
+		exit(1);
+	}
+
+	for( int k = 0; k < 2; k++ )
+		closesocket( connection[k] );
+	closesocket( listener );
+}
+
+void TestSegmented()
+{
+	char endpoint[ 50 ];
+	SOCKET listener = LoopbackListener( endpoint );
+	if( listener == INVALID_SOCKET ) {
+		printf("Failed TestSegmented #1, no loopback socket\n");
+		exit(1);
+	}
+	std::string host, service;
+	raven::farmodbus::cPort::ParseEndpoint( endpoint, host, service );
+
+	// Modbus TCP replies arriving in two pieces, split in the header, then in the PDU
+	int split[] = { 3, 9 };
+	for( int s = 0; s < 2; s++ ) {
+		boost::thread device( boost::bind( &SegmentedDevice, listener, true, split[s], 1, 2 ) );
+		raven::farmodbus::cPort port( INVALID_SOCKET, 1 );
+		port.setEndpoint( host, service );
+		for( int k = 0; k < 2; k++ ) {
+			unsigned char pdu[256] = { 3, 0, 20, 0, 2 };
+			int reply_length;
+			if( port.Transaction( 1, pdu, 5, pdu, reply_length, 1000 ) != raven::farmodbus::OK ||
+				reply_length != 6 || pdu[1] != 4 || pdu[3] != 20 || pdu[5] != 21 ) {
+				printf("Failed TestSegmented #2 split %d\n", split[s] );
+				exit(1);
+			}
+		}
+
+		// the connection was kept through both replies
+		if( port.getConnects() != 1 || ! port.IsConnected() ) {
+			printf("Failed TestSegmented #3 split %d\n", split[s] );
+			exit(1);
+		}
+		device.join();
+	}
+
+	// RTU frames over TCP, split before and after the byte count
+	int rtu_split[] = { 2, 5 };
+	for( int s = 0; s < 2; s++ ) {
+		boost::thread device( boost::bind( &SegmentedDevice, listener, false, rtu_split[s], 1, 1 ) );
+		SOCKET connection = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+		sockaddr_in address;
+		memset( &address, 0, sizeof( address ) );
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		address.sin_port = htons( atoi( service.c_str() ) );
+		if( connect( connection, (sockaddr *) &address, sizeof( address ) ) ) {
+			printf("Failed TestSegmented #4\n");
+			exit(1);
+		}
+		raven::farmodbus::cPort port( connection );
+		unsigned char pdu[256] = { 3, 0, 20, 0, 2 };
+		int reply_length;
+		if( port.Transaction( 1, pdu, 5, pdu, reply_length, 1000 ) != raven::farmodbus::OK ||
+			reply_length != 6 || pdu[1] != 4 || pdu[3] != 20 || pdu[5] != 21 ) {
+			printf("Failed TestSegmented #5 split %d\n", rtu_split[s] );
+			exit(1);
+		}
+		device.join();
+		closesocket( connection );
+	}
+	closesocket( listener );
+}
+
+void TestTimeoutMBAP()
+{
+	char endpoint[ 50 ];
+	SOCKET listener = LoopbackListener( endpoint );
+	if( listener == INVALID_SOCKET ) {
+		printf("Failed TestTimeoutMBAP #1, no loopback socket\n");
+		exit(1);
+	}
+	std::string host, service;
+	raven::farmodbus::cPort::ParseEndpoint( endpoint, host, service );
+
+	// replies that do not match the request do not put off the timeout
+	boost::thread stale( boost::bind( &StallingGateway, listener, 10 ) );
+	raven::farmodbus::cPort port( INVALID_SOCKET, 1 );
+	port.setEndpoint( host, service );
+	unsigned char pdu[256] = { 3, 0, 20, 0, 2 };
+	int reply_length;
+	raven::farmodbus::time_point_t start = boost::chrono::steady_clock::now();
+	if( port.Transaction( 1, pdu, 5, pdu, reply_length, 300 ) != raven::farmodbus::timed_out ||
+		boost::chrono::steady_clock::now() - start > boost::chrono::milliseconds( 700 ) ) {
+		printf("Failed TestTimeoutMBAP #2\n");
+		exit(1);
+	}
+	stale.join();
+
+	// a reply whose PDU comes after the timeout is thrown away when it does come,
+	// on a socket supplied by the application, which the port cannot reconnect
+	boost::thread stalling( boost::bind( &StallingGateway, listener, 0 ) );
+	SOCKET connection = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	sockaddr_in address;
+	memset( &address, 0, sizeof( address ) );
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	address.sin_port = htons( atoi( service.c_str() ) );
+	if( connect( connection, (sockaddr *) &address, sizeof( address ) ) ) {
+		printf("Failed TestTimeoutMBAP #3\n");
+		exit(1);
+	}
+	raven::farmodbus::cPort app_port( connection, 1 );
+	unsigned char first[256] = { 3, 0, 20, 0, 2 };
+	if( app_port.Transaction( 1, first, 5, first, reply_length, 200 ) != raven::farmodbus::timed_out ) {
+		printf("Failed TestTimeoutMBAP #4\n");
+		exit(1);
+	}
+	unsigned char second[256] = { 3, 0, 30, 0, 2 };
+	if( app_port.Transaction( 1, second, 5, second, reply_length, 1000 ) != raven::farmodbus::OK ||
+		reply_length != 6 || second[1] != 4 || second[3] != 30 || second[5] != 31 ) {
+		printf("Failed TestTimeoutMBAP #5\n");
+		exit(1);
+	}
+	stalling.join();
+	closesocket( connection );
+	closesocket( listener );
+}
+
+void TestReconnect()
+{
+	// a gateway that closes the connection after each pair of replies
+	char endpoint[ 50 ];
+	SOCKET listener = LoopbackListener( endpoint );
+	if( listener == INVALID_SOCKET ) {
+		printf("Failed TestReconnect #1, no loopback socket\n");
+		exit(1);
+	}
+	boost::thread gateway( boost::bind( &SegmentedDevice, listener, true, 9, 2, 2 ) );
+
+	raven::farmodbus::port_handle_t port;
+	raven::farmodbus::station_handle_t station;
+	unsigned short value;
+	if( theModbusFarm.AddModbusTCP( port, endpoint, 1, 1 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( station, port, 1 ) != raven::farmodbus::OK ) {
+		printf("Failed TestReconnect #2\n");
+		exit(1);
+	}
+	theModbusFarm.Query( value, station, 7 );
+
+	// the port connects again, and polls on the new connection
+	if( ! gateway.try_join_for( boost::chrono::seconds( 5 ) ) ) {
+		printf("Failed TestReconnect #3, not polled after the connection closed\n");
+		exit(1);
+	}
+	bool connected;
+	int connects;
+	theModbusFarm.getConnection( connected, connects, port );
+	if( connects < 2 ) {
+		printf("Failed TestReconnect #4\n");
+		exit(1);
+	}
+	closesocket( listener );
+}
+
+void TestPipelined()
+{
+	// replies that match a request's transaction ID, but not its station or command, are discarded
+	char endpoint[ 50 ];
+	SOCKET listener = LoopbackListener( endpoint );
+	if( listener == INVALID_SOCKET ) {
+		printf("Failed TestPipelined #1, no loopback socket\n");
+		exit(1);
+	}
+	boost::thread decoy( boost::bind( &DecoyGateway, listener, 1 ) );
+	std::string host, service;
+	raven::farmodbus::cPort::ParseEndpoint( endpoint, host, service );
+	raven::farmodbus::cPort decoy_port( INVALID_SOCKET, 1 );
+	decoy_port.setEndpoint( host, service );
+	unsigned char pdu[256] = { 3, 0, 0, 0, 2 };
+	int reply_length;
+	if( decoy_port.Transaction( 7, pdu, 5, pdu, reply_length, 1000 ) != raven::farmodbus::OK ||
+		reply_length != 6 || pdu[0] != 3 || pdu[3] != 7 || pdu[5] != 7 ) {
+		printf("Failed TestPipelined #2\n");
+		exit(1);
+	}
+	decoy.join();
+
+	// and by the polling thread, with two requests in flight
+	boost::thread decoy2( boost::bind( &DecoyGateway, listener, 4 ) );
+	raven::farmodbus::port_handle_t port;
+	raven::farmodbus::station_handle_t station[2];
+	unsigned short value;
+	if( theModbusFarm.AddModbusTCP( port, endpoint, 2, 1 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( station[0], port, 1 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( station[1], port, 2 ) != raven::farmodbus::OK ) {
+		printf("Failed TestPipelined #3\n");
+		exit(1);
+	}
+	theModbusFarm.Query( value, station[0], 0 );
+	theModbusFarm.Query( value, station[1], 0 );
+	if( ! decoy2.try_join_for( boost::chrono::seconds( 5 ) ) ) {
+		printf("Failed TestPipelined #4, not polled\n");
+		exit(1);
+	}
+	for( int k = 0; k < 2; k++ ) {
+		if( theModbusFarm.Query( value, station[k], 0 ) != raven::farmodbus::OK ||
+			value != k + 1 ) {
+			printf("Failed TestPipelined #5 station %d\n", k + 1 );
+			exit(1);
+		}
+	}
+	closesocket( listener );
+
+	// simulated stations replying out of order, one of them too late
+	raven::farmodbus::cFarmodbusConfig config;
+	config.Set("T3000");
+	config.TimeoutCeiling = 300;
+	theModbusFarm.Set( config );
+	raven::simodbus::cSimBus * bus = new raven::simodbus::cSimBus();
+	raven::simodbus::cLatency latency;
+	latency.Parse( "uniform:1:30" );
+	for( int k = 1; k <= 9; k++ ) {
+		raven::simodbus::cSimStation * sim = new raven::simodbus::cSimStation( k );
+		sim->Map( 0, 10 );
+		unsigned char write[] = { 6, 0, 0, 0, (unsigned char) k };
+		unsigned char reply[256];
+		int delay;
+		sim->Answer( write, 5, reply, delay );
+		if( k == 9 )
+			latency.Parse( "fixed:1000" );
+		sim->setLatency( latency );
+		bus->Add( sim );
+	}
+	char sim_endpoint[ 50 ];
+	sprintf( sim_endpoint, "127.0.0.1:%d", bus->ServeTCP( 0, true ) );
+	raven::farmodbus::station_handle_t sim_station[9];
+	if( theModbusFarm.AddModbusTCP( port, sim_endpoint, 4, 1 ) != raven::farmodbus::OK ) {
+		printf("Failed TestPipelined #6\n");
+		exit(1);
+	}
+	for( int k = 0; k < 9; k++ ) {
+		theModbusFarm.Add( sim_station[k], port, k + 1 );
+		theModbusFarm.SetPollPeriod( sim_station[k], 10 );
+		theModbusFarm.Query( value, sim_station[k], 0 );
+	}
+	config.TimeoutCeiling = 6000;
+	theModbusFarm.Set( config );
+	Sleep( 1500 );
+	for( int k = 0; k < 8; k++ ) {
+		if( theModbusFarm.Query( value, sim_station[k], 0 ) != raven::farmodbus::OK ||
+			value != k + 1 ) {
+			printf("Failed TestPipelined #7 station %d\n", k + 1 );
+			exit(1);
+		}
+	}
+	raven::farmodbus::cMetricsSnapshot M;
+	theModbusFarm.getStationMetrics( M, sim_station[8] );
+	if( M.timeouts < 1 ) {
+		printf("Failed TestPipelined #8\n");
+		exit(1);
+	}
+}
+
+void TestReconfigure()
+{
+	// a simulated station polled for its holding registers
+	raven::farmodbus::cFarmodbusConfig config;
+	config.Set("T3000");
+	theModbusFarm.Set( config );
+	raven::simodbus::cSimBus * bus = new raven::simodbus::cSimBus();
+	raven::simodbus::cSimStation * sim = new raven::simodbus::cSimStation( 1 );
+	sim->Map( 0, 10 );
+	bus->Add( sim );
+	char endpoint[ 50 ];
+	sprintf( endpoint, "127.0.0.1:%d", bus->ServeTCP( 0, true ) );
+	raven::farmodbus::port_handle_t port;
+	raven::farmodbus::station_handle_t station;
+	unsigned short value;
+	if( theModbusFarm.AddModbusTCP( port, endpoint, 1, 1 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( station, port, 1 ) != raven::farmodbus::OK ) {
+		printf("Failed TestReconfigure #1\n");
+		exit(1);
+	}
+	theModbusFarm.SetPollPeriod( station, 10 );
+	theModbusFarm.Query( value, station, 0 );
+	Sleep( 300 );
+	if( theModbusFarm.Query( value, station, 0 ) != raven::farmodbus::OK ) {
+		printf("Failed TestReconfigure #2\n");
+		exit(1);
+	}
+
+	// then for its input registers, which needs new request frames
+	config.ModbusReadCommand = 4;
+	theModbusFarm.Set( config );
+	Sleep( 300 );
+	if( theModbusFarm.Query( value, station, 0 ) != raven::farmodbus::OK ) {
+		printf("Failed TestReconfigure #3\n");
+		exit(1);
+	}
+}
+
+#ifndef _WIN32
+/**
+
+  Answer RTU read requests on the master side of a pseudo terminal,
+  with every register holding its own address
+
+  @param[in] master the pseudo terminal master
+  @param[in] count number of requests to answer
+
+*/
+void PtyDevice( int master, int count )
+{
+	for( int k = 0; k < count; k++ ) {
+		unsigned char request[8];
+		int have = 0;
+		while( have < 8 ) {
+			int n = read( master, request + have, 8 - have );
+			if( n <= 0 )
+				return;
+			have += n;
+		}
+		int first = request[2] << 8 | request[3];
+		int reg_count = request[4] << 8 | request[5];
+		unsigned char reply[256];
+		reply[0] = request[0];
+		reply[1] = request[1];
+		reply[2] = 2 * reg_count;
+		for( int r = 0; r < reg_count; r++ ) {
+			reply[3+2*r] = ( first + r ) >> 8;
+			reply[4+2*r] = 0xFF & ( first + r );
+		}
+		int length = 3 + 2 * reg_count;
+		unsigned short crc = raven::farmodbus::cPort::CyclicalRedundancyCheck( reply, length );
+		reply[length++] = crc >> 8;
+		reply[length++] = 0xFF & crc;
+		if( write( master, reply, length ) != length )
+			return;
+	}
+}
+
+void TestSerialPosix()
+{
+	// a pseudo terminal pair, the port on the slave side, a device on the master side
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( master < 0 || grantpt( master ) || unlockpt( master ) ) {
+		printf("Failed TestSerialPosix #1, no pseudo terminal\n");
+		exit(1);
+	}
+	raven::farmodbus::cSerialPosix serial;
+	if( serial.Open( ptsname( master ), 12345 ) || serial.IsOpened() ) {
+		printf("Failed TestSerialPosix #2\n");
+		exit(1);
+	}
+	if( ! serial.Open( ptsname( master ), 19200, 'E' ) || serial.getBaud() != 19200 ) {
+		printf("Failed TestSerialPosix #3\n");
+		exit(1);
+	}
+
+	// bytes written by the device are read whole, in pieces, and no more
+	unsigned char msg[] = { 1, 2, 3, 4, 5 };
+	unsigned char buf[8];
+	if( write( master, msg, 5 ) != 5 ||
+		! serial.WaitForData( 5, 1000 ) ||
+		serial.ReadData( buf, 3 ) != 3 ||
+		serial.ReadData( buf + 3, 8 ) != 2 ||
+		memcmp( buf, msg, 5 ) ||
+		serial.WaitForData( 1, 10 ) ) {
+		printf("Failed TestSerialPosix #4\n");
+		exit(1);
+	}
+
+	// bytes sent arrive at the device unchanged
+	if( serial.SendData( msg, 5 ) != 5 ||
+		read( master, buf, 8 ) != 5 ||
+		memcmp( buf, msg, 5 ) ) {
+		printf("Failed TestSerialPosix #5\n");
+		exit(1);
+	}
+
+	// a read transaction through a port
+	raven::farmodbus::cPort port( serial, 19200 );
+	boost::thread device( boost::bind( &PtyDevice, master, 1 ) );
+	unsigned char pdu[256] = { 4, 0, 10, 0, 3 };
+	int reply_length;
+	raven::farmodbus::error err = port.Transaction( 1, pdu, 5, pdu, reply_length, 1000 );
+	device.join();
+	if( err != raven::farmodbus::OK ||
+		reply_length != 8 ||
+		pdu[0] != 4 || pdu[1] != 6 ||
+		pdu[2] != 0 || pdu[3] != 10 || pdu[7] != 12 ) {
+		printf("Failed TestSerialPosix #6 error %d\n", err );
+		exit(1);
+	}
+
+	serial.Close();
+	close( master );
+}
+#endif
+
+void TestSimulator()
+{
+	// a station with two blocks of registers
+	raven::simodbus::cSimStation * station = new raven::simodbus::cSimStation( 5 );
+	station->Map( 0, 10 );
+	station->Map( 100, 10 );
+	unsigned char reply[256];
+	int delay;
+	unsigned char read[] = { 4, 0, 8, 0, 2 };
+	if( station->Answer( read, 5, reply, delay ) != 6 ||
+		reply[0] != 4 || reply[1] != 4 || reply[3] != 8 || reply[5] != 9 || delay != 0 ) {
+		printf("Failed TestSimulator #1\n");
+		exit(1);
+	}
+	unsigned char outside[] = { 4, 0, 8, 0, 3 };
+	if( station->Answer( outside, 5, reply, delay ) != 2 ||
+		reply[0] != 0x84 || reply[1] != 2 ) {
+		printf("Failed TestSimulator #2\n");
+		exit(1);
+	}
+	unsigned char write[] = { 16, 0, 101, 0, 2, 4, 0x12, 0x34, 0, 7 };
+	unsigned short value;
+	if( station->Answer( write, 10, reply, delay ) != 5 ||
+		reply[0] != 16 || reply[4] != 2 ||
+		! station->getValue( value, 102 ) || value != 7 ) {
+		printf("Failed TestSimulator #3\n");
+		exit(1);
+	}
+	std::vector< int > functions( 1, 4 );
+	station->setFunctions( functions );
+	if( station->Answer( write, 10, reply, delay ) != 2 ||
+		reply[0] != 0x90 || reply[1] != 1 ) {
+		printf("Failed TestSimulator #4\n");
+		exit(1);
+	}
+
+	// reply times
+	raven::simodbus::cLatency latency;
+	if( ! latency.Parse( "uniform:2:3" ) || latency.Parse( "uniform:3:2" ) || latency.Parse( "slow" ) ) {
+		printf("Failed TestSimulator #5\n");
+		exit(1);
+	}
+	for( int k = 0; k < 100; k++ ) {
+		int usec = latency.Draw();
+		if( usec < 2000 || usec > 3000 ) {
+			printf("Failed TestSimulator #6\n");
+			exit(1);
+		}
+	}
+
+	// a read through a Modbus TCP port, from a bus on a loopback port
+	raven::simodbus::cSimBus * bus = new raven::simodbus::cSimBus();
+	bus->Add( station );
+	int tcp_port = bus->ServeTCP( 0, true );
+	char service[ 10 ];
+	sprintf( service, "%d", tcp_port );
+	raven::farmodbus::cPort port( INVALID_SOCKET, 4 );
+	port.setEndpoint( "127.0.0.1", service );
+	unsigned char pdu[256] = { 4, 0, 100, 0, 3 };
+	int reply_length;
+	if( ! tcp_port ||
+		port.Transaction( 5, pdu, 5, pdu, reply_length, 1000 ) != raven::farmodbus::OK ||
+		reply_length != 8 || pdu[3] != 100 || pdu[5] != 0x34 || pdu[7] != 7 ) {
+		printf("Failed TestSimulator #7\n");
+		exit(1);
+	}
+
+#ifndef _WIN32
+	// the same read through a serial port, from the bus on a pseudo terminal
+	std::string path = bus->ServePty();
+	raven::farmodbus::cSerialPosix serial;
+	if( path.empty() || ! serial.Open( path.c_str(), 115200 ) ) {
+		printf("Failed TestSimulator #8, no pseudo terminal\n");
+		exit(1);
+	}
+	raven::farmodbus::cPort serial_port( serial, 115200 );
+	unsigned char pdu2[256] = { 4, 0, 100, 0, 3 };
+	if( serial_port.Transaction( 5, pdu2, 5, pdu2, reply_length, 1000 ) != raven::farmodbus::OK ||
+		reply_length != 8 || memcmp( pdu, pdu2, 8 ) ) {
+		printf("Failed TestSimulator #9\n");
+		exit(1);
+	}
+	serial.Close();
+#endif
+
+	long long answered, dropped;
+	bus->getCount( answered, dropped );
+	if( answered < 2 || dropped ) {
+		printf("Failed TestSimulator #10\n");
+		exit(1);
+	}
+}
+
+	// changes reported to TestNotify
+	std::vector< raven::farmodbus::cChange > theChanges;
+	boost::mutex theChangesMutex;
+
+void TestMetrics()
+{
+	// histogram buckets and percentiles
+	raven::farmodbus::cHistogram histogram;
+	histogram.Add( 10 );
+	histogram.Add( 50 );
+	histogram.Add( 51 );
+	histogram.Add( 3000 );
+	histogram.Add( 20000000 );
+	raven::farmodbus::cHistogramSnapshot H;
+	histogram.Get( H );
+	if( H.Total() != 5 || H.count[0] != 2 || H.count[1] != 1 ||
+		H.count[ raven::farmodbus::cHistogram::bucket_count - 1 ] != 1 ||
+		H.sum != 20003111 ||
+		H.Percentile( 0.4 ) != 50 || H.Percentile( 0.5 ) != 100 ||
+		H.Percentile( 0.8 ) != 5000 || H.Percentile( 1 ) != -1 ) {
+		printf("Failed TestMetrics #1\n");
+		exit(1);
+	}
+
+	// two stations polled over RTU through a loopback port,
+	// one of them answering the polls with an exception
+	raven::simodbus::cSimBus * bus = new raven::simodbus::cSimBus();
+	raven::simodbus::cSimStation * sim = new raven::simodbus::cSimStation( 5 );
+	sim->Map( 0, 10 );
+	bus->Add( sim );
+	sim = new raven::simodbus::cSimStation( 7 );
+	sim->Map( 0, 10 );
+	sim->setFunctions( std::vector< int >( 1, 16 ) );
+	bus->Add( sim );
+	char service[ 10 ];
+	sprintf( service, "%d", bus->ServeTCP( 0, false ) );
+	raven::farmodbus::cPort port( INVALID_SOCKET );
+	port.setEndpoint( "127.0.0.1", service );
+	raven::farmodbus::cStation station5( 5, port );
+	raven::farmodbus::cStation station7( 7, port );
+	unsigned short value[2];
+	station5.Query( value, 0, 2 );
+	station5.setPeriod( 1 );
+	station7.Query( value, 0, 2 );
+	station5.Poll();
+	Sleep( 5 );
+	station5.Poll();
+	station7.Poll();
+	station7.Measure( raven::farmodbus::timed_out, boost::chrono::steady_clock::now(), 5, 0, 0 );
+	station7.Measure( raven::farmodbus::crc_error, boost::chrono::steady_clock::now(), 5, 0, 0 );
+
+	raven::farmodbus::cMetricsSnapshot M;
+	station5.getMetrics().Get( M );
+	if( M.requests != 2 || M.replies != 2 || M.exceptions != 0 || M.timeouts != 0 ||
+		M.bytes_out != 10 || M.bytes_in != 12 ||
+		M.rtt.Total() != 2 || M.period.Total() != 1 || M.period.Percentile( 1 ) < 5000 ) {
+		printf("Failed TestMetrics #2\n");
+		exit(1);
+	}
+	station7.getMetrics().Get( M );
+	if( M.requests != 3 || M.replies != 1 || M.exceptions != 1 ||
+		M.timeouts != 1 || M.crc_errors != 1 ||
+		M.bytes_in != 2 || M.rtt.Total() != 2 || M.period.Total() != 0 ) {
+		printf("Failed TestMetrics #3\n");
+		exit(1);
+	}
+
+	// the port adds up its stations, and counts the bytes on the line, frames with address and CRC
+	port.getMetrics().Get( M );
+	if( M.requests != 5 || M.replies != 3 || M.exceptions != 1 ||
+		M.timeouts != 1 || M.crc_errors != 1 ||
+		M.bytes_out != 3 * 8 || M.bytes_in != 2 * 9 + 5 ||
+		M.rtt.Total() != 4 || M.period.Total() != 1 ) {
+		printf("Failed TestMetrics #4\n");
+		exit(1);
+	}
+
+	// the farm's ports and stations, as text
+	std::string text;
+	if( theModbusFarm.getMetricsText( text ) != raven::farmodbus::OK ||
+		text.find( "# TYPE farmodbus_requests_total counter\n" ) == std::string::npos ||
+		text.find( "farmodbus_requests_total{port=\"0\"} " ) == std::string::npos ||
+		text.find( "farmodbus_timeouts_total{port=\"0\",station=\"0\",address=\"1\"} " ) == std::string::npos ||
+		text.find( "farmodbus_rtt_usec_bucket{port=\"0\",le=\"+Inf\"} " ) == std::string::npos ||
+		text.find( "farmodbus_busy_usec_total{port=\"0\",station" ) != std::string::npos ) {
+		printf("Failed TestMetrics #5\n");
+		exit(1);
+	}
+	if( theModbusFarm.getPortMetrics( M, 1000 ) != raven::farmodbus::bad_port_handle ||
+		theModbusFarm.getStationMetrics( M, -1 ) != raven::farmodbus::bad_station_handle ) {
+		printf("Failed TestMetrics #6\n");
+		exit(1);
+	}
+}
+
+void TestNotify( const std::vector< raven::farmodbus::cChange >& changes )
+{
+	boost::mutex::scoped_lock lock( theChangesMutex );
+	theChanges.insert( theChanges.end(), changes.begin(), changes.end() );
+}
+
+/**
+
+  Wait for the notification thread to report a number of changes
+
+  @return true if exactly that many changes have been reported
+
+*/
+bool WaitForChanges( unsigned int count )
+{
+	for( int k = 0; k < 100; k++ ) {
+		{
+			boost::mutex::scoped_lock lock( theChangesMutex );
+			if( theChanges.size() >= count )
+				return theChanges.size() == count;
+		}
+		Sleep( 10 );
+	}
+	return false;
+}
+
+void TestSubscribe()
+{
+	// construct a test station
+	// ( production code should NOT do this! )
+	raven::farmodbus::cPort port( 0 );
+	raven::farmodbus::cStation station( 1, port );
+
+	station.Subscribe( 0, 100, 2, 5, raven::farmodbus::notify_t( &TestNotify ) );
+	std::vector< raven::farmodbus::cPollRange > due;
+	station.Due( due, boost::chrono::steady_clock::now() );
+	unsigned char pdu[256];
+	station.ReadRequest( pdu, due[0] );
+
+	// the first values read are always reported
+	unsigned char reply[] = { pdu[0], 4, 0, 100, 0, 200 };
+	station.Decode( reply, 6, due[0] );
+	if( ! WaitForChanges( 2 ) || theChanges[0].reg != 100 || theChanges[0].value != 100 ) {
+		printf("Failed TestSubscribe #1\n");
+		exit(1);
+	}
+
+	// changes within the deadband are not reported
+	reply[3] = 104;
+	reply[5] = 210;
+	station.Decode( reply, 6, due[0] );
+	if( ! WaitForChanges( 3 ) || theChanges[2].reg != 101 ||
+		theChanges[2].value != 210 || theChanges[2].previous != 200 ) {
+		printf("Failed TestSubscribe #2\n");
+		exit(1);
+	}
+
+	// drift is measured from the value last reported
+	reply[3] = 106;
+	station.Decode( reply, 6, due[0] );
+	if( ! WaitForChanges( 4 ) || theChanges[3].value != 106 || theChanges[3].previous != 100 ) {
+		printf("Failed TestSubscribe #3\n");
+		exit(1);
+	}
+
+	// nothing after unsubscribing
+	station.Unsubscribe( 0 );
+	reply[3] = 200;
+	station.Decode( reply, 6, due[0] );
+	Sleep( 50 );
+	if( ! WaitForChanges( 4 ) ) {
+		printf("Failed TestSubscribe #4\n");
+		exit(1);
+	}
+}
+
+	// results passed to CountCompletion
+	boost::atomic< int > theCompletions( 0 );
+	boost::atomic< int > theCompletionError( raven::farmodbus::OK );
+
+void CountCompletion( const raven::farmodbus::cResult& result )
+{
+	theCompletionError = result.err;
+	theCompletions++;
+}
+
+/**
+
+  Wait for the completion callbacks to be called a number of times
+
+  @return true if they have been called exactly that many times,
+  and no more in the next 100 msecs
+
+*/
+bool WaitForCompletions( int count )
+{
+	for( int k = 0; k < 500 && theCompletions < count; k++ )
+		Sleep( 10 );
+	Sleep( 100 );
+	return theCompletions == count;
+}
+
+void TestCompletion()
+{
+	// a short write queue, and a short wait for stations that do not reply
+	raven::farmodbus::cFarmodbusConfig config;
+	config.Set("T3000");
+	config.WriteQueueLength = 4;
+	config.TimeoutCeiling = 1000;
+	theModbusFarm.Set( config );
+
+	// a simulated gateway, with a quick station, a slow one, and one that never replies
+	raven::simodbus::cSimBus * bus = new raven::simodbus::cSimBus();
+	raven::simodbus::cSimStation * sim = new raven::simodbus::cSimStation( 9 );
+	sim->Map( 0, 20 );
+	bus->Add( sim );
+	raven::simodbus::cSimStation * slow = new raven::simodbus::cSimStation( 10 );
+	slow->Map( 0, 20 );
+	raven::simodbus::cLatency latency;
+	latency.Parse( "fixed:100" );
+	slow->setLatency( latency );
+	bus->Add( slow );
+	raven::simodbus::cSimStation * dead = new raven::simodbus::cSimStation( 11 );
+	dead->Map( 0, 20 );
+	dead->setDrop( 1 );
+	bus->Add( dead );
+	char endpoint[ 50 ];
+	sprintf( endpoint, "127.0.0.1:%d", bus->ServeTCP( 0, true ) );
+	raven::farmodbus::port_handle_t port;
+	raven::farmodbus::station_handle_t station, slow_station, dead_station;
+	if( theModbusFarm.AddModbusTCP( port, endpoint, 1, 1 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( station, port, 9 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( slow_station, port, 10 ) != raven::farmodbus::OK ||
+		theModbusFarm.Add( dead_station, port, 11 ) != raven::farmodbus::OK ) {
+		printf("Failed TestCompletion #1\n");
+		exit(1);
+	}
+	config.Set("T3000");
+	config.WriteQueueLength = 256;
+	config.TimeoutCeiling = 6000;
+	theModbusFarm.Set( config );
+
+	// futures become ready with the result
+	unsigned short v[] = { 100, 101 };
+	boost::shared_future< raven::farmodbus::cResult > write =
+		theModbusFarm.WriteAsync( station, 3, 2, v );
+	unsigned short value;
+	if( ! write.timed_wait( boost::posix_time::seconds( 5 ) ) ||
+		write.get().err != raven::farmodbus::OK ||
+		! write.get().value.empty() ||
+		! sim->getValue( value, 4 ) || value != 101 ) {
+		printf("Failed TestCompletion #2\n");
+		exit(1);
+	}
+	boost::shared_future< raven::farmodbus::cResult > read =
+		theModbusFarm.ReadAsync( station, 3, 3 );
+	if( ! read.timed_wait( boost::posix_time::seconds( 5 ) ) ||
+		read.get().err != raven::farmodbus::OK ||
+		read.get().value.size() != 3 ||
+		read.get().value[0] != 100 || read.get().value[1] != 101 || read.get().value[2] != 5 ) {
+		printf("Failed TestCompletion #3\n");
+		exit(1);
+	}
+	if( theModbusFarm.ReadAsync( station, 0, 200 ).get().err != raven::farmodbus::bad_register_address ) {
+		printf("Failed TestCompletion #4\n");
+		exit(1);
+	}
+
+	// callbacks are called once
+	if( theModbusFarm.Write( station, 6, 1, v, &CountCompletion ) != raven::farmodbus::OK ||
+		theModbusFarm.Read( station, 6, 1, &CountCompletion ) != raven::farmodbus::OK ||
+		! WaitForCompletions( 2 ) ||
+		theCompletionError != raven::farmodbus::OK ) {
+		printf("Failed TestCompletion #5\n");
+		exit(1);
+	}
+
+	// and once when the station does not reply
+	theCompletions = 0;
+	read = theModbusFarm.ReadAsync( dead_station, 0, 1 );
+	if( theModbusFarm.Write( dead_station, 0, 1, v, &CountCompletion ) != raven::farmodbus::OK ||
+		! read.timed_wait( boost::posix_time::seconds( 5 ) ) ||
+		read.get().err != raven::farmodbus::timed_out ||
+		! WaitForCompletions( 1 ) ||
+		theCompletionError != raven::farmodbus::timed_out ) {
+		printf("Failed TestCompletion #6\n");
+		exit(1);
+	}
+
+	// while the slow station holds up the port the queue fills,
+	// and a request refused is never completed
+	theCompletions = 0;
+	int queued = 0;
+	raven::farmodbus::error err = raven::farmodbus::OK;
+	for( int k = 0; k < 20 && err == raven::farmodbus::OK; k++ ) {
+		err = theModbusFarm.Write( slow_station, k, 1, v, &CountCompletion );
+		if( err == raven::farmodbus::OK )
+			queued++;
+	}
+	if( err != raven::farmodbus::write_queue_full ||
+		! WaitForCompletions( queued ) ||
+		theCompletionError != raven::farmodbus::OK ) {
+		printf("Failed TestCompletion #7\n");
+		exit(1);
+	}
+
+	// a future for a request refused is ready at once
+	std::vector< boost::shared_future< raven::farmodbus::cResult > > pending;
+	bool refused = false;
+	for( int k = 0; k < 20 && ! refused; k++ ) {
+		boost::shared_future< raven::farmodbus::cResult > f =
+			theModbusFarm.WriteAsync( slow_station, k, 1, v );
+		if( f.is_ready() && f.get().err == raven::farmodbus::write_queue_full )
+			refused = true;
+		else
+			pending.push_back( f );
+	}
+	if( ! refused ) {
+		printf("Failed TestCompletion #8\n");
+		exit(1);
+	}
+	foreach( boost::shared_future< raven::farmodbus::cResult >& f, pending ) {
+		if( ! f.timed_wait( boost::posix_time::seconds( 5 ) ) ||
+			f.get().err != raven::farmodbus::OK ) {
+			printf("Failed TestCompletion #9\n");
+			exit(1);
+		}
+	}
+}
+
+/// Number of registers in each write pushed by QueueProducer
+int QueueWriteLength( int k )
+{
+	return k % 3 ? 1 + k % 5 : 300;
+}
+
+/**
+
+  Push writes into a queue, as an application thread would,
+  trying again while the queue is full
+
+  @param[in] queue the write queue
+  @param[in] producer the station handle of every write, to tell the producers apart
+  @param[in] count number of writes
+
+  Write k is to registers from 1000, holding k, k + 1, ...
+
+*/
+void QueueProducer( raven::farmodbus::cWriteQueue* queue, int producer, int count )
+{
+	unsigned short v[300];
+	for( int k = 0; k < count; k++ ) {
+		for( int r = 0; r < QueueWriteLength( k ); r++ )
+			v[r] = 0xFFFF & ( k + r );
+		while( ! queue->Push( producer, 1000, QueueWriteLength( k ), v ) )
+			boost::this_thread::yield();
+	}
+}
+
+void TestWriteQueue()
+{
+	// a write too long for one command is queued whole or not at all
+	raven::farmodbus::cWriteQueue small( 4 );
+	unsigned short v[300];
+	for( int r = 0; r < 300; r++ )
+		v[r] = r;
+	if( ! small.Push( 0, 1, 1, v ) || ! small.Push( 0, 2, 1, v ) ||
+		small.Push( 0, 1000, 300, v ) ||
+		small.Front()->getFirstReg() != 1 ) {
+		printf("Failed TestWriteQueue #1\n");
+		exit(1);
+	}
+	small.Pop();
+	if( ! small.Push( 0, 1000, 300, v ) ) {
+		printf("Failed TestWriteQueue #2\n");
+		exit(1);
+	}
+	int first[] = { 2, 1000, 1123, 1246 };
+	int count[] = { 1, 123, 123, 54 };
+	int last[] = { 0, 122, 245, 299 };
+	for( int k = 0; k < 4; k++ ) {
+		raven::farmodbus::cWriteWaiting * W = small.Front();
+		if( ! W || W->getFirstReg() != first[k] || W->getCount() != count[k] ||
+			W->getValue( count[k] - 1 ) != last[k] ) {
+			printf("Failed TestWriteQueue #3\n");
+			exit(1);
+		}
+		small.Pop();
+	}
+	if( ! small.Empty() || small.Push( 0, 0, 600, v ) ) {
+		printf("Failed TestWriteQueue #4\n");
+		exit(1);
+	}
+
+	// several producers pushing while the consumer pops:
+	// every write arrives once, in the order of its producer,
+	// with the commands of a split write together
+	const int producers = 4;
+	const int writes = 2000;
+	raven::farmodbus::cWriteQueue queue( 8 );
+	boost::thread_group g;
+	for( int p = 0; p < producers; p++ )
+		g.create_thread( boost::bind( &QueueProducer, &queue, p, writes ) );
+	int next[ producers ] = { 0 };		// next write expected from each producer
+	int offset[ producers ] = { 0 };	// registers of that write already popped
+	int inside = -1;					// producer whose split write is part way through
+	int done = 0;
+	boost::chrono::steady_clock::time_point deadline =
+		boost::chrono::steady_clock::now() + boost::chrono::seconds( 20 );
+	while( done < producers * writes ) {
+		raven::farmodbus::cWriteWaiting * W = queue.Front();
+		if( ! W ) {
+			if( boost::chrono::steady_clock::now() > deadline ) {
+				printf("Failed TestWriteQueue #5, writes lost\n");
+				exit(1);
+			}
+			boost::this_thread::yield();
+			continue;
+		}
+		int p = W->getStation();
+		if( p < 0 || p >= producers || ( inside >= 0 && p != inside ) ) {
+			printf("Failed TestWriteQueue #6\n");
+			exit(1);
+		}
+		int k = next[p];
+		int expected = QueueWriteLength( k ) - offset[p];
+		if( expected > raven::farmodbus::cWriteWaiting::max_count )
+			expected = raven::farmodbus::cWriteWaiting::max_count;
+		if( k >= writes ||
+			W->getFirstReg() != 1000 + offset[p] ||
+			W->getCount() != expected ) {
+			printf("Failed TestWriteQueue #7\n");
+			exit(1);
+		}
+		for( int r = 0; r < W->getCount(); r++ ) {
+			if( W->getValue( r ) != ( 0xFFFF & ( k + offset[p] + r ) ) ) {
+				printf("Failed TestWriteQueue #8\n");
+				exit(1);
+			}
+		}
+		queue.Pop();
+		offset[p] += expected;
+		inside = p;
+		if( offset[p] == QueueWriteLength( k ) ) {
+			next[p]++;
+			offset[p] = 0;
+			inside = -1;
+			done++;
+		}
+	}
+	g.join_all();
+	if( ! queue.Empty() ) {
+		printf("Failed TestWriteQueue #9\n");
+		exit(1);
+	}
+}
+
+void TestWriteMerge()
+{
+	unsigned short v[] = { 10, 11, 12, 13, 14 };
+
+	// adjacent writes merge
+	raven::farmodbus::cWriteWaiting W( 0, 10, 2, v );
+	if( ! W.Merge( raven::farmodbus::cWriteWaiting( 0, 12, 3, v + 2 ) ) ||
+		W.getFirstReg() != 10 || W.getCount() != 5 || W.getValue( 4 ) != 14 ) {
+		printf("Failed TestWriteMerge #1\n");
+		exit(1);
+	}
+
+	// overlapping writes merge, later value wins
+	unsigned short later = 99;
+	if( ! W.Merge( raven::farmodbus::cWriteWaiting( 0, 9, 2, v ) ) ||
+		W.getFirstReg() != 9 || W.getCount() != 6 || W.getValue( 1 ) != 11 ) {
+		printf("Failed TestWriteMerge #2\n");
+		exit(1);
+	}
+	if( ! W.Merge( raven::farmodbus::cWriteWaiting( 0, 12, 1, &later ) ) ||
+		W.getCount() != 6 || W.getValue( 3 ) != 99 ) {
+		printf("Failed TestWriteMerge #3\n");
+		exit(1);
+	}
+
+	// no merge across a gap, or with another station
+	if( W.Merge( raven::farmodbus::cWriteWaiting( 0, 20, 1, v ) ) ||
+		W.Merge( raven::farmodbus::cWriteWaiting( 1, 15, 1, v ) ) ) {
+		printf("Failed TestWriteMerge #4\n");
+		exit(1);
+	}
+
+	// merged write keeps the earlier queued time, for the latency measurement
+	raven::farmodbus::cWriteWaiting earlier( 0, 30, 1, v );
+	Sleep( 2 );
+	raven::farmodbus::cWriteWaiting W2( 0, 31, 1, v );
+	if( ! W2.Merge( earlier ) || W2.getQueued() != earlier.getQueued() ) {
+		printf("Failed TestWriteMerge #5\n");
+		exit(1);
+	}
+
+	// writes with a completion callback report their own command, so never merge
+	raven::farmodbus::cWriteWaiting callback( 0, 32, 1, v,
+		raven::farmodbus::completion_t( &CountCompletion ) );
+	if( W2.Merge( callback ) || callback.Merge( W2 ) ) {
+		printf("Failed TestWriteMerge #6\n");
+		exit(1);
+	}
 }
 
 void ReaderThread()
@@ -187,7 +1782,11 @@ int _tmain(int argc, _TCHAR* argv[])
 	}
 
 	// open the port
+#ifdef _WIN32
 	char * portsz = "COM4";
+#else
+	const char * portsz = "/dev/ttyUSB0";
+#endif
 	theCOM.Open( portsz );
 	std::wstring port_config_text;
 	theCOM.getConfig(port_config_text);
@@ -248,6 +1847,14 @@ int _tmain(int argc, _TCHAR* argv[])
 		Sleep(1000);
 	}
 
+	// polling through a gateway, and the metrics, before a second farm stops the first
+	TestGateway();
+	TestReconnect();
+	TestPipelined();
+	TestCompletion();
+	TestMetrics();
+	TestReconfigure();
+
 	raven::farmodbus::cFarmodbus ModbusFarm2;
 	if( ModbusFarm2.Query( value, 1, 1 ) != raven::farmodbus::not_singleton ) {
 		printf("ERROR: Failed to enforce singleton\n");
@@ -258,6 +1865,18 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	// station unit tests
 	TestStation();
+	TestWriteMerge();
+	TestWriteQueue();
+	TestSubscribe();
+	TestCRC();
+	TestReplyLength();
+	TestEndpoint();
+	TestSimulator();
+	TestSegmented();
+	TestTimeoutMBAP();
+#ifndef _WIN32
+	TestSerialPosix();
+#endif
 
 
 
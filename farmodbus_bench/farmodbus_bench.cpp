@@ -0,0 +1,453 @@
+// farmodbus_bench.cpp : Modbus farm benchmarks
+//
+// These exercise the farm's internals directly, without any devices,
+// so that the results measure the farm code and not the wire.
+
+#include "stdafx.h"
+#include "cFarmodbus.h"
+
+	// set true to stop the benchmark threads
+	boost::atomic< bool > flagStop( false );
+
+	// test station, shared by the benchmark threads
+	raven::farmodbus::cPort * thePort;
+	raven::farmodbus::cStation * theStation;
+
+	// number of registers polled on the test station
+	const int register_count = 100;
+
+	// how long each benchmark runs, msecs
+	const int run_time = 1000;
+
+/**
+
+  Simulate the polling thread, decoding replies into the test station as fast as possible
+
+*/
+void PollerThread( long long* count )
+{
+	std::vector< raven::farmodbus::cPollRange > due;
+	theStation->Due( due, boost::chrono::steady_clock::now() );
+	unsigned char pdu[256];
+	theStation->ReadRequest( pdu, due[0] );
+
+	// a reply with every register set to the number of this poll
+	unsigned char reply[256];
+	reply[0] = pdu[0];
+	reply[1] = 2 * register_count;
+
+	long long k = 0;
+	while( ! flagStop ) {
+		for( int r = 0; r < register_count; r++ ) {
+			reply[2+2*r] = 0x7F & ( k >> 8 );
+			reply[3+2*r] = 0xFF & k;
+		}
+		theStation->Decode( reply, 2 + 2 * register_count, due[0] );
+		k++;
+	}
+	*count = k;
+}
+
+/**
+
+  Read registers from the test station as fast as possible
+
+*/
+void ReaderThread( long long* count, int reg_count )
+{
+	unsigned short value[ register_count ];
+	long long k = 0;
+	long long torn = 0;
+	while( ! flagStop ) {
+		theStation->Query( value, 0, reg_count );
+
+		// all registers are written by the same poll, so must match
+		if( value[0] != value[ reg_count - 1 ] )
+			torn++;
+		k++;
+	}
+	if( torn )
+		printf("ERROR: %lld inconsistent snapshots\n", torn );
+	*count = k;
+}
+
+/**
+
+  Measure read throughput for a number of reader threads
+
+  @param[in] readers number of reader threads
+  @param[in] reg_count number of registers read by each query
+
+*/
+void BenchQuery( int readers, int reg_count )
+{
+	std::vector< long long > count( readers + 1, 0 );
+	flagStop = false;
+
+	boost::thread_group g;
+	g.create_thread( boost::bind( &PollerThread, &count[ readers ] ) );
+	for( int k = 0; k < readers; k++ )
+		g.create_thread( boost::bind( &ReaderThread, &count[k], reg_count ) );
+
+	Sleep( run_time );
+	flagStop = true;
+	g.join_all();
+
+	long long total = 0;
+	for( int k = 0; k < readers; k++ )
+		total += count[k];
+
+	printf("Query %3d registers %2d readers %12.0f reads/sec %10.0f polls/sec\n",
+		reg_count,
+		readers,
+		total * 1000.0 / run_time,
+		count[ readers ] * 1000.0 / run_time );
+}
+
+/**
+
+  Push writes into a queue as fast as possible
+
+*/
+void ProducerThread( raven::farmodbus::cWriteQueue* queue, long long* count, long long* full )
+{
+	unsigned short value[ 4 ] = { 1, 2, 3, 4 };
+	long long k = 0;
+	long long f = 0;
+	while( ! flagStop ) {
+		if( queue->Push( 0, (int)( k & 0xFFF ), 4, value ) )
+			k++;
+		else {
+			// let the consumer catch up
+			f++;
+			boost::this_thread::yield();
+		}
+	}
+	*count = k;
+	*full = f;
+}
+
+/**
+
+  Drain writes from a queue as fast as possible, as the polling thread does
+
+*/
+void ConsumerThread( raven::farmodbus::cWriteQueue* queue, long long* count, boost::atomic< bool >* stop )
+{
+	long long k = 0;
+	for( ; ; ) {
+		raven::farmodbus::cWriteWaiting * W = queue->Front();
+		if( ! W ) {
+			if( *stop )
+				break;
+			boost::this_thread::yield();
+			continue;
+		}
+		queue->Pop();
+		k++;
+	}
+	*count = k;
+}
+
+/**
+
+  Measure write queue throughput for a number of writer threads
+
+  @param[in] producers number of writer threads
+
+*/
+void BenchWriteQueue( int producers )
+{
+	raven::farmodbus::cWriteQueue queue( 256 );
+	std::vector< long long > count( producers + 1, 0 );
+	std::vector< long long > full( producers, 0 );
+	flagStop = false;
+	boost::atomic< bool > consumer_stop( false );
+
+	boost::thread consumer( boost::bind( &ConsumerThread, &queue, &count[ producers ], &consumer_stop ) );
+	boost::thread_group g;
+	for( int k = 0; k < producers; k++ )
+		g.create_thread( boost::bind( &ProducerThread, &queue, &count[k], &full[k] ) );
+
+	Sleep( run_time );
+	flagStop = true;
+	g.join_all();
+
+	// stop the consumer once it has drained everything the producers pushed
+	consumer_stop = true;
+	consumer.join();
+
+	long long total = 0;
+	long long total_full = 0;
+	for( int k = 0; k < producers; k++ ) {
+		total += count[k];
+		total_full += full[k];
+	}
+	if( total != count[ producers ] )
+		printf("ERROR: %lld writes pushed, %lld popped\n", total, count[ producers ] );
+
+	printf("Write queue %2d writers %12.0f writes/sec %12.0f queue full/sec\n",
+		producers,
+		total * 1000.0 / run_time,
+		total_full * 1000.0 / run_time );
+}
+
+/**
+
+  Measure CRC throughput of one method
+
+  @param[in] name of method
+  @param[in] crc the method
+  @param[in] len frame length, bytes
+
+*/
+void BenchCRC(
+	const char * name,
+	unsigned short (*crc)( const unsigned char *, int ),
+	int len )
+{
+	unsigned char frame[256];
+	for( int k = 0; k < len; k++ )
+		frame[k] = (unsigned char) k;
+
+	// run for the benchmark time, checking the clock only every so often
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	boost::chrono::steady_clock::time_point stop = start + boost::chrono::milliseconds( run_time );
+	long long count = 0;
+	unsigned short total = 0;
+	boost::chrono::steady_clock::time_point now;
+	do {
+		for( int k = 0; k < 1000; k++ ) {
+			frame[0] = (unsigned char) k;		// stop the compiler hoisting the calculation
+			total += crc( frame, len );
+		}
+		count += 1000;
+		now = boost::chrono::steady_clock::now();
+	} while( now < stop );
+
+	double secs = boost::chrono::duration_cast< boost::chrono::microseconds >( now - start ).count() / 1000000.0;
+	printf("CRC %-10s %4d bytes %12.0f frames/sec %8.1f MB/sec   ( %04X )\n",
+		name, len,
+		count / secs,
+		count * len / secs / 1000000.0,
+		total );
+}
+
+/**
+
+  Measure decode throughput for full 125 register replies
+
+  @param[in] name of method
+  @param[in] swap the byte swapping method
+
+*/
+void BenchDecode(
+	const char * name,
+	void (*swap)( unsigned short *, const unsigned char *, int ) )
+{
+	const int count = 125;
+	unsigned char reply[ 2 * count ];
+	for( int k = 0; k < 2 * count; k++ )
+		reply[k] = (unsigned char) k;
+	unsigned short value[ count ];
+
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	boost::chrono::steady_clock::time_point stop = start + boost::chrono::milliseconds( run_time );
+	long long replies = 0;
+	unsigned int total = 0;
+	boost::chrono::steady_clock::time_point now;
+	do {
+		for( int k = 0; k < 1000; k++ ) {
+			reply[0] = (unsigned char) k;
+			swap( value, reply, count );
+			total += value[0];
+		}
+		replies += 1000;
+		now = boost::chrono::steady_clock::now();
+	} while( now < stop );
+
+	double secs = boost::chrono::duration_cast< boost::chrono::microseconds >( now - start ).count() / 1000000.0;
+	printf("Decode %-8s %12.0f replies/sec %8.1f ns/reply   ( %u )\n",
+		name,
+		replies / secs,
+		secs * 1000000000.0 / replies,
+		total );
+}
+
+/**
+
+  Measure decode throughput into the station's register store, for full 125 register replies
+
+*/
+void BenchStationDecode()
+{
+	const int count = 125;
+	raven::farmodbus::cStation station( 1, *thePort );
+	unsigned short value[ count ];
+	station.Query( value, 0, count );
+	std::vector< raven::farmodbus::cPollRange > due;
+	station.Due( due, boost::chrono::steady_clock::now() );
+	unsigned char pdu[ 2 + 2 * count ];
+	station.ReadRequest( pdu, due[0] );
+	pdu[1] = 2 * count;
+	for( int k = 0; k < 2 * count; k++ )
+		pdu[ 2 + k ] = (unsigned char) k;
+
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	boost::chrono::steady_clock::time_point stop = start + boost::chrono::milliseconds( run_time );
+	long long replies = 0;
+	boost::chrono::steady_clock::time_point now;
+	do {
+		for( int k = 0; k < 1000; k++ )
+			station.Decode( pdu, 2 + 2 * count, due[0] );
+		replies += 1000;
+		now = boost::chrono::steady_clock::now();
+	} while( now < stop );
+
+	double secs = boost::chrono::duration_cast< boost::chrono::microseconds >( now - start ).count() / 1000000.0;
+	printf("Decode %-8s %12.0f replies/sec %8.1f ns/reply\n",
+		"station",
+		replies / secs,
+		secs * 1000000000.0 / replies );
+}
+
+#ifndef _WIN32
+/**
+
+  Answer RTU read requests on the master side of a pseudo terminal
+
+  @param[in] master the pseudo terminal master
+  @param[in] count number of requests to answer
+
+*/
+void PtyDevice( int master, int count )
+{
+	for( int k = 0; k < count; k++ ) {
+		unsigned char request[8];
+		int have = 0;
+		while( have < 8 ) {
+			int n = read( master, request + have, 8 - have );
+			if( n <= 0 )
+				return;
+			have += n;
+		}
+		int reg_count = request[4] << 8 | request[5];
+		unsigned char reply[256];
+		reply[0] = request[0];
+		reply[1] = request[1];
+		reply[2] = 2 * reg_count;
+		for( int r = 0; r < 2 * reg_count; r++ )
+			reply[3+r] = (unsigned char) r;
+		int length = 3 + 2 * reg_count;
+		unsigned short crc = raven::farmodbus::cPort::CyclicalRedundancyCheck( reply, length );
+		reply[length++] = crc >> 8;
+		reply[length++] = 0xFF & crc;
+		if( write( master, reply, length ) != length )
+			return;
+	}
+}
+
+/**
+
+  Measure serial transaction latency through a pseudo terminal
+
+  @param[in] reg_count number of registers read by each transaction
+
+  A pseudo terminal has no baud rate, so this measures the farm
+  and the termios path, not the wire.  The port is constructed at 115200 baud,
+  where t3.5 is its fixed minimum, so the silence between frames is included.
+
+*/
+void BenchSerial( int reg_count )
+{
+	const int count = 1000;
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( master < 0 || grantpt( master ) || unlockpt( master ) ) {
+		printf("ERROR: no pseudo terminal\n");
+		return;
+	}
+	raven::farmodbus::cSerialPosix serial;
+	if( ! serial.Open( ptsname( master ), 115200 ) ) {
+		printf("ERROR: cannot open %s\n", ptsname( master ) );
+		close( master );
+		return;
+	}
+	raven::farmodbus::cPort port( serial, 115200 );
+	boost::thread device( boost::bind( &PtyDevice, master, count ) );
+
+	unsigned char pdu[256];
+	long long total = 0;
+	long long slowest = 0;
+	int failed = 0;
+	for( int k = 0; k < count; k++ ) {
+		pdu[0] = 4;
+		pdu[1] = 0;
+		pdu[2] = 0;
+		pdu[3] = 0;
+		pdu[4] = (unsigned char) reg_count;
+		int reply_length;
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		if( port.Transaction( 1, pdu, 5, pdu, reply_length, 1000 ) != raven::farmodbus::OK )
+			failed++;
+		long long usec = boost::chrono::duration_cast< boost::chrono::microseconds >(
+			boost::chrono::steady_clock::now() - start ).count();
+		total += usec;
+		if( usec > slowest )
+			slowest = usec;
+	}
+	device.join();
+	serial.Close();
+	close( master );
+
+	if( failed )
+		printf("ERROR: %d transactions failed\n", failed );
+	printf("Serial pty %3d registers %8.0f usec/transaction %8lld usec slowest  %s\n",
+		reg_count,
+		(double) total / count,
+		slowest,
+		serial.IsLowLatency() ? "low latency" : "" );
+}
+#endif
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+	// construct a test station
+	// ( production code should NOT do this! )
+	thePort = new raven::farmodbus::cPort( 0 );
+	theStation = new raven::farmodbus::cStation( 1, *thePort );
+	unsigned short value[ register_count ];
+	theStation->Query( value, 0, register_count );
+
+	printf("Query read throughput\n");
+	int readers[] = { 1, 2, 4, 8, 16 };
+	for( int k = 0; k < 5; k++ )
+		BenchQuery( readers[k], 1 );
+	for( int k = 0; k < 5; k++ )
+		BenchQuery( readers[k], register_count );
+
+	printf("\nWrite queue throughput\n");
+	for( int k = 0; k < 5; k++ )
+		BenchWriteQueue( readers[k] );
+
+	printf("\nDecode throughput, 125 register replies\n");
+	BenchDecode( "scalar", &raven::farmodbus::cRegisterStore::SwapScalar );
+	BenchDecode( "selected", &raven::farmodbus::cRegisterStore::Swap );
+	BenchStationDecode();
+
+	printf("\nCRC throughput\n");
+	int frame_length[] = { 8, 16, 64, 128, 256 };
+	for( int k = 0; k < 5; k++ ) {
+		BenchCRC( "bytewise", &raven::farmodbus::cPort::CyclicalRedundancyCheckBytewise, frame_length[k] );
+		BenchCRC( "slice-by-4", &raven::farmodbus::cPort::CyclicalRedundancyCheckSlice4, frame_length[k] );
+		BenchCRC( "slice-by-8", &raven::farmodbus::cPort::CyclicalRedundancyCheckSlice8, frame_length[k] );
+		BenchCRC( "selected", &raven::farmodbus::cPort::CyclicalRedundancyCheck, frame_length[k] );
+	}
+
+#ifndef _WIN32
+	printf("\nSerial transaction latency\n");
+	BenchSerial( 1 );
+	BenchSerial( 125 );
+#endif
+
+	return 0;
+}
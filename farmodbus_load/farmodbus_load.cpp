@@ -0,0 +1,568 @@
+// farmodbus_load.cpp : Modbus farm load scenarios
+//
+// Runs the whole farm against buses of simulated stations, served in the same process
+// over loopback TCP or pseudo terminals, and measures what an application sees.
+// Each run is one scenario, reported as one line of JSON, so that runs can be compared.
+//
+//   farmodbus_load --list              the built in scenarios
+//   farmodbus_load --scenario name     run one, options after it change it
+//   farmodbus_load --suite             run all of them, each in its own process
+//
+// The farm is a singleton, and its ports poll until the program exits,
+// so one process runs one scenario.
+
+#include "stdafx.h"
+#include "cFarmodbus.h"
+#include "cSimodbus.h"
+
+/**
+
+  A load scenario
+
+*/
+class cScenario {
+public:
+	std::string name;
+	std::string transport;		///< "tcp" RTU over TCP, "mbap" Modbus TCP, or "pty" serial through pseudo terminals
+	int stations;				///< number of stations, in buses of up to 247, each bus on its own farm port
+	int registers;				///< registers polled on each station, from register 0
+	int period;					///< milliseconds between polls, 0 to poll as fast as the port can
+	int in_flight;				///< requests in flight on each Modbus TCP port
+	int readers;				///< threads calling Query()
+	int writers;				///< threads writing, each waiting for its write to be acknowledged
+	int write_interval;			///< milliseconds between the writes of each writer
+	int slow;					///< slow stations on each bus
+	std::string slow_latency;	///< reply time of the slow stations
+	int dead;					///< stations on each bus that never reply
+	std::string latency;		///< reply time of the other stations
+	int warmup;					///< seconds to run before measuring
+	int seconds;				///< seconds measured
+	int seed;					///< seed of the simulated reply times
+
+	cScenario()
+		: name( "custom" )
+		, transport( "tcp" )
+		, stations( 100 )
+		, registers( 10 )
+		, period( 0 )
+		, in_flight( 8 )
+		, readers( 1 )
+		, writers( 1 )
+		, write_interval( 10 )
+		, slow( 0 )
+		, slow_latency( "uniform:20:50" )
+		, dead( 0 )
+		, latency( "fixed:0" )
+		, warmup( 2 )
+		, seconds( 5 )
+		, seed( 1 )
+	{}
+
+	cScenario( const char * n, const char * t, int s, int r, int rd, int wr, int sl, int d )
+	{
+		*this = cScenario();
+		name = n;
+		transport = t;
+		stations = s;
+		registers = r;
+		readers = rd;
+		writers = wr;
+		slow = sl;
+		dead = d;
+	}
+};
+
+	// the built in scenarios
+	std::vector< cScenario > theScenario;
+
+	// set true to stop the reader and writer threads
+	boost::atomic< bool > flagStop( false );
+
+	// the stations, shared by the reader and writer threads
+	std::vector< raven::farmodbus::station_handle_t > theStation;
+	raven::farmodbus::cFarmodbus * theFarm;
+
+void MakeScenarios()
+{
+	//                                   name            transport stations registers readers writers slow dead
+	theScenario.push_back( cScenario( "tcp-100x10",       "tcp",   100,   10,  1,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "tcp-1000x100",     "tcp",  1000,  100,  1,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "mbap-100x10",      "mbap",  100,   10,  1,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "mbap-1000x100",    "mbap", 1000,  100,  1,  1, 0, 0 ) );
+#ifndef _WIN32
+	theScenario.push_back( cScenario( "pty-100x10",       "pty",   100,   10,  1,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "pty-1000x100",     "pty",  1000,  100,  1,  1, 0, 0 ) );
+#endif
+	theScenario.push_back( cScenario( "tcp-readers-4",    "tcp",  1000,   10,  4,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "tcp-readers-16",   "tcp",  1000,   10, 16,  1, 0, 0 ) );
+	theScenario.push_back( cScenario( "tcp-writers-4",    "tcp",  1000,   10,  1,  4, 0, 0 ) );
+	theScenario.push_back( cScenario( "tcp-writers-16",   "tcp",  1000,   10,  1, 16, 0, 0 ) );
+	theScenario.push_back( cScenario( "tcp-slow",         "tcp",  1000,   10,  1,  4, 20, 0 ) );
+	theScenario.push_back( cScenario( "tcp-dead",         "tcp",  1000,   10,  1,  4, 0, 5 ) );
+	theScenario.push_back( cScenario( "mbap-slow-dead",   "mbap", 1000,   10,  1,  4, 20, 5 ) );
+
+	// measure once the dead stations are down, each takes DownAfter timeouts to find
+	theScenario[ theScenario.size() - 2 ].warmup = 8;
+	theScenario[ theScenario.size() - 1 ].warmup = 8;
+}
+
+/**
+
+  CPU time used by the whole process, microseconds
+
+*/
+long long ProcessCPU()
+{
+#ifdef _WIN32
+	FILETIME create, exit, kernel, user;
+	if( ! GetProcessTimes( GetCurrentProcess(), &create, &exit, &kernel, &user ) )
+		return 0;
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (long long)( ( k.QuadPart + u.QuadPart ) / 10 );
+#else
+	rusage usage;
+	if( getrusage( RUSAGE_SELF, &usage ) )
+		return 0;
+	return (long long)( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+/**
+
+  Read the stations' registers from the farm cache as fast as possible
+
+  @param[out] count number of queries
+  @param[out] cpu microseconds of CPU used by the thread
+  @param[in] registers number of registers read by each query
+  @param[in] first index of the first station read, so the readers spread out
+
+*/
+void ReaderThread( long long* count, long long* cpu, int registers, int first )
+{
+	long long start = raven::simodbus::ThreadCPU();
+	std::vector< unsigned short > value( registers );
+	int station_count = (int) theStation.size();
+	int s = first;
+	long long k = 0;
+	while( ! flagStop ) {
+		theFarm->Query( &value[0], theStation[ s ], 0, registers );
+		if( ++s == station_count )
+			s = 0;
+		k++;
+	}
+	*count = k;
+	*cpu = raven::simodbus::ThreadCPU() - start;
+}
+
+/**
+
+  A write waiting to be acknowledged
+
+*/
+class cAck {
+public:
+	boost::atomic< bool > done;
+	raven::farmodbus::cResult result;
+
+	cAck() : done( false ) {}
+};
+
+/// Completion callback, called by the port's polling thread
+class cAcknowledged {
+public:
+	cAck * ack;
+
+	cAcknowledged( cAck * a ) : ack( a ) {}
+
+	void operator()( const raven::farmodbus::cResult& result )
+	{
+		ack->result = result;
+		ack->done = true;
+	}
+};
+
+/**
+
+  Write to the stations, one write at a time, waiting for each to be acknowledged
+
+  @param[out] latency microseconds from queueing each write to its acknowledgement
+  @param[out] failed number of writes that failed, or were not acknowledged
+  @param[out] cpu microseconds of CPU used by the thread
+  @param[in] registers number of registers on each station
+  @param[in] interval milliseconds between writes
+  @param[in] first index of the first station written, so the writers spread out
+
+*/
+void WriterThread(
+	std::vector< int >* latency,
+	long long* failed,
+	long long* cpu,
+	int registers,
+	int interval,
+	int first )
+{
+	long long start_cpu = raven::simodbus::ThreadCPU();
+	int station_count = (int) theStation.size();
+	int s = first;
+	long long k = 0;
+	long long f = 0;
+
+	// the acknowledgement may come after a write is given up on, so is never freed
+	cAck * ack = new cAck();
+
+	while( ! flagStop ) {
+		unsigned short value = (unsigned short) k;
+		ack->done = false;
+		raven::farmodbus::time_point_t start = boost::chrono::steady_clock::now();
+		raven::farmodbus::error err = theFarm->Write(
+			theStation[ s ], (int)( k % registers ), 1, &value,
+			cAcknowledged( ack ) );
+		if( ++s == station_count )
+			s = 0;
+		k++;
+		if( err != raven::farmodbus::OK ) {
+			f++;
+			Sleep( interval );
+			continue;
+		}
+
+		// wait for the acknowledgement, the time is taken by the polling thread
+		raven::farmodbus::time_point_t give_up = start + boost::chrono::seconds( 10 );
+		while( ! ack->done && boost::chrono::steady_clock::now() < give_up )
+			boost::this_thread::sleep_for( boost::chrono::microseconds( 100 ) );
+		if( ! ack->done ) {
+			f++;
+			ack = new cAck();
+		} else if( ack->result.err != raven::farmodbus::OK ) {
+			f++;
+		} else {
+			latency->push_back( (int) boost::chrono::duration_cast< boost::chrono::microseconds >(
+				ack->result.time - start ).count() );
+		}
+		Sleep( interval );
+	}
+	*failed = f;
+	*cpu = raven::simodbus::ThreadCPU() - start_cpu;
+}
+
+/// The latency below which a fraction of the sorted latencies fall
+int Percentile( const std::vector< int >& sorted, double fraction )
+{
+	if( ! sorted.size() )
+		return 0;
+	int k = (int)( fraction * sorted.size() );
+	if( k >= (int) sorted.size() )
+		k = (int) sorted.size() - 1;
+	return sorted[ k ];
+}
+
+/**
+
+  Run a scenario and report it
+
+  @param[in] S the scenario
+
+  @return 0 if the scenario ran, 1 if it could not be set up
+
+*/
+int Run( const cScenario& S )
+{
+	srand( S.seed );
+	raven::simodbus::cLatency latency;
+	raven::simodbus::cLatency slow_latency;
+	if( ! latency.Parse( S.latency.c_str() ) || ! slow_latency.Parse( S.slow_latency.c_str() ) ) {
+		printf("ERROR: bad latency\n");
+		return 1;
+	}
+#ifdef _WIN32
+	if( S.transport == "pty" ) {
+		printf("ERROR: pseudo terminals are not available on Windows\n");
+		return 1;
+	}
+#endif
+
+	// the farm, configured so that dead stations are found quickly
+	theFarm = new raven::farmodbus::cFarmodbus();
+	raven::farmodbus::cFarmodbusConfig config;
+	config.PollPeriod = S.period;
+	config.TimeoutCeiling = 300;
+	theFarm->Set( config );
+
+	// the buses, each on its own port, the last stations on each bus dead, those before them slow
+	std::vector< raven::simodbus::cSimBus * > bus;
+	for( int first = 1; first <= S.stations; first += 247 ) {
+		int count = S.stations - first + 1;
+		if( count > 247 )
+			count = 247;
+		raven::simodbus::cSimBus * B = new raven::simodbus::cSimBus();
+		bus.push_back( B );
+		for( int address = 1; address <= count; address++ ) {
+			raven::simodbus::cSimStation * station = new raven::simodbus::cSimStation( address );
+			station->Map( 0, S.registers );
+			if( address > count - S.dead )
+				station->setDrop( 1 );
+			else if( address > count - S.dead - S.slow )
+				station->setLatency( slow_latency );
+			else
+				station->setLatency( latency );
+			B->Add( station );
+		}
+
+		raven::farmodbus::port_handle_t port;
+		raven::farmodbus::error err = raven::farmodbus::OK;
+		if( S.transport == "pty" ) {
+#ifndef _WIN32
+			std::string path = B->ServePty();
+			raven::farmodbus::cSerialPosix * serial = new raven::farmodbus::cSerialPosix();
+			if( path.empty() || ! serial->Open( path.c_str(), 115200 ) ) {
+				printf("ERROR: no pseudo terminal\n");
+				return 1;
+			}
+			err = theFarm->Add( port, *serial, 115200 );
+#endif
+		} else {
+			bool mbap = S.transport == "mbap";
+			int tcp_port = B->ServeTCP( 0, mbap );
+			if( ! tcp_port ) {
+				printf("ERROR: cannot open TCP port\n");
+				return 1;
+			}
+			char endpoint[ 32 ];
+			sprintf( endpoint, "127.0.0.1:%d", tcp_port );
+			if( mbap )
+				err = theFarm->AddModbusTCP( port, endpoint, S.in_flight );
+			else
+				err = theFarm->Add( port, endpoint );
+		}
+		if( err != raven::farmodbus::OK ) {
+			printf("ERROR: cannot add port, error %d\n", err );
+			return 1;
+		}
+
+		// the first query of each station puts its registers in the poll plan
+		std::vector< unsigned short > value( S.registers );
+		for( int address = 1; address <= count; address++ ) {
+			raven::farmodbus::station_handle_t station;
+			theFarm->Add( station, port, address );
+			theFarm->Query( &value[0], station, 0, S.registers );
+			theStation.push_back( station );
+		}
+	}
+
+	Sleep( 1000 * S.warmup );
+
+	// measure
+	long long answered_start = 0;
+	long long dropped_start = 0;
+	long long writes_start = 0;
+	long long sim_cpu_start = 0;
+	for( unsigned int b = 0; b < bus.size(); b++ ) {
+		long long a, d;
+		bus[b]->getCount( a, d );
+		answered_start += a;
+		dropped_start += d;
+		writes_start += bus[b]->getWriteCount();
+		sim_cpu_start += bus[b]->getCPU();
+	}
+	long long cpu_start = ProcessCPU();
+	raven::farmodbus::time_point_t start = boost::chrono::steady_clock::now();
+
+	std::vector< long long > queries( S.readers, 0 );
+	std::vector< long long > reader_cpu( S.readers, 0 );
+	std::vector< std::vector< int > > latency_us( S.writers );
+	std::vector< long long > failed( S.writers, 0 );
+	std::vector< long long > writer_cpu( S.writers, 0 );
+	int station_count = (int) theStation.size();
+	boost::thread_group g;
+	for( int k = 0; k < S.readers; k++ )
+		g.create_thread( boost::bind( &ReaderThread,
+			&queries[k], &reader_cpu[k], S.registers, k * station_count / S.readers ) );
+	for( int k = 0; k < S.writers; k++ )
+		g.create_thread( boost::bind( &WriterThread,
+			&latency_us[k], &failed[k], &writer_cpu[k], S.registers, S.write_interval,
+			k * station_count / S.writers ) );
+
+	Sleep( 1000 * S.seconds );
+	flagStop = true;
+	g.join_all();
+
+	double secs = boost::chrono::duration_cast< boost::chrono::microseconds >(
+		boost::chrono::steady_clock::now() - start ).count() / 1000000.0;
+	long long process_cpu = ProcessCPU() - cpu_start;
+	long long answered = -answered_start;
+	long long dropped = -dropped_start;
+	long long writes = -writes_start;
+	long long sim_cpu = -sim_cpu_start;
+	for( unsigned int b = 0; b < bus.size(); b++ ) {
+		long long a, d;
+		bus[b]->getCount( a, d );
+		answered += a;
+		dropped += d;
+		writes += bus[b]->getWriteCount();
+		sim_cpu += bus[b]->getCPU();
+	}
+
+	// every request answered by the stations is a poll, except the writes,
+	// counted by the stations too since the farm may have given up on them
+	long long total_queries = 0;
+	long long client_cpu = 0;
+	for( int k = 0; k < S.readers; k++ ) {
+		total_queries += queries[k];
+		client_cpu += reader_cpu[k];
+	}
+	std::vector< int > sorted;
+	long long total_failed = 0;
+	for( int k = 0; k < S.writers; k++ ) {
+		sorted.insert( sorted.end(), latency_us[k].begin(), latency_us[k].end() );
+		total_failed += failed[k];
+		client_cpu += writer_cpu[k];
+	}
+	std::sort( sorted.begin(), sorted.end() );
+	long long polls = answered - writes;
+
+	// the farm's CPU is what is left once the simulated stations and the application threads are taken out
+	long long farm_cpu = process_cpu - sim_cpu - client_cpu;
+	if( farm_cpu < 0 )
+		farm_cpu = 0;
+
+	printf("{\"scenario\":\"%s\",\"transport\":\"%s\",\"stations\":%d,\"registers\":%d,"
+		"\"ports\":%d,\"period_ms\":%d,\"readers\":%d,\"writers\":%d,\"slow_per_port\":%d,\"dead_per_port\":%d,"
+		"\"latency\":\"%s\",\"slow_latency\":\"%s\",\"seconds\":%.3f,"
+		"\"polls\":%lld,\"polls_per_sec\":%.1f,\"unanswered\":%lld,"
+		"\"queries\":%lld,\"query_ns_per_op\":%.1f,"
+		"\"writes\":%d,\"writes_failed\":%lld,"
+		"\"write_p50_us\":%d,\"write_p90_us\":%d,\"write_p99_us\":%d,\"write_p999_us\":%d,\"write_max_us\":%d,"
+		"\"cpu_process_us\":%lld,\"cpu_simulator_us\":%lld,\"cpu_application_us\":%lld,"
+		"\"cpu_farm_us\":%lld,\"cpu_us_per_poll\":%.2f}\n",
+		S.name.c_str(), S.transport.c_str(), S.stations, S.registers,
+		(int) bus.size(), S.period, S.readers, S.writers, S.slow, S.dead,
+		latency.Text().c_str(), slow_latency.Text().c_str(), secs,
+		polls, polls / secs, dropped,
+		total_queries, total_queries ? S.readers * secs * 1000000000.0 / total_queries : 0.0,
+		(int) sorted.size(), total_failed,
+		Percentile( sorted, 0.5 ), Percentile( sorted, 0.9 ), Percentile( sorted, 0.99 ),
+		Percentile( sorted, 0.999 ), sorted.size() ? sorted.back() : 0,
+		process_cpu, sim_cpu, client_cpu,
+		farm_cpu, polls ? (double) farm_cpu / polls : 0.0 );
+	fflush( stdout );
+
+	return 0;
+}
+
+void Usage()
+{
+	printf(
+		"farmodbus_load [options]\n"
+		"  --list              list the built in scenarios\n"
+		"  --suite             run every built in scenario, each in its own process,\n"
+		"                      options after this apply to all of them\n"
+		"  --scenario name     start from a built in scenario, options after this change it\n"
+		"  --transport t       tcp ( RTU over TCP ), mbap ( Modbus TCP ) or pty ( default tcp )\n"
+		"  --stations n        number of stations, 247 to each port ( default 100 )\n"
+		"  --registers n       registers polled on each station ( default 10 )\n"
+		"  --period ms         poll period, 0 polls as fast as possible ( default 0 )\n"
+		"  --in-flight n       requests in flight on each Modbus TCP port ( default 8 )\n"
+		"  --readers n         threads querying the stations ( default 1 )\n"
+		"  --writers n         threads writing to the stations ( default 1 )\n"
+		"  --write-interval ms pause between the writes of each writer ( default 10 )\n"
+		"  --latency spec      reply time: fixed:ms, uniform:min:max or exp:min:mean ( default fixed:0 )\n"
+		"  --slow n            slow stations on each port ( default 0 )\n"
+		"  --slow-latency spec reply time of the slow stations ( default uniform:20:50 )\n"
+		"  --dead n            stations on each port that never reply ( default 0 )\n"
+		"  --warmup secs       run before measuring ( default 2 )\n"
+		"  --seconds secs      measured ( default 5 )\n"
+		"  --seed n            seed of the simulated reply times ( default 1 )\n"
+		"\n"
+		"Reports one line of JSON for each scenario run.\n" );
+}
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+#endif
+
+	MakeScenarios();
+	cScenario S;
+	for( int k = 1; k < argc; k++ ) {
+		std::string option( argv[k] );
+		if( option == "--list" ) {
+			foreach( cScenario& L, theScenario )
+				printf("%-18s %-5s %5d stations %4d registers %3d readers %3d writers %3d slow %3d dead per port\n",
+					L.name.c_str(), L.transport.c_str(), L.stations, L.registers,
+					L.readers, L.writers, L.slow, L.dead );
+			return 0;
+		}
+		if( option == "--suite" ) {
+			// the farm runs until the program exits, so each scenario needs its own process
+			std::string options;
+			for( int j = k + 1; j < argc; j++ )
+				options += std::string( " " ) + argv[j];
+			int failures = 0;
+			foreach( cScenario& L, theScenario ) {
+				std::string command = std::string( "\"" ) + argv[0] + "\" --scenario " + L.name + options;
+				fflush( stdout );
+				if( system( command.c_str() ) )
+					failures++;
+			}
+			return failures ? 1 : 0;
+		}
+		const char * value = k + 1 < argc ? argv[ k + 1 ] : "";
+		k++;
+		bool ok = true;
+		if( option == "--scenario" ) {
+			ok = false;
+			foreach( cScenario& L, theScenario ) {
+				if( L.name == value ) {
+					S = L;
+					ok = true;
+				}
+			}
+		} else if( option == "--transport" ) {
+			S.transport = value;
+			ok = S.transport == "tcp" || S.transport == "mbap" || S.transport == "pty";
+		} else if( option == "--stations" ) {
+			ok = sscanf( value, "%d", &S.stations ) == 1 && S.stations > 0;
+		} else if( option == "--registers" ) {
+			ok = sscanf( value, "%d", &S.registers ) == 1 && S.registers > 0;
+		} else if( option == "--period" ) {
+			ok = sscanf( value, "%d", &S.period ) == 1 && S.period >= 0;
+		} else if( option == "--in-flight" ) {
+			ok = sscanf( value, "%d", &S.in_flight ) == 1 && S.in_flight > 0;
+		} else if( option == "--readers" ) {
+			ok = sscanf( value, "%d", &S.readers ) == 1 && S.readers >= 0;
+		} else if( option == "--writers" ) {
+			ok = sscanf( value, "%d", &S.writers ) == 1 && S.writers >= 0;
+		} else if( option == "--write-interval" ) {
+			ok = sscanf( value, "%d", &S.write_interval ) == 1 && S.write_interval >= 0;
+		} else if( option == "--latency" ) {
+			S.latency = value;
+		} else if( option == "--slow" ) {
+			ok = sscanf( value, "%d", &S.slow ) == 1 && S.slow >= 0;
+		} else if( option == "--slow-latency" ) {
+			S.slow_latency = value;
+		} else if( option == "--dead" ) {
+			ok = sscanf( value, "%d", &S.dead ) == 1 && S.dead >= 0;
+		} else if( option == "--warmup" ) {
+			ok = sscanf( value, "%d", &S.warmup ) == 1 && S.warmup >= 0;
+		} else if( option == "--seconds" ) {
+			ok = sscanf( value, "%d", &S.seconds ) == 1 && S.seconds > 0;
+		} else if( option == "--seed" ) {
+			ok = sscanf( value, "%d", &S.seed ) == 1;
+		} else {
+			ok = false;
+		}
+		if( ! ok ) {
+			Usage();
+			return 1;
+		}
+	}
+
+	return Run( S );
+}
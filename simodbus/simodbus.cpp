@@ -0,0 +1,180 @@
+// simodbus.cpp : Simulated modbus devices, to load test the modbus farm
+//
+// Serves buses of simulated stations on loopback TCP ports,
+// and on pseudo terminals where the system has them,
+// so the farm can be run against thousands of stations on one machine.
+
+#include "stdafx.h"
+#include "cFarmodbus.h"
+#include "cSimodbus.h"
+
+void Usage()
+{
+	printf(
+		"simodbus [options]\n"
+		"  --tcp port          TCP port of the first bus, the others follow on, 0 for none ( default 5020 )\n"
+		"  --mbap              Modbus TCP framing on the TCP ports ( default RTU framing )\n"
+		"  --pty               also serve each bus on a pseudo terminal, RTU framing\n"
+		"  --buses n           number of buses ( default 1 )\n"
+		"  --stations n        stations on each bus, addresses 1 to n, at most 247 ( default 247 )\n"
+		"  --registers f:c     c registers from register f in each station, may be repeated ( default 0:1000 )\n"
+		"  --functions list    function codes supported, e.g. 4 or 3,4,6,16 ( default 3,4,6,16 )\n"
+		"  --latency spec      reply time: fixed:ms, uniform:min:max or exp:min:mean ( default fixed:0 )\n"
+		"  --slow n:spec       the last n live stations on each bus reply with this latency instead\n"
+		"  --dead n            the last n stations on each bus never reply\n"
+		"  --drop p            fraction of requests not answered, 0 to 1 ( default 0 )\n" );
+}
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+#endif
+
+	int tcp_port = 5020;
+	bool mbap = false;
+	bool pty = false;
+	int buses = 1;
+	int stations = 247;
+	std::vector< std::pair< int, int > > registers;
+	std::vector< int > functions;
+	raven::simodbus::cLatency latency;
+	raven::simodbus::cLatency slow_latency;
+	int slow = 0;
+	int dead = 0;
+	double drop = 0;
+
+	for( int k = 1; k < argc; k++ ) {
+		std::string option( argv[k] );
+		const char * value = k + 1 < argc ? argv[ k + 1 ] : "";
+		bool ok = true;
+		if( option == "--mbap" ) {
+			mbap = true;
+			continue;
+		}
+		if( option == "--pty" ) {
+			pty = true;
+			continue;
+		}
+		k++;
+		if( option == "--tcp" ) {
+			ok = sscanf( value, "%d", &tcp_port ) == 1;
+		} else if( option == "--buses" ) {
+			ok = sscanf( value, "%d", &buses ) == 1 && buses > 0;
+		} else if( option == "--stations" ) {
+			ok = sscanf( value, "%d", &stations ) == 1 && 0 < stations && stations <= 247;
+		} else if( option == "--registers" ) {
+			int first, count;
+			ok = sscanf( value, "%d:%d", &first, &count ) == 2;
+			registers.push_back( std::make_pair( first, count ) );
+		} else if( option == "--functions" ) {
+			std::string list( value );
+			std::replace( list.begin(), list.end(), ',', ' ' );
+			const char * p = list.c_str();
+			int code, n;
+			while( sscanf( p, "%d%n", &code, &n ) == 1 ) {
+				functions.push_back( code );
+				p += n;
+			}
+			ok = functions.size() > 0;
+		} else if( option == "--latency" ) {
+			ok = latency.Parse( value );
+		} else if( option == "--slow" ) {
+			const char * colon = strchr( value, ':' );
+			ok = sscanf( value, "%d", &slow ) == 1 && colon && slow_latency.Parse( colon + 1 );
+		} else if( option == "--dead" ) {
+			ok = sscanf( value, "%d", &dead ) == 1;
+		} else if( option == "--drop" ) {
+			ok = sscanf( value, "%lf", &drop ) == 1 && 0 <= drop && drop <= 1;
+		} else {
+			ok = false;
+		}
+		if( ! ok ) {
+			Usage();
+			return 1;
+		}
+	}
+	if( ! registers.size() )
+		registers.push_back( std::make_pair( 0, 1000 ) );
+#ifdef _WIN32
+	if( pty ) {
+		printf("Pseudo terminals are not available on Windows\n");
+		pty = false;
+	}
+#endif
+
+	// construct the buses
+	// the last stations on each bus are dead, those before them slow
+	std::vector< raven::simodbus::cSimBus * > bus;
+	for( int b = 0; b < buses; b++ ) {
+		bus.push_back( new raven::simodbus::cSimBus() );
+		for( int address = 1; address <= stations; address++ ) {
+			raven::simodbus::cSimStation * station = new raven::simodbus::cSimStation( address );
+			for( unsigned int r = 0; r < registers.size(); r++ )
+				station->Map( registers[r].first, registers[r].second );
+			if( functions.size() )
+				station->setFunctions( functions );
+			if( address > stations - dead )
+				station->setDrop( 1 );
+			else if( address > stations - dead - slow )
+				station->setLatency( slow_latency );
+			else
+				station->setLatency( latency );
+			if( drop > 0 && address <= stations - dead )
+				station->setDrop( drop );
+			bus.back()->Add( station );
+		}
+	}
+
+	// serve them
+	printf("%d buses of %d stations, %d stations in all, latency %s\n",
+		buses, stations, buses * stations, latency.Text().c_str() );
+	if( slow )
+		printf("%d slow stations on each bus, latency %s\n", slow, slow_latency.Text().c_str() );
+	if( dead )
+		printf("%d dead stations on each bus\n", dead );
+	for( int b = 0; b < buses; b++ ) {
+		printf("bus %d:", b );
+		if( tcp_port ) {
+			int port = bus[b]->ServeTCP( tcp_port + b, mbap );
+			if( ! port ) {
+				printf(" cannot open TCP port %d\n", tcp_port + b );
+				return 1;
+			}
+			printf(" 127.0.0.1:%d %s", port, mbap ? "Modbus TCP" : "RTU over TCP" );
+		}
+#ifndef _WIN32
+		if( pty ) {
+			std::string path = bus[b]->ServePty();
+			if( path.empty() ) {
+				printf(" no pseudo terminal\n");
+				return 1;
+			}
+			printf(" %s RTU", path.c_str() );
+		}
+#endif
+		printf("\n");
+	}
+	fflush( stdout );
+
+	// report the requests answered, every 10 seconds, for ever
+	long long last_answered = 0;
+	for( ; ; ) {
+		Sleep( 10000 );
+		long long answered = 0;
+		long long dropped = 0;
+		for( int b = 0; b < buses; b++ ) {
+			long long a, d;
+			bus[b]->getCount( a, d );
+			answered += a;
+			dropped += d;
+		}
+		printf("%lld requests answered, %lld not answered, %.0f answers/sec\n",
+			answered, dropped, ( answered - last_answered ) / 10.0 );
+		fflush( stdout );
+		last_answered = answered;
+	}
+
+	return 0;
+}
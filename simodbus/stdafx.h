@@ -0,0 +1,55 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _WIN32
+#include <tchar.h>
+#include <Ws2tcpip.h>
+#else
+// sockets, and the other Windows names used, on POSIX
+#include "PosixCompat.h"
+#endif
+
+#ifndef _WIN32
+// serial ports through termios
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#endif
+
+
+#include <vector>
+#include <queue>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/chrono.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/foreach.hpp>
+#define foreach         BOOST_FOREACH
+#include <boost/thread/tss.hpp>
+
+#ifdef _WIN32
+#include "cRunWatch.h"
+#endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+/*
+ *  Map the Windows names used by the modbus farm onto POSIX
+ *
+ * Copyright (c) 2013 by James Bremner
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by James Bremner. The name "James Bremner" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// Winsock
+
+typedef int SOCKET;
+typedef struct timeval TIMEVAL;
+
+#define INVALID_SOCKET	(-1)
+#define SOCKET_ERROR	(-1)
+
+#define WSAEINTR		EINTR
+#define WSAEWOULDBLOCK	EWOULDBLOCK
+#define WSAEINPROGRESS	EINPROGRESS
+
+inline int closesocket( SOCKET s )
+{
+	return close( s );
+}
+
+/// ioctl on a socket, for FIONBIO and FIONREAD, which take an int on POSIX
+inline int ioctlsocket( SOCKET s, long cmd, u_long * arg )
+{
+	int value = (int) *arg;
+	int ret = ioctl( s, cmd, &value );
+	*arg = (u_long) value;
+	return ret;
+}
+
+/// The error of the last socket call
+inline int WSAGetLastError()
+{
+	return errno;
+}
+
+// Win32
+
+inline void Sleep( int msec )
+{
+	timespec t;
+	t.tv_sec = msec / 1000;
+	t.tv_nsec = ( msec % 1000 ) * 1000000L;
+	while( nanosleep( &t, &t ) == -1 && errno == EINTR )
+		;
+}
+
+// tchar.h, narrow characters only
+
+#define _tmain main
+typedef char _TCHAR;
+
+// raven::set::cRunWatch times sections of code on Windows only,
+// elsewhere it does nothing
+
+namespace raven {
+	namespace set {
+		class cRunWatch {
+		public:
+			cRunWatch( const char * ) {}
+			static void Start() {}
+			static void Report() {}
+		};
+	}
+}
+
+#endif
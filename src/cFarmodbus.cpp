@@ -20,9 +20,17 @@
  * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
  */
 
-#include "StdAfx.h"
+#include "stdafx.h"
 #include "cFarmodbus.h"
+#ifdef _WIN32
 #include "Serial.h"
+#endif
+
+// use SSE2 to decode replies, if the compiler targets it
+#if defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) || defined( __SSE2__ )
+#define FARMODBUS_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace raven {
 	namespace farmodbus {
@@ -36,23 +44,227 @@ namespace raven {
 		// The active configuration
 		cFarmodbusConfig theConfig;
 
-		cPort::cPort( cSerial& serial )
+		// The notification thread, shared by all subscribers
+		// never destroyed, since its thread runs until the program exits
+		cNotifier * theNotifier = new cNotifier();
+
+		cPort::cPort( cSerial& serial, int baud )
 			: myFlagTCP( false )
+			, myFlagMBAP( false )
+			, myInFlight( 1 )
+			, myTransactionID( 0 )
+			, myReconnectDelay( theConfig.ReconnectMin )
+			, myConnects( 0 )
+			, myReceivedHave( 0 )
+			, myDiscard( 0 )
+			, myWriteQueue( theConfig.WriteQueueLength )
+			, mySleeping( false )
 		{
 			myID = myLastID++;
 			mySerial = &serial;
+			mySocket = INVALID_SOCKET;
+
+			// silent interval between frames, from the time to send a character
+			// of 11 bits: start, 8 data, parity or second stop, stop
+			// above 19200 baud the modbus specification fixes them
+			if( baud < 1 )
+				baud = 9600;
+			myCharTime = 11000000 / baud;
+			if( baud > 19200 )
+				mySilence35 = 1750;
+			else
+				mySilence35 = 35 * myCharTime / 10;
 		}
 		cPort::cPort( SOCKET s )
 			: myFlagTCP( true )
+			, myFlagMBAP( false )
+			, myInFlight( 1 )
+			, myTransactionID( 0 )
+			, myCharTime( 0 )
+			, mySilence35( 0 )
+			, myReconnectDelay( theConfig.ReconnectMin )
+			, myConnects( 0 )
+			, myReceivedHave( 0 )
+			, myDiscard( 0 )
+			, myWriteQueue( theConfig.WriteQueueLength )
+			, mySleeping( false )
+		{
+			myID = myLastID++;
+			mySocket = s;
+		}
+		cPort::cPort( SOCKET s, int in_flight )
+			: myFlagTCP( true )
+			, myFlagMBAP( true )
+			, myInFlight( in_flight < 1 ? 1 : in_flight )
+			, myTransactionID( 0 )
+			, myCharTime( 0 )
+			, mySilence35( 0 )
+			, myReconnectDelay( theConfig.ReconnectMin )
+			, myConnects( 0 )
+			, myReceivedHave( 0 )
+			, myDiscard( 0 )
+			, myWriteQueue( theConfig.WriteQueueLength )
+			, mySleeping( false )
 		{
 			myID = myLastID++;
 			mySocket = s;
 		}
+		void cPort::setEndpoint( const std::string& host, const std::string& service )
+		{
+			myHost = host;
+			myService = service;
+		}
+
+		bool cPort::ParseEndpoint(
+			const char * endpoint,
+			std::string& host,
+			std::string& service )
+		{
+			std::string text( endpoint ? endpoint : "" );
+			std::string::size_type colon = text.rfind( ':' );
+			if( colon == std::string::npos )
+				return false;
+			host = text.substr( 0, colon );
+			service = text.substr( colon + 1 );
+
+			// an IPv6 address has colons of its own, so must be in brackets
+			if( host.size() >= 2 && host[0] == '[' && host[ host.size() - 1 ] == ']' )
+				host = host.substr( 1, host.size() - 2 );
+			else if( host.find( ':' ) != std::string::npos )
+				return false;
+			return host.size() && service.size();
+		}
+
+		/**
+
+		Connect the port's endpoint, if the backoff since the last attempt has passed
+
+		Each address the host resolves to is tried in turn.
+		If none connects, the delay before the next attempt doubles.
+
+		*/
+		void cPort::Connect()
+		{
+			if( boost::chrono::steady_clock::now() < myReconnectDue )
+				return;
+
+			addrinfo hints;
+			memset( &hints, 0, sizeof( hints ) );
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_protocol = IPPROTO_TCP;
+			addrinfo * found = 0;
+			if( getaddrinfo( myHost.c_str(), myService.c_str(), &hints, &found ) == 0 ) {
+				for( addrinfo * a = found; a && mySocket == INVALID_SOCKET; a = a->ai_next )
+					mySocket = Connect( a );
+				freeaddrinfo( found );
+			}
+			if( mySocket == INVALID_SOCKET ) {
+				myReconnectDue = boost::chrono::steady_clock::now() +
+					boost::chrono::milliseconds( myReconnectDelay );
+				myReconnectDelay = std::min( 2 * myReconnectDelay, theConfig.ReconnectMax );
+				return;
+			}
+			myReconnectDelay = theConfig.ReconnectMin;
+			myConnects++;
+		}
+
+		/**
+
+		Connect a socket to an address, without blocking longer than the connect timeout
+
+		@param[in] address to connect to
+
+		@return the connected socket, INVALID_SOCKET if the connection failed
+
+		*/
+		SOCKET cPort::Connect( const addrinfo * address )
+		{
+			SOCKET s = socket( address->ai_family, address->ai_socktype, address->ai_protocol );
+			if( s == INVALID_SOCKET )
+				return INVALID_SOCKET;
+
+			// start the connection, and wait for it with a timeout
+			u_long mode = 1;
+			ioctlsocket( s, FIONBIO, &mode );
+			if( connect( s, address->ai_addr, (int) address->ai_addrlen ) == SOCKET_ERROR ) {
+				int e = WSAGetLastError();
+				if( e != WSAEWOULDBLOCK && e != WSAEINPROGRESS ) {
+					closesocket( s );
+					return INVALID_SOCKET;
+				}
+				fd_set writable, failed;
+				FD_ZERO( &writable );
+				FD_ZERO( &failed );
+				FD_SET( s, &writable );
+				FD_SET( s, &failed );
+				TIMEVAL timeout;
+				timeout.tv_sec = theConfig.ConnectTimeout / 1000;
+				timeout.tv_usec = 1000 * ( theConfig.ConnectTimeout % 1000 );
+
+				// Windows reports a refused connection as an exception,
+				// POSIX as writable with the socket error set
+				int so_error = 0;
+				socklen_t len = sizeof( so_error );
+				if( select( (int) s + 1, 0, &writable, &failed, &timeout ) <= 0 ||
+					FD_ISSET( s, &failed ) ||
+					getsockopt( s, SOL_SOCKET, SO_ERROR, (char *) &so_error, &len ) ||
+					so_error ) {
+					closesocket( s );
+					return INVALID_SOCKET;
+				}
+			}
+
+			// the port waits for replies in select(), then reads and writes blocking
+			mode = 0;
+			ioctlsocket( s, FIONBIO, &mode );
+
+			// send each request at once, rather than waiting to coalesce small frames
+			int on = 1;
+			setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof( on ) );
+
+			// notice a gateway that has gone without closing the connection
+			setsockopt( s, SOL_SOCKET, SO_KEEPALIVE, (const char *) &on, sizeof( on ) );
+#ifdef TCP_KEEPIDLE
+			int idle = 5;
+			int interval = 1;
+			int count = 3;
+			setsockopt( s, IPPROTO_TCP, TCP_KEEPIDLE, (const char *) &idle, sizeof( idle ) );
+			setsockopt( s, IPPROTO_TCP, TCP_KEEPINTVL, (const char *) &interval, sizeof( interval ) );
+			setsockopt( s, IPPROTO_TCP, TCP_KEEPCNT, (const char *) &count, sizeof( count ) );
+#endif
+			return s;
+		}
+
+		/**
+
+		Close a broken connection to the port's endpoint, to be connected again
+
+		Sockets supplied by the application are left alone.
+
+		*/
+		void cPort::Disconnect()
+		{
+			if( myHost.empty() || mySocket == INVALID_SOCKET )
+				return;
+			closesocket( mySocket );
+			mySocket = INVALID_SOCKET;
+			myReceivedHave = 0;
+			myDiscard = 0;
+			myReconnectDue = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( myReconnectDelay );
+		}
+
 		bool cPort::IsOpen()
 		{
 			if( myFlagTCP ) {
-				// assume socket is always open
-				return true;
+				if( myHost.empty() ) {
+					// socket supplied by application, assume it is open
+					return true;
+				}
+				if( mySocket == INVALID_SOCKET )
+					Connect();
+				return mySocket != INVALID_SOCKET;
 			} else {
 				return mySerial->IsOpened();
 			}
@@ -70,14 +282,26 @@ namespace raven {
 		int cPort::SendData( const unsigned char *msg, int length )
 		{
 			if( myFlagTCP ) {
+				if( mySocket == INVALID_SOCKET )
+					return 0;
+				int flags = 0;
+#ifdef MSG_NOSIGNAL
+				// a broken connection is an error, not a signal that kills the process
+				flags = MSG_NOSIGNAL;
+#endif
 				int iResult = send( mySocket,
-					(const char* )msg, length, 0 );
+					(const char* )msg, length, flags );
 				if (iResult == SOCKET_ERROR) {
+					Disconnect();
 					return 0;
 				}
+				cMetrics::Count( myMetrics.bytes_out, length );
 				return length;
 			} else {
-				return mySerial->SendData( msg, length );
+				int n = mySerial->SendData( msg, length );
+				if( n > 0 )
+					cMetrics::Count( myMetrics.bytes_out, n );
+				return n;
 			}
 		}
 		/**
@@ -89,20 +313,57 @@ namespace raven {
 
   @return 1 if data ready, 0 if timeout
 
+  For TCP the thread blocks in select() until more data arrives
+  or the deadline passes, so there is no polling and the wait
+  ends as soon as the device has replied.  Bytes that arrive are
+  taken into the port's receive buffer, so a reply that arrives
+  in pieces wakes the thread once for each piece.
+
   */
 		int cPort::WaitForData( int len, int msec )
 		{
 			if( myFlagTCP ) {
-				int timeout = 0;
-				while( ! TCPReadDataWaiting() )
-				{
-					if( timeout++ > msec ) {
+				if( mySocket == INVALID_SOCKET )
+					return 0;
+				if( len > (int) sizeof( myReceived ) )
+					len = (int) sizeof( myReceived );
+				boost::chrono::steady_clock::time_point deadline =
+					boost::chrono::steady_clock::now() + boost::chrono::milliseconds( msec );
+				for( ; ; ) {
+					if( ! TCPFill() ) {
+						Disconnect();
+						return 0;
+					}
+					if( myReceivedHave >= len )
+						return 1;
+
+					long long remaining = boost::chrono::duration_cast< boost::chrono::microseconds >(
+						deadline - boost::chrono::steady_clock::now() ).count();
+					if( remaining <= 0 )
 						return 0;
+
+					// sleep until more data arrives, or deadline
+					fd_set fds;
+					FD_ZERO( &fds );
+					FD_SET( mySocket, &fds );
+					TIMEVAL timeout;
+					timeout.tv_sec = (long)( remaining / 1000000 );
+					timeout.tv_usec = (long)( remaining % 1000000 );
+					if( select( (int)mySocket + 1, &fds, 0, 0, &timeout ) != 1 )
+						return 0;
+
+					// readable with nothing waiting is the end of the stream, or an error
+					// only then is the connection given up, a slow device is just a timeout
+					if( TCPReadDataWaiting() == 0 ) {
+						char c;
+						int n = recv( mySocket, &c, 1, MSG_PEEK );
+						if( n == 0 ||
+							( n < 0 && WSAGetLastError() != WSAEINTR && WSAGetLastError() != WSAEWOULDBLOCK ) ) {
+							Disconnect();
+							return 0;
+						}
 					}
-					Sleep(1);
 				}
-				// TODO  check for length of data waiting
-				return 1;
 
 			} else {
 				return mySerial->WaitForData( len, msec );
@@ -111,18 +372,35 @@ namespace raven {
 		}
 		/**
 
-  True if data available to be read
+  Number of bytes available to be read, without blocking
 
 */
 int cPort::TCPReadDataWaiting( void )
 {
-		fd_set fds;
-		FD_ZERO( &fds );
-		FD_SET( mySocket, &fds );
-		TIMEVAL timeout;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 10000;
-		return ( select( 0, &fds, 0, 0, &timeout ) == 1 );
+		u_long count = 0;
+		if( ioctlsocket( mySocket, FIONREAD, &count ) == SOCKET_ERROR )
+			return 0;
+		return (int) count;
+
+}
+/**
+
+  Take the bytes waiting on the socket into the receive buffer, without blocking
+
+  @return false if the socket failed
+
+*/
+bool cPort::TCPFill( void )
+{
+		int room = (int) sizeof( myReceived ) - myReceivedHave;
+		int waiting = TCPReadDataWaiting();
+		if( room <= 0 || waiting <= 0 )
+			return true;
+		int n = recv( mySocket, (char*)myReceived + myReceivedHave, std::min( room, waiting ), 0 );
+		if( n <= 0 )
+			return false;
+		myReceivedHave += n;
+		return true;
 
 }
 /**
@@ -138,479 +416,2842 @@ int cPort::TCPReadDataWaiting( void )
 		int cPort::ReadData( void *buffer, int limit )
 		{
 			if( myFlagTCP ) {
-				return recv( mySocket, (char*)buffer, limit, 0 );
+				if( mySocket == INVALID_SOCKET )
+					return 0;
+				if( myReceivedHave ) {
+					int n = std::min( limit, myReceivedHave );
+					memcpy( buffer, myReceived, n );
+					myReceivedHave -= n;
+					memmove( myReceived, myReceived + n, myReceivedHave );
+					cMetrics::Count( myMetrics.bytes_in, n );
+					return n;
+				}
+				int n = recv( mySocket, (char*)buffer, limit, 0 );
+				if( n <= 0 )
+					Disconnect();
+				else
+					cMetrics::Count( myMetrics.bytes_in, n );
+				return n;
 			} else {
-				return mySerial->ReadData( buffer, limit );
+				int n = mySerial->ReadData( buffer, limit );
+				if( n > 0 )
+					cMetrics::Count( myMetrics.bytes_in, n );
+				return n;
 			}
 
 		}
-		cStation::cStation( 
+		error cPort::Transaction(
 			int address,
-			cPort& port )
-			: myAddress( address )
-			, myPort( port )
-			, myFirstReg( -1 )
-			, myError( not_ready )
-			, myWriteError( OK )
+			const unsigned char * request,
+			int length,
+			unsigned char * reply,
+			int& reply_length,
+			int msec )
 		{
-			myHandle  = myLastHandle++;
+			if( ! IsOpen() )
+				return port_not_open;
+
+			if( myFlagMBAP )
+				return TransactionMBAP( address, request, length, reply, reply_length, msec );
+
+			// assemble the RTU frame
+			myTX[0] = address;
+			memcpy( myTX + 1, request, length );
+			unsigned short crc = CyclicalRedundancyCheck( myTX, length + 1 );
+			myTX[length+1] = crc >> 8;
+			myTX[length+2] = 0xFF & crc;
+
+			return TransactionRTU( myTX, length + 3, reply, reply_length, msec );
 		}
 
-		error cStation::Query( 
-			unsigned short& value,
-			int reg )
+		error cPort::Transaction(
+			const unsigned char * frame,
+			int frame_length,
+			unsigned char * reply,
+			int& reply_length,
+			int msec )
 		{
+			if( ! IsOpen() )
+				return port_not_open;
 
-			if( 0 > reg || reg > 255 )
-				return bad_register_address;
+			if( myFlagMBAP )
+				return TransactionMBAP( frame[0], frame + 1, frame_length - 3, reply, reply_length, msec );
 
-			// prevent other threads from accessing the cached values
-			boost::mutex::scoped_lock lock( myMutex );
+			return TransactionRTU( frame, frame_length, reply, reply_length, msec );
+		}
 
-			// check if we need to extend the registered polled
-			if( myFirstReg == -1 ) {
-				//first time called
-				myFirstReg = reg;
-				myCount = 1;
-				myError = not_ready;
-			} else {
-				if( reg < myFirstReg ) {
-					myFirstReg = reg;
-					myError = not_ready;
-				} else if ( reg - myFirstReg + 1 > myCount ) {
-					myCount = reg - myFirstReg + 1;
-					myError = not_ready;
-				}
-				
-			}
+		error cPort::TransactionMBAP(
+			int address,
+			const unsigned char * request,
+			int length,
+			unsigned char * reply,
+			int& reply_length,
+			int msec )
+		{
+			unsigned short tid = ++myTransactionID;
+			if( ! SendMBAP( tid, address, request, length ) )
+				return port_not_open;
+			int function = request[0];		// the reply may be read over the request
 
+			// the replies discarded on the way share the one timeout
+			time_point_t deadline = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( msec );
+			for( ; ; ) {
+				int wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+					deadline - boost::chrono::steady_clock::now() ).count();
+				if( wait < 0 )
+					wait = 0;
+				unsigned short reply_tid;
+				int unit;
+				reply_length = ReadMBAP( reply_tid, unit, reply, wait );
+				if( reply_length < 0 )
+					return timed_out;
+				if( reply_tid == tid &&
+					unit == address &&
+					( 0x7F & reply[0] ) == function )
+					return OK;
+				// late reply to an earlier request, or not a reply to this one, discard
+			}
+		}
 
-			// check if we have a good value from last poll
-			if( myError != OK )
-				return myError;
+		error cPort::TransactionRTU(
+			const unsigned char * frame,
+			int frame_length,
+			unsigned char * reply,
+			int& reply_length,
+			int msec )
+		{
+			// discard anything left on the line, such as a late reply to an earlier request
+			Flush();
+
+			// the line must be silent for t3.5 between frames
+			if( myCharTime ) {
+				time_point_t ready = myFrameEnd + boost::chrono::microseconds( mySilence35 );
+				if( boost::chrono::steady_clock::now() < ready )
+					boost::this_thread::sleep_until( ready );
+			}
 
-			// value saved from last poll
-			value = myValue[ reg ];
+			// send the query
+			SendData( frame, frame_length );
 
+			// read the reply
+			int msglen;
+			error err = ReceiveRTU( frame, msglen, msec );
+			if( err != OK )
+				return err;
+
+			// check the reply is intact, and from the station asked
+			unsigned short crc = CyclicalRedundancyCheck( myRX, msglen - 2 );
+			if( myRX[msglen-2] != crc >> 8 || myRX[msglen-1] != ( 0xFF & crc ) )
+				return crc_error;
+			if( myRX[0] != frame[0] )
+				return device_error;
+
+			// strip the address and CRC
+			reply_length = msglen - 3;
+			if( reply_length > 256 )
+				reply_length = 256;
+			memcpy( reply, myRX + 1, reply_length );
 			return OK;
 		}
-		error cStation::Query( 
-			unsigned short* value,
-			int first_reg,
-			int reg_count )
-		{
-			// prevent other threads from accessing the cached values
-			boost::mutex::scoped_lock lock( myMutex );
 
-			// check if we need to extend the registers polled
-			if( myFirstReg == -1 ) {
-				//first time called
-				myFirstReg = first_reg;
-				myCount = reg_count;
-				myError = not_ready;
-			} else {
-				int old_first = myFirstReg;
-				int old_last  = myFirstReg + myCount - 1;
-				int new_first = first_reg;
-				int new_last  = first_reg + reg_count - 1;
-				if( new_first < old_first ) {
+		/**
+
+  Receive an RTU reply frame into myRX
+
+  @param[in] request the request frame, to match the reply against
+  @param[out] length number of bytes in the reply frame
+  @param[in] msec number of milliseconds to wait for the reply to start
+
+  @return error
 
+  The length of the frame is known from the function code and byte count,
+  so this returns as soon as the last byte arrives.  For function codes
+  it does not know, the end of the frame is a silence of t3.5.
+
+  Once a frame has started, the rest must follow within the time
+  to send it plus the t3.5 silence, with an allowance for the serial driver,
+  otherwise the frame is broken.
+
+  A whole frame from another station, or for another function, is a late reply
+  to an earlier request, and is discarded.
+
+  */
+		error cPort::ReceiveRTU(
+			const unsigned char * request,
+			int& length,
+			int msec )
+		{
+			time_point_t deadline = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( msec );
+			int have = 0;			// bytes received
+			int expected = 0;		// bytes in frame, 0 if not known yet, -1 if not known at all
+			for( ; ; ) {
+
+				// how many bytes to wait for, and how long
+				int need;
+				int wait;
+				if( have == 0 ) {
+					// the start of the frame, enough to tell its length
+					need = 3;
+					wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+						deadline - boost::chrono::steady_clock::now() ).count();
+					if( wait <= 0 )
+						return timed_out;
+				} else if( myCharTime ) {
+					// the rest of the frame, which should follow without a break
+					need = expected > 0 ? expected - have : 1;
+					wait = ( need * myCharTime + mySilence35 + 999 ) / 1000 + theConfig.SerialLatency;
 				} else {
-					new_first = old_first;
+					// over TCP the network may split the frame, with no silence to mark its end,
+					// so the rest of a frame of known length has until the deadline
+					need = expected > 0 ? expected - have : 1;
+					wait = theConfig.SerialLatency;
+					if( expected > 0 ) {
+						wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+							deadline - boost::chrono::steady_clock::now() ).count();
+						if( wait < theConfig.SerialLatency )
+							wait = theConfig.SerialLatency;
+					}
 				}
-				if( new_last > old_last ) {
 
+				bool complete = false;
+				if( ! WaitForData( need, wait ) ) {
+					if( have == 0 )
+						return timed_out;
+					if( expected >= 0 )
+						return device_error;		// broken off part way through
+					complete = true;				// silence ends frame of unknown length
 				} else {
-					new_last = old_last;
-				}
-				int new_count = new_last - new_first + 1;
-				if( new_first < old_first ) {
-					myFirstReg = new_first;
-					myError = not_ready;
-				}
-				if( new_count > myCount ) {
-					myCount = new_count;
-					myError = not_ready;
+					int n = ReadData( myRX + have, need );
+					if( n <= 0 )
+						return port_not_open;
+					have += n;
+					if( expected == 0 )
+						expected = ReplyLength( myRX, have );
+					if( expected > 0 && have >= expected )
+						complete = true;
+					if( expected < 0 && have >= (int) sizeof( myRX ) )
+						return device_error;
 				}
+				if( ! complete )
+					continue;
+
+				// is this the reply to this request?
+				if( have >= 2 &&
+					myRX[0] == request[0] &&
+					( 0x7F & myRX[1] ) == request[1] )
+					break;
+
+				// a late reply to an earlier request, discard and keep waiting
+				have = 0;
+				expected = 0;
 			}
 
-			// check if we have a good value from last poll
-			if( myError != OK )
-				return myError;
-
-			for( int k = 0; k < myCount; k++ ) {
-				*value++ = myValue[myFirstReg+k];
-			}
+			myFrameEnd = boost::chrono::steady_clock::now();
+			length = have;
 			return OK;
 		}
 
-		void cStation::Poll()
+		int cPort::ReplyLength( const unsigned char * frame, int have )
 		{
-			raven::set::cRunWatch runwatch("cStation::Poll");
-			if( ! myPort.IsOpen() ) {
-				myError = port_not_open;
-				return;
+			if( have < 2 )
+				return 0;
+
+			// exception, address, function code, exception code and CRC
+			if( frame[1] & 0x80 )
+				return 5;
+
+			switch( frame[1] ) {
+			case 1:
+			case 2:
+			case 3:
+			case 4:
+			case 0x17:
+				// reads, address, function code, byte count, data and CRC
+				if( have < 3 )
+					return 0;
+				return 5 + frame[2];
+			case 5:
+			case 6:
+			case 15:
+			case 16:
+				// writes echo address, function code, register and value or count, and CRC
+				return 8;
+			default:
+				return -1;
 			}
+		}
 
-			unsigned char buf[1000];
+		/**
 
-			// assemble the modbus read command
-			int msglen;
-			buf[0] = myAddress;
-			buf[1] = theConfig.ModbusReadCommand;
-			buf[2] = 0;				// max register 255
-			buf[3] = myFirstReg;
-			buf[4] = 0;
-			buf[5] = myCount;
-			unsigned short crc = CyclicalRedundancyCheck( buf,6);
-			buf[6] = crc >> 8;
-			buf[7] = 0xFF & crc;
-			msglen = 8;
+  Discard any bytes waiting to be read
 
-			// send the query
-			myPort.SendData( 
-				(const unsigned char *)buf,
-				msglen );
-
-			// wait for reply
-
-			/** Wait for data does a 1000Hz poll
-			To prevent it using excessive CPU
-			do an initial 50ms sleep
-			*/
-			Sleep(50);
-			if( !myPort.WaitForData(
-				7,
-				6000 ) ) {
-					myError = timed_out;
-					return;
+  */
+		void cPort::Flush()
+		{
+			while( WaitForData( 1, 0 ) ) {
+				if( ReadData( myRX, sizeof( myRX ) ) <= 0 )
+					break;
 			}
+		}
 
-			// read the reply
-			memset(buf,'\0',1000);
-			msglen = myPort.ReadData(
-				buf,
-				999);
+		/**
 
-			// prevent other threads from accessing the cached values
-			boost::mutex::scoped_lock lock( myMutex );
+  Send request with MBAP header
 
+  @param[in] tid transaction ID
+  @param[in] address modbus unit ID
+  @param[in] request the request PDU
+  @param[in] length number of bytes in request
 
-			// decode reply
+  @return true if sent
 
-			/* The values are returned as 
-				16 bit integers 
-				in 2's complement and
-				network byte order ( MSB first )  */
+  */
+		bool cPort::SendMBAP(
+			unsigned short tid,
+			int address,
+			const unsigned char * request,
+			int length )
+		{
+			myTX[0] = tid >> 8;
+			myTX[1] = 0xFF & tid;
+			myTX[2] = 0;				// protocol ID, always 0 for modbus
+			myTX[3] = 0;
+			myTX[4] = ( length + 1 ) >> 8;
+			myTX[5] = 0xFF & ( length + 1 );
+			myTX[6] = address;
+			memcpy( myTX + 7, request, length );
+			return SendData( myTX, length + 7 ) == length + 7;
+		}
 
-			int iv;
-			union  {
-				short s;
-				unsigned char c[2];
-			} v;
-			for( int k = 0; k < myCount; k++ ) {
-				v.c[0] = buf[4+k*2];
-				v.c[1] = buf[3+k*2];
+		/**
 
-				iv = v.s & 0x7FFF;
-				if( v.s & 0x8000 )
-					iv -= 32767;
-				myValue[k+myFirstReg] = iv;
-			}
+  Read reply with MBAP header
 
-			//printf("Poll OK Station %d, FirstReg %d, Count %d\n",
-			//	myHandle, myFirstReg, myCount );
+  @param[out] tid transaction ID of reply
+  @param[out] unit unit ID of reply
+  @param[out] reply buffer for reply PDU, at least 256 bytes
+  @param[in] msec number of milliseconds to wait for reply
 
-			myError = OK;
+  @return number of bytes in reply PDU, -1 on timeout or bad header
 
-		}
+  A reply whose header arrived but whose PDU did not is given up on,
+  and the rest of it thrown away as it arrives, before the next header
+  is looked for.  So the frames in the stream are not lost track of,
+  even on a socket supplied by the application, which is never reconnected.
 
-		error cStation::Write( cWriteWaiting& W )
+  */
+		int cPort::ReadMBAP(
+			unsigned short& tid,
+			int& unit,
+			unsigned char * reply,
+			int msec )
 		{
-			if( ! myPort.IsOpen() ) {
-				myWriteError = port_not_open;
-				return port_not_open;
+			time_point_t deadline = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( msec );
+
+			// the rest of a reply given up on
+			while( myDiscard ) {
+				unsigned char skip[ 256 ];
+				int wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+					deadline - boost::chrono::steady_clock::now() ).count();
+				if( ! WaitForData( 1, wait < 0 ? 0 : wait ) )
+					return -1;
+				int n = ReadData( skip, std::min( myDiscard, (int) sizeof( skip ) ) );
+				if( n <= 0 )
+					return -1;
+				myDiscard -= n;
 			}
-			if( W.getCount() != 1 ) {
-				myWriteError = NYI;
-				return NYI;
+
+			unsigned char header[7];
+			int wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+				deadline - boost::chrono::steady_clock::now() ).count();
+			if( ! WaitForData( 7, wait < 0 ? 0 : wait ) )
+				return -1;
+			if( ReadData( header, 7 ) != 7 )
+				return -1;
+			tid = header[0] << 8 | header[1];
+			unit = header[6];
+
+			// length counts the unit ID, which is in the header, and the PDU
+			int length = header[4] << 8 | header[5];
+			if( header[2] || header[3] || length < 2 || length > 254 ) {
+				// lost track of the frames in the stream, start again on a new connection
+				Disconnect();
+				return -1;
+			}
+			length--;
+
+			// the network may split the frame, so the PDU has until the deadline,
+			// and at least the time allowed for the rest of a frame on a serial line
+			wait = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+				deadline - boost::chrono::steady_clock::now() ).count();
+			if( wait < theConfig.SerialLatency )
+				wait = theConfig.SerialLatency;
+			if( ! WaitForData( length, wait ) ) {
+				myDiscard = length;
+				return -1;
 			}
+			if( ReadData( reply, length ) != length )
+				return -1;
+			return length;
+		}
+
+		/**
 
-			unsigned char buf[1000];
+  Poll stations on a Modbus TCP port
 
-			// assemble the modbus write command
-			int msglen;
-			buf[0] = myAddress;
-			buf[1] = 6;				// single register read command
-			buf[2] = 0;				// max register 255
-			buf[3] = W.getFirstReg();
-			buf[4] = 0;
-			buf[5] = (unsigned char)W.getValue();
-			unsigned short crc = CyclicalRedundancyCheck( buf,6);
-			buf[6] = crc >> 8;
-			buf[7] = 0xFF & crc;
-			msglen = 8;
+  @param[in] stations to be polled
 
-			// send the query
-			myPort.SendData( 
-				(const unsigned char *)buf,
-				msglen );
-
-			// wait for reply
-
-			/** Wait for data does a 1000Hz poll
-			To prevent it using excessive CPU
-			do an initial 50ms sleep
-			*/
-			Sleep(50);
-			if( !myPort.WaitForData(
-				7,
-				6000 ) ) {
-					myWriteError = timed_out;
-					return timed_out;
+  Up to myInFlight requests are sent before waiting for a reply.
+  As each reply arrives it is matched by transaction ID to the station
+  that sent the request, and another request is sent.  A reply whose
+  unit ID or function code does not match the request is discarded.
+
+  */
+		void cPort::PollPipelined( std::vector< cStation * >& stations )
+		{
+			typedef std::pair< cStation *, cPollRange > request_t;
+
+			// the blocks of registers due on each station
+			std::vector< request_t > request;
+			time_point_t now = boost::chrono::steady_clock::now();
+			foreach( cStation* station, stations ) {
+				std::vector< cPollRange > due;
+				station->Due( due, now );
+				foreach( cPollRange& range, due ) {
+					request.push_back( std::make_pair( station, range ) );
+				}
+			}
+			if( ! IsOpen() ) {
+				foreach( request_t& R, request )
+					R.first->setError( port_not_open, R.second );
+				return;
 			}
 
-			// read the reply
-			memset(buf,'\0',1000);
-			msglen = myPort.ReadData(
-				buf,
-				999);
-
-			if( buf[1] == 6 )
-				return OK;
-			if( buf[1] == 86 ) {
-				myWriteError = device_exception;
-				return device_exception;
+			// requests waiting for a reply, with when they were sent, keyed by transaction ID
+			typedef std::pair< request_t, time_point_t > in_flight_t;
+			typedef std::map< unsigned short, in_flight_t > waiting_t;
+			waiting_t waiting;
+
+			unsigned char pdu[256];
+			unsigned int next = 0;
+			while( next < request.size() || ! waiting.empty() ) {
+
+				// writes go first, once the replies in flight are in
+				if( waiting.empty() )
+					Write();
+
+				// keep the pipeline full, unless writes are waiting
+				while( next < request.size() &&
+					(int) waiting.size() < myInFlight &&
+					myWriteQueue.Empty() ) {
+					request_t& R = request[ next++ ];
+					unsigned short tid = ++myTransactionID;
+					if( ! SendMBAP( tid, R.second.frame[0], R.second.frame + 1,
+						cPollRange::frame_length - 3 ) ) {
+						R.first->setError( port_not_open, R.second );
+						continue;
+					}
+					waiting.insert( std::make_pair( tid,
+						in_flight_t( R, boost::chrono::steady_clock::now() ) ) );
+				}
+				if( waiting.empty() )
+					continue;
+
+				// wait for next reply, until the first request in flight times out
+				// each station has its own timeout
+				time_point_t expire = time_point_t::max();
+				waiting_t::iterator it;
+				for( it = waiting.begin(); it != waiting.end(); it++ ) {
+					time_point_t t = it->second.second +
+						boost::chrono::milliseconds( it->second.first.first->getTimeout() );
+					if( t < expire )
+						expire = t;
+				}
+				int msec = (int) boost::chrono::duration_cast< boost::chrono::milliseconds >(
+					expire - boost::chrono::steady_clock::now() ).count() + 1;
+				if( msec < 1 )
+					msec = 1;
+				unsigned short tid;
+				int unit;
+				int length = ReadMBAP( tid, unit, pdu, msec );
+				if( length < 0 ) {
+					// give up on the requests that have timed out
+					time_point_t now = boost::chrono::steady_clock::now();
+					bool expired = false;
+					for( it = waiting.begin(); it != waiting.end(); ) {
+						request_t& R = it->second.first;
+						if( it->second.second + boost::chrono::milliseconds( R.first->getTimeout() ) <= now ) {
+							R.first->Measure( timed_out, it->second.second,
+								cPollRange::frame_length - 3, 0, 0 );
+							R.first->setError( timed_out, R.second );
+							waiting.erase( it++ );
+							expired = true;
+						} else {
+							it++;
+						}
+					}
+					if( ! expired ) {
+						// no request has timed out, so the connection has failed
+						error err = IsConnected() ? timed_out : port_not_open;
+						for( it = waiting.begin(); it != waiting.end(); it++ )
+							it->second.first.first->setError( err, it->second.first.second );
+						waiting.clear();
+					}
+					continue;
+				}
+				it = waiting.find( tid );
+				if( it == waiting.end() ) {
+					// late reply to a request that has already timed out
+					continue;
+				}
+				request_t& R = it->second.first;
+				if( unit != R.second.frame[0] ||
+					( 0x7F & pdu[0] ) != R.second.frame[1] ) {
+					// the transaction ID matches, but not the station or command,
+					// so not a reply to this request, discard and keep waiting
+					continue;
+				}
+				R.first->Measure( OK, it->second.second,
+					cPollRange::frame_length - 3, pdu, length );
+				R.first->Decode( pdu, length, R.second );
+				waiting.erase( it );
 			}
-			myWriteError = device_error;
-			return device_error;
+		}
 
+		void cPort::Add( cStation * station )
+		{
+			{
+				boost::mutex::scoped_lock lock( myStationMutex );
+				myStation.push_back( station );
+			}
+			Reschedule( station );
 		}
 
+		bool cPort::Push(
+			station_handle_t station,
+			int first_reg,
+			int reg_count,
+			const unsigned short * value,
+			const completion_t& done,
+			bool read )
+		{
+			if( ! myWriteQueue.Push( station, first_reg, reg_count, value, done, read ) )
+				return false;
+
+			// wake the polling thread, if it is asleep
+			// the fence orders the push before the check,
+			// matching the fence in Poll() between setting mySleeping and checking the queue
+			boost::atomic_thread_fence( boost::memory_order_seq_cst );
+			if( mySleeping ) {
+				boost::mutex::scoped_lock lock( myQueueMutex );
+				myWake.notify_one();
+			}
+			return true;
+		}
 
-		cFarmodbus::cFarmodbus(void)
+		void cPort::Write()
 		{
-			// ensure that the app only creates one of these
-			myLastID++;
-			if( ! IsSingleton() )
+			if( myWriteQueue.Empty() )
 				return;
 
-			// start polling thread
-			boost::thread* pThread = new boost::thread(
-				boost::bind(
-				&cFarmodbus::Poll,		// member function
-				this ) );	
+			// take the writes waiting in the queue,
+			// merging writes to adjacent or overlapping registers on the same station
+			// each write can merge only into the last waiting for its station,
+			// so a later write to a register always wins
+			myMerged.clear();
+			cWriteWaiting * waiting;
+			while( ( waiting = myWriteQueue.Front() ) ) {
+				int k;
+				for( k = (int) myMerged.size() - 1; k >= 0; k-- ) {
+					if( myMerged[k].getStation() == waiting->getStation() )
+						break;
+				}
+				if( k < 0 || ! myMerged[k].Merge( *waiting ) )
+					myMerged.push_back( *waiting );
+				myWriteQueue.Pop();
+			}
+
+			// loop over writes
+			foreach( cWriteWaiting& W, myMerged ) {
+				cStation * station = Find( W.getStation() );
+				if( ! station )
+					W.Complete( bad_station_handle );
+				else if( W.IsRead() )
+					station->Read( W );
+				else
+					station->Write( W );
+			}
+
+			// release the completion callbacks
+			myMerged.clear();
 		}
-		void cFarmodbus::Set( cFarmodbusConfig& config )
+
+		void cPort::Reschedule( cStation * station )
 		{
-			theConfig = config;
+			boost::mutex::scoped_lock lock( myQueueMutex );
+			myReschedule.push_back( station );
+			myWake.notify_one();
 		}
 
-		void cFarmodbusConfig::Set( const char* system_name )
+		/**
+
+		Put station into the schedule, at the time its next poll is due
+
+		Any earlier entry for the station is left in the priority queue
+		but is ignored when it reaches the top, since it no longer
+		matches the station's scheduled deadline.
+
+		*/
+		void cPort::Schedule( cStation * station )
 		{
-			if( std::string( system_name ) == std::string("T3000") ) {
+			time_point_t due = station->NextDue();
+			station->setScheduled( due );
+			if( due != time_point_t::max() )
+				mySchedule.push( std::make_pair( due, station ) );
+		}
 
-				// Change configuration defaults to T3000 settings
-				ModbusReadCommand = 3;
+		void cPort::Start()
+		{
+			// start polling thread
+			boost::thread* pThread = new boost::thread(
+				boost::bind(
+				&cPort::Poll,		// member function
+				this ) );
+		}
+
+		cStation * cPort::Find( station_handle_t station )
+		{
+			boost::mutex::scoped_lock lock( myStationMutex );
+			foreach( cStation* s, myStation ) {
+				if( s->getHandle() == station )
+					return s;
 			}
+			return 0;
 		}
 
 		/**
 
-		The polling thread method.
+		The polling thread method for this port.
 
 		This method never returns.
 		It should run in its own thread, and should be the ONLY
-		code that actually does read/writes on the communication ports
+		code that actually does read/writes on this port
 
 		First it checks the write queue, and performs any write reuests.
-		Second it reads all the registers that the application code has requested a read from
-		Third it sleeps for 1 second.
+		Second it polls the stations whose polls are due,
+		checking the write queue again between every read transaction
+		Third it sleeps until the next poll is due, or a write is queued.
 		Repeats for ever
 
 		*/
-		void cFarmodbus::Poll()
+		void cPort::Poll()
 		{
 			// for ever
+			time_point_t awake = boost::chrono::steady_clock::now();
 			for( ; ; ) {
 
-				// loop over writes in queue
-				while( ! myWriteQueue.empty() ) {
-
-					// pop first write from queue
-					cWriteWaiting W = PopWriteFromQueue();
- 
-					// do write
-					myStation[ W.getStation()]->Write( W );
+				// connect, or reconnect, a TCP endpoint owned by the port
+				IsOpen();
 
+				// take all the station changes waiting
+				std::vector< cStation * > reschedule;
+				{
+					boost::mutex::scoped_lock lock( myQueueMutex );
+					reschedule.swap( myReschedule );
 				}
 
-				// loop over stations
-				foreach( cStation* station, myStation ) {
+				// perform the writes waiting
+				Write();
 
-					// poll the station
-					station->Poll();
+				// schedule stations that are new or have changed their poll plan
+				foreach( cStation* station, reschedule ) {
+					Schedule( station );
 				}
 
-				// allow 1 second to elapse between polls
-				Sleep(1000);
-			}
-		}
+				// find the stations that are due
+				time_point_t now = boost::chrono::steady_clock::now();
+				std::vector< cStation * > stations;
+				while( ! mySchedule.empty() && mySchedule.top().first <= now ) {
+					std::pair< time_point_t, cStation * > top = mySchedule.top();
+					mySchedule.pop();
+					if( top.first != top.second->getScheduled() ) {
+						// the station has been rescheduled since this entry was made
+						continue;
+					}
+					stations.push_back( top.second );
+				}
 
-		/**
+				if( stations.size() ) {
 
-		Pop first write from queue
+					if( myFlagMBAP ) {
 
-		@return copy of first write that was waiting on the queue
+						// poll the stations, several requests in flight at once
+						PollPipelined( stations );
 
-		*/
-		cWriteWaiting cFarmodbus::PopWriteFromQueue()
+					} else {
+
+						// loop over stations
+						foreach( cStation* station, stations ) {
+
+							// poll the station
+							station->Poll();
+						}
+					}
+
+					// schedule the next polls
+					foreach( cStation* station, stations ) {
+						Schedule( station );
+					}
+
+					// check for writes before sleeping
+					continue;
+				}
+
+				// sleep until the next poll is due, or something is queued,
+				// or it is time to reconnect
+				time_point_t wake = time_point_t::max();
+				if( ! mySchedule.empty() )
+					wake = mySchedule.top().first;
+				if( ! IsConnected() && myReconnectDue < wake )
+					wake = myReconnectDue;
+				time_point_t now_idle = boost::chrono::steady_clock::now();
+				cMetrics::Count( myMetrics.busy_usec, boost::chrono::duration_cast< boost::chrono::microseconds >(
+					now_idle - awake ).count() );
+				boost::mutex::scoped_lock lock( myQueueMutex );
+				mySleeping = true;
+				boost::atomic_thread_fence( boost::memory_order_seq_cst );
+				if( myWriteQueue.Empty() && myReschedule.empty() ) {
+					if( wake == time_point_t::max() )
+						myWake.wait( lock );
+					else
+						myWake.wait_until( lock, wake );
+				}
+				mySleeping = false;
+				awake = boost::chrono::steady_clock::now();
+			}
+		}
+
+		cRegisterStore::cRegisterStore()
+			: myDirectory( new directory_t() )
+			, mySequence( 0 )
 		{
-			boost::mutex::scoped_lock lock( myWriteQueueMutex );
-			cWriteWaiting W = myWriteQueue.front();
-			myWriteQueue.pop();
-			return W;
 		}
 
-		error cFarmodbus::Add( port_handle_t& handle, ::raven::cSerial& port )
-		{ 
-			myPort.push_back( cPort( port ) );
-			handle = (port_handle_t) myPort.size() - 1;
-			return OK;
+		cRegisterStore::~cRegisterStore()
+		{
+			directory_t * directory = myDirectory.load();
+			for( unsigned int k = 0; k < directory->size(); k++ )
+				delete (*directory)[k];
+			delete directory;
+			for( unsigned int k = 0; k < myRetired.size(); k++ )
+				delete myRetired[k];
 		}
 
-		error cFarmodbus::Add( port_handle_t& handle, SOCKET port )
+		void cRegisterStore::Allocate( int first, int last )
 		{
-			myPort.push_back( cPort( port ) );
-			handle = (port_handle_t) myPort.size() - 1;
-			return OK;
+			directory_t * directory = myDirectory.load();
+			directory_t * copy = 0;
+			for( int index = first >> 8; index <= last >> 8; index++ ) {
+				if( index < (int) directory->size() && (*directory)[ index ] )
+					continue;
+
+				// the published page table must not change, so work on a copy
+				if( ! copy )
+					copy = new directory_t( *directory );
+				if( index >= (int) copy->size() )
+					copy->resize( index + 1, 0 );
+				cPage * page = new cPage;
+				memset( page->value, 0, sizeof( page->value ) );
+				memset( page->status, unregistered, sizeof( page->status ) );
+				(*copy)[ index ] = page;
+			}
+			if( ! copy )
+				return;
 
+			// publish the new page table
+			myDirectory.store( copy, boost::memory_order_release );
+			myRetired.push_back( directory );
 		}
 
-error 
-cFarmodbus::Add(
-		station_handle_t& station_handle,
-		port_handle_t port_handle,
-		int address  )
-{
-	if( 0 > port_handle || port_handle >= (int) myPort.size() )
+		void cRegisterStore::Register( int first, int last )
+		{
+			for( int reg = first; reg <= last; reg++ ) {
+				cPage * page = Page( reg );
+				if( page && page->status[ 0xFF & reg ] == unregistered )
+					page->status[ 0xFF & reg ] = (unsigned char) not_ready;
+			}
+		}
+
+		void cRegisterStore::Set( int first, const unsigned char * data, int count )
+		{
+			for( int k = 0; k < count; ) {
+				int reg = first + k;
+				int offset = 0xFF & reg;
+				int n = std::min( count - k, 256 - offset );
+				cPage * page = Page( reg );
+				if( page ) {
+					Swap( page->value + offset, data + 2 * k, n );
+
+					// registered registers become OK
+					// this relies on OK being 0, unregistered 0xFF
+					unsigned char * status = page->status + offset;
+					int j = 0;
+#ifdef FARMODBUS_SSE2
+					const __m128i all = _mm_set1_epi8( (char) unregistered );
+					for( ; j + 16 <= n; j += 16 ) {
+						__m128i s = _mm_loadu_si128( (const __m128i *)( status + j ) );
+						_mm_storeu_si128( (__m128i *)( status + j ), _mm_cmpeq_epi8( s, all ) );
+					}
+#endif
+					for( ; j < n; j++ ) {
+						if( status[j] != unregistered )
+							status[j] = OK;
+					}
+				}
+				k += n;
+			}
+		}
+
+		void cRegisterStore::Swap( unsigned short * value, const unsigned char * data, int count )
+		{
+#ifdef FARMODBUS_SSE2
+			// 8 registers at a time, swapping the bytes of each 16 bit lane
+			for( ; count >= 8; count -= 8, value += 8, data += 16 ) {
+				__m128i x = _mm_loadu_si128( (const __m128i *) data );
+				x = _mm_or_si128( _mm_slli_epi16( x, 8 ), _mm_srli_epi16( x, 8 ) );
+				_mm_storeu_si128( (__m128i *) value, x );
+			}
+#endif
+			SwapScalar( value, data, count );
+		}
+
+		void cRegisterStore::SwapScalar( unsigned short * value, const unsigned char * data, int count )
+		{
+			for( int k = 0; k < count; k++ )
+				value[k] = (unsigned short)( ( data[ 2 * k ] << 8 ) | data[ 2 * k + 1 ] );
+		}
+
+		bool cRegisterStore::Snapshot(
+			unsigned short * value,
+			int first,
+			int count,
+			error& err )
+		{
+			unsigned int epoch;
+			return Snapshot( value, first, count, err, epoch );
+		}
+
+		bool cRegisterStore::Snapshot(
+			unsigned short * value,
+			int first,
+			int count,
+			error& err,
+			unsigned int& epoch )
+		{
+			for( ; ; ) {
+				unsigned int sequence = mySequence.load( boost::memory_order_acquire );
+				if( sequence & 1 ) {
+					// an update is in progress, it will not take long
+					boost::this_thread::yield();
+					continue;
+				}
+
+				// copy the registers, one page at a time
+				bool registered = true;
+				err = OK;
+				for( int k = 0; k < count; ) {
+					int reg = first + k;
+					int offset = 0xFF & reg;
+					int n = std::min( count - k, 256 - offset );
+					cPage * page = Page( reg );
+					if( ! page ||
+						memchr( page->status + offset, unregistered, n ) ) {
+						registered = false;
+						break;
+					}
+					if( err == OK ) {
+						for( int j = 0; j < n; j++ ) {
+							if( page->status[ offset + j ] != OK ) {
+								err = (error) page->status[ offset + j ];
+								break;
+							}
+						}
+					}
+					memcpy( value + k, page->value + offset, n * sizeof( unsigned short ) );
+					k += n;
+				}
+
+				// check that there was no update while copying
+				boost::atomic_thread_fence( boost::memory_order_acquire );
+				if( mySequence.load( boost::memory_order_relaxed ) == sequence ) {
+					epoch = sequence / 2;
+					return registered;
+				}
+			}
+		}
+
+		cStation::cStation( 
+			int address,
+			cPort& port )
+			: myAddress( address )
+			, myPeriod( theConfig.PollPeriod < 1 ? 1 : theConfig.PollPeriod )
+			, myMaxReadCount( 0 )
+			, myOverruns( 0 )
+			, myScheduled( time_point_t::max() )
+			, myWriteError( OK )
+			, myWriteLatency( 0 )
+			, myWriteLatencyMax( 0 )
+			, myWriteLate( 0 )
+			, mySRTT( 0 )
+			, myRTTVAR( 0 )
+			, myTimeout( theConfig.TimeoutCeiling )
+			, myHealth( healthy )
+			, myMissed( 0 )
+			, myProbes( 0 )
+			, myProbeDue( time_point_t::max() )
+			, myPort( port )
+		{
+			myHandle  = myLastHandle++;
+		}
+
+		error cStation::Query( 
+			unsigned short& value,
+			int reg )
+		{
+
+			if( 0 > reg || reg > 65535 )
+				return bad_register_address;
+
+			return Query( &value, reg, 1 );
+		}
+		error cStation::Query( 
+			unsigned short* value,
+			int first_reg,
+			int reg_count )
+		{
+			unsigned int epoch;
+			return Snapshot( value, first_reg, reg_count, epoch );
+		}
+		error cStation::Snapshot(
+			unsigned short* value,
+			int first_reg,
+			int reg_count,
+			unsigned int& epoch )
+		{
+			if( reg_count < 1 )
+				return bad_register_address;
+
+			// copy the values from last poll, without locking
+			error err;
+			if( myValue.Snapshot( value, first_reg, reg_count, err, epoch ) )
+				return err;
+
+			// prevent other threads from changing the registers polled
+			boost::mutex::scoped_lock lock( myMutex );
+
+			// extend the registers polled
+			if( AddRange( first_reg, first_reg + reg_count - 1 ) )
+				Plan();
+
+			return not_ready;
+		}
+
+		/**
+
+		Add a block of registers to those the application is interested in
+
+		@param[in] first register
+		@param[in] last register
+
+		@return true if novel registers were added
+
+		The blocks are kept sorted and merged, so that no two overlap or touch.
+
+		*/
+		bool cStation::AddRange( int first, int last )
+		{
+			// check if already covered
+			for( unsigned int k = 0; k < myRange.size(); k++ ) {
+				if( myRange[k].first <= first && last <= myRange[k].second )
+					return false;
+			}
+
+			// merge with any blocks that overlap or touch
+			std::vector< std::pair< int, int > > merged;
+			unsigned int k = 0;
+			for( ; k < myRange.size() && myRange[k].second + 1 < first; k++ )
+				merged.push_back( myRange[k] );
+			for( ; k < myRange.size() && myRange[k].first <= last + 1; k++ ) {
+				if( myRange[k].first < first )
+					first = myRange[k].first;
+				if( myRange[k].second > last )
+					last = myRange[k].second;
+			}
+			merged.push_back( std::make_pair( first, last ) );
+			for( ; k < myRange.size(); k++ )
+				merged.push_back( myRange[k] );
+			myRange.swap( merged );
+
+			// storage for the values
+			myValue.Allocate( first, last );
+			myValue.BeginWrite();
+			myValue.Register( first, last );
+			myValue.EndWrite();
+
+			return true;
+		}
+
+		/**
+
+		Plan the read transactions needed to poll the registers the application is interested in
+
+		Registers with different poll periods are never read in the same transaction.
+
+		Each transaction costs a fixed overhead ( theConfig.PollOverhead bytes )
+		plus 2 bytes for every register read, including those in gaps between
+		the blocks of interest that are read only to save a transaction.
+		No transaction may read more than the station's maximum, by default
+		theConfig.MaxReadCount, registers.
+
+		Long blocks are first cut into pieces no longer than the maximum,
+		then a dynamic program finds the grouping of consecutive pieces
+		into transactions that costs the least airtime.
+
+		Transactions that are unchanged keep their schedule, new ones are due at once.
+
+		The port is asked to reschedule the station.
+
+		*/
+		void cStation::Plan()
+		{
+			int max = myMaxReadCount ? myMaxReadCount : theConfig.MaxReadCount;
+			if( max < 1 )
+				max = 1;
+
+			// cut the blocks where the poll period changes
+			std::vector< cPollRange > block;
+			for( unsigned int k = 0; k < myRange.size(); k++ ) {
+				std::vector< int > cut;
+				cut.push_back( myRange[k].first );
+				foreach( cPollRange& p, myPeriodBlock ) {
+					if( myRange[k].first < p.first && p.first <= myRange[k].second )
+						cut.push_back( p.first );
+					if( myRange[k].first <= p.last() && p.last() < myRange[k].second )
+						cut.push_back( p.last() + 1 );
+				}
+				std::sort( cut.begin(), cut.end() );
+				cut.erase( std::unique( cut.begin(), cut.end() ), cut.end() );
+				cut.push_back( myRange[k].second + 1 );
+				for( unsigned int c = 0; c + 1 < cut.size(); c++ ) {
+
+					// the last period set for a block of registers wins
+					int period = myPeriod;
+					foreach( cPollRange& p, myPeriodBlock ) {
+						if( p.first <= cut[c] && cut[c] <= p.last() )
+							period = p.period;
+					}
+					block.push_back( cPollRange( cut[c], cut[c+1] - cut[c], period ) );
+				}
+			}
+
+			// cut the blocks into pieces no longer than a single read
+			std::vector< cPollRange > piece;
+			foreach( cPollRange& b, block ) {
+				for( int first = b.first; first <= b.last(); first += max ) {
+					int last = first + max - 1;
+					if( last > b.last() )
+						last = b.last();
+					piece.push_back( cPollRange( first, last - first + 1, b.period ) );
+				}
+			}
+
+			// best[j] is the least cost of reading the first j pieces
+			// from[j] is the first piece in the last transaction of that solution
+			int n = (int) piece.size();
+			std::vector< int > best( n + 1, 0 );
+			std::vector< int > from( n + 1, 0 );
+			for( int j = 1; j <= n; j++ ) {
+				best[j] = -1;
+				for( int i = j - 1; i >= 0; i-- ) {
+					int span = piece[j-1].last() - piece[i].first + 1;
+					if( span > max || piece[i].period != piece[j-1].period )
+						break;
+					int cost = best[i] + theConfig.PollOverhead + 2 * span;
+					if( best[j] == -1 || cost < best[j] ) {
+						best[j] = cost;
+						from[j] = i;
+					}
+				}
+			}
+
+			// construct the transactions
+			std::vector< cPollRange > plan;
+			for( int j = n; j > 0; j = from[j] ) {
+				int first = piece[ from[j] ].first;
+				plan.insert( plan.begin(),
+					cPollRange( first, piece[j-1].last() - first + 1, piece[j-1].period ) );
+			}
+
+			// keep the schedule of transactions unchanged
+			time_point_t now = boost::chrono::steady_clock::now();
+			foreach( cPollRange& range, plan ) {
+				range.due = now;
+				foreach( cPollRange& old, myPlan ) {
+					if( old.first == range.first &&
+						old.count == range.count &&
+						old.period == range.period ) {
+						range.due = old.due;
+						break;
+					}
+				}
+			}
+
+			// assemble the request frames, so polling need not
+			foreach( cPollRange& range, plan ) {
+				range.frame[0] = myAddress;
+				ReadRequest( range.frame + 1, range );
+				unsigned short crc = cPort::CyclicalRedundancyCheck( range.frame, 6 );
+				range.frame[6] = crc >> 8;
+				range.frame[7] = 0xFF & crc;
+			}
+
+			myPlan.swap( plan );
+
+			myPort.Reschedule( this );
+		}
+
+		void cStation::setPeriod( int msec )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			myPeriod = msec < 1 ? 1 : msec;
+			Plan();
+		}
+
+		void cStation::setMaxReadCount( int count )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			myMaxReadCount = count < 0 ? 0 : count;
+			Plan();
+		}
+
+		void cStation::Replan()
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			Plan();
+		}
+
+		void cStation::setPeriod( int first_reg, int reg_count, int msec )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			myPeriodBlock.push_back( cPollRange( first_reg, reg_count, msec < 1 ? 1 : msec ) );
+			Plan();
+		}
+
+		void cStation::Due( std::vector< cPollRange >& due, time_point_t now )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+
+			if( myHealth == down ) {
+				// probe with the first block, and back off until the next probe
+				// the station comes back up as soon as it answers
+				if( myProbeDue > now || ! myPlan.size() )
+					return;
+				due.push_back( myPlan[0] );
+				myProbes++;
+				myProbeDue = now + boost::chrono::milliseconds( ProbeInterval() );
+				return;
+			}
+
+			foreach( cPollRange& range, myPlan ) {
+				if( range.due > now )
+					continue;
+				due.push_back( range );
+
+				// the period achieved, since this block was last polled
+				if( range.polled != time_point_t() ) {
+					long long usec = boost::chrono::duration_cast< boost::chrono::microseconds >(
+						now - range.polled ).count();
+					myMetrics.period.Add( usec );
+					myPort.getMetrics().period.Add( usec );
+				}
+				range.polled = now;
+
+				// schedule next poll one period after this one was due
+				boost::chrono::milliseconds period( range.period < 1 ? 1 : range.period );
+				range.due += period;
+				if( range.due <= now ) {
+
+					// fallen behind by more than a period
+					// count the overrun and skip the missed polls
+					myOverruns++;
+					range.due += period * ( ( now - range.due ) / period + 1 );
+				}
+			}
+		}
+
+		time_point_t cStation::NextDue()
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			if( myHealth == down )
+				return myProbeDue;
+			time_point_t next = time_point_t::max();
+			foreach( cPollRange& range, myPlan ) {
+				if( range.due < next )
+					next = range.due;
+			}
+			return next;
+		}
+
+		int cStation::ReadRequest( unsigned char * pdu, const cPollRange& range )
+		{
+			// assemble the modbus read command
+			pdu[0] = theConfig.ModbusReadCommand;
+			pdu[1] = range.first >> 8;
+			pdu[2] = 0xFF & range.first;
+			pdu[3] = range.count >> 8;
+			pdu[4] = 0xFF & range.count;
+			return 5;
+		}
+
+		void cStation::Decode(
+			const unsigned char * pdu,
+			int length,
+			const cPollRange& range )
+		{
+			error err = ReplyError( pdu, length, range );
+			if( err != OK ) {
+				setError( err, range );
+				return;
+			}
+
+			// prevent other threads from changing the cached values
+			// readers are not blocked, they see the update through the seqlock
+			boost::mutex::scoped_lock lock( myMutex );
+			myValue.BeginWrite();
+
+			// decode reply
+
+			/* The values are returned as 
+				16 bit integers 
+				in 2's complement and
+				network byte order ( MSB first )  */
+
+			myValue.Set( range.first, pdu + 2, range.count );
+
+			myValue.EndWrite();
+
+			// report changes to subscribers
+			if( ! mySubscription.empty() )
+				Notify( pdu, range );
+
+			//printf("Poll OK Station %d, FirstReg %d, Count %d\n",
+			//	myHandle, range.first, range.count );
+
+		}
+
+		error cStation::ReplyError(
+			const unsigned char * pdu,
+			int length,
+			const cPollRange& range )
+		{
+			if( length >= 1 && ( pdu[0] & 0x80 ) )
+				return device_exception;
+			if( length < 2 ||
+				pdu[0] != theConfig.ModbusReadCommand ||
+				pdu[1] != 2 * range.count ||
+				length < 2 + 2 * range.count )
+				return device_error;
+			return OK;
+		}
+
+		unsigned short cStation::DecodeRegister( const unsigned char * p )
+		{
+			// the 16 bits exactly as read, MSB first
+			return (unsigned short)( ( p[0] << 8 ) | p[1] );
+		}
+
+		/**
+
+		Compare the values in a poll reply with those last reported to each subscriber,
+		and post the changes larger than the subscriber's deadband
+
+		Called with myMutex locked
+
+		*/
+		void cStation::Notify( const unsigned char * pdu, const cPollRange& range )
+		{
+			time_point_t now = boost::chrono::steady_clock::now();
+			std::vector< cChange > batch;
+			foreach( cSubscription& S, mySubscription ) {
+
+				// registers in both the subscription and the reply
+				int first = std::max( S.first, range.first );
+				int last = std::min( S.first + S.count, range.first + range.count ) - 1;
+
+				for( int reg = first; reg <= last; reg++ ) {
+					unsigned short value = DecodeRegister( pdu + 2 + 2 * ( reg - range.first ) );
+					int k = reg - S.first;
+					if( S.valid[k] ) {
+						int change = (short) value - (short) S.reported[k];
+						if( change < 0 )
+							change = -change;
+						if( change <= S.deadband )
+							continue;
+					}
+					cChange C;
+					C.station = myHandle;
+					C.reg = reg;
+					C.value = value;
+					C.previous = S.valid[k] ? S.reported[k] : value;
+					C.time = now;
+					batch.push_back( C );
+					S.reported[k] = value;
+					S.valid[k] = true;
+				}
+				if( batch.size() )
+					theNotifier->Post( S.notify, batch );
+			}
+		}
+
+		void cStation::Subscribe(
+			subscription_handle_t handle,
+			int first_reg,
+			int reg_count,
+			int deadband,
+			const notify_t& notify )
+		{
+			cSubscription S;
+			S.handle = handle;
+			S.first = first_reg;
+			S.count = reg_count;
+			S.deadband = deadband;
+			S.notify = notify;
+			S.reported.resize( reg_count, 0 );
+			S.valid.resize( reg_count, false );
+
+			boost::mutex::scoped_lock lock( myMutex );
+			mySubscription.push_back( S );
+
+			// make sure the registers are polled
+			if( AddRange( first_reg, first_reg + reg_count - 1 ) )
+				Plan();
+		}
+
+		bool cStation::Unsubscribe( subscription_handle_t handle )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			for( unsigned int k = 0; k < mySubscription.size(); k++ ) {
+				if( mySubscription[k].handle == handle ) {
+					mySubscription.erase( mySubscription.begin() + k );
+					return true;
+				}
+			}
+			return false;
+		}
+
+		cNotifier::cNotifier()
+			: myStarted( false )
+		{
+		}
+
+		void cNotifier::Post( const notify_t& notify, std::vector< cChange >& batch )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			if( ! myStarted ) {
+				// start notification thread
+				boost::thread* pThread = new boost::thread(
+					boost::bind(
+					&cNotifier::Run,		// member function
+					this ) );
+				myStarted = true;
+			}
+			myQueue.push_back( post_t( notify, std::vector< cChange >() ) );
+			myQueue.back().second.swap( batch );
+			myWake.notify_one();
+		}
+
+		/**
+
+		The notification thread method
+
+		Takes all the batches posted, and passes them to the subscribers,
+		without holding the lock, so polling threads can post more meanwhile.
+		This method never returns.
+
+		*/
+		void cNotifier::Run()
+		{
+			std::vector< post_t > posted;
+			for( ; ; ) {
+				{
+					boost::mutex::scoped_lock lock( myMutex );
+					while( myQueue.empty() )
+						myWake.wait( lock );
+					posted.swap( myQueue );
+				}
+				foreach( post_t& P, posted ) {
+					P.first( P.second );
+				}
+				posted.clear();
+			}
+		}
+
+		// upper bounds of the histogram buckets, microseconds, 1 2 5 steps
+		static const long long theBound[ cHistogram::bucket_count - 1 ] = {
+			50, 100, 200, 500,
+			1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+			1000000, 2000000, 5000000, 10000000 };
+
+		cHistogram::cHistogram()
+			: mySum( 0 )
+		{
+			for( int k = 0; k < bucket_count; k++ )
+				myCount[k] = 0;
+		}
+
+		void cHistogram::Add( long long usec )
+		{
+			if( usec < 0 )
+				usec = 0;
+			int k = 0;
+			while( k < bucket_count - 1 && usec > theBound[k] )
+				k++;
+			myCount[k].fetch_add( 1, boost::memory_order_relaxed );
+			mySum.fetch_add( (unsigned long long) usec, boost::memory_order_relaxed );
+		}
+
+		void cHistogram::Get( cHistogramSnapshot& snapshot ) const
+		{
+			for( int k = 0; k < bucket_count; k++ )
+				snapshot.count[k] = myCount[k].load( boost::memory_order_relaxed );
+			snapshot.sum = mySum.load( boost::memory_order_relaxed );
+		}
+
+		long long cHistogram::Bound( int bucket )
+		{
+			if( bucket < 0 || bucket >= bucket_count - 1 )
+				return -1;
+			return theBound[ bucket ];
+		}
+
+		cHistogramSnapshot::cHistogramSnapshot()
+			: sum( 0 )
+		{
+			for( int k = 0; k < cHistogram::bucket_count; k++ )
+				count[k] = 0;
+		}
+
+		unsigned long long cHistogramSnapshot::Total() const
+		{
+			unsigned long long total = 0;
+			for( int k = 0; k < cHistogram::bucket_count; k++ )
+				total += count[k];
+			return total;
+		}
+
+		long long cHistogramSnapshot::Percentile( double fraction ) const
+		{
+			unsigned long long total = Total();
+			if( ! total )
+				return 0;
+
+			// the rank of the time at the percentile, from 1
+			double target = fraction * total;
+			unsigned long long rank = (unsigned long long) target;
+			if( rank < target )
+				rank++;
+			if( rank < 1 )
+				rank = 1;
+
+			unsigned long long below = 0;
+			for( int k = 0; k < cHistogram::bucket_count; k++ ) {
+				below += count[k];
+				if( below >= rank )
+					return cHistogram::Bound( k );
+			}
+			return -1;
+		}
+
+		void cHistogramSnapshot::Add( const cHistogramSnapshot& other )
+		{
+			for( int k = 0; k < cHistogram::bucket_count; k++ )
+				count[k] += other.count[k];
+			sum += other.sum;
+		}
+
+		cMetricsSnapshot::cMetricsSnapshot()
+			: requests( 0 )
+			, replies( 0 )
+			, timeouts( 0 )
+			, exceptions( 0 )
+			, crc_errors( 0 )
+			, bad_replies( 0 )
+			, bytes_out( 0 )
+			, bytes_in( 0 )
+			, busy_usec( 0 )
+		{
+		}
+
+		void cMetricsSnapshot::Add( const cMetricsSnapshot& other )
+		{
+			requests += other.requests;
+			replies += other.replies;
+			timeouts += other.timeouts;
+			exceptions += other.exceptions;
+			crc_errors += other.crc_errors;
+			bad_replies += other.bad_replies;
+			bytes_out += other.bytes_out;
+			bytes_in += other.bytes_in;
+			busy_usec += other.busy_usec;
+			rtt.Add( other.rtt );
+			period.Add( other.period );
+		}
+
+		cMetrics::cMetrics()
+			: requests( 0 )
+			, replies( 0 )
+			, timeouts( 0 )
+			, exceptions( 0 )
+			, crc_errors( 0 )
+			, bad_replies( 0 )
+			, bytes_out( 0 )
+			, bytes_in( 0 )
+			, busy_usec( 0 )
+		{
+		}
+
+		void cMetrics::Get( cMetricsSnapshot& snapshot ) const
+		{
+			snapshot.requests = requests.load( boost::memory_order_relaxed );
+			snapshot.replies = replies.load( boost::memory_order_relaxed );
+			snapshot.timeouts = timeouts.load( boost::memory_order_relaxed );
+			snapshot.exceptions = exceptions.load( boost::memory_order_relaxed );
+			snapshot.crc_errors = crc_errors.load( boost::memory_order_relaxed );
+			snapshot.bad_replies = bad_replies.load( boost::memory_order_relaxed );
+			snapshot.bytes_out = bytes_out.load( boost::memory_order_relaxed );
+			snapshot.bytes_in = bytes_in.load( boost::memory_order_relaxed );
+			snapshot.busy_usec = busy_usec.load( boost::memory_order_relaxed );
+			rtt.Get( snapshot.rtt );
+			period.Get( snapshot.period );
+		}
+
+#ifndef _WIN32
+		cSerialPosix::cSerialPosix()
+			: myFD( -1 )
+			, myLowLatency( false )
+			, myBaud( 0 )
+			, myParity( 'N' )
+			, myStopBits( 1 )
+			, myHave( 0 )
+		{
+		}
+
+		cSerialPosix::~cSerialPosix()
+		{
+			Close();
+		}
+
+		bool cSerialPosix::Open(
+			const char * device,
+			int baud,
+			char parity,
+			int stop_bits )
+		{
+			Close();
+
+			speed_t speed;
+			switch( baud ) {
+			case 1200:		speed = B1200;		break;
+			case 2400:		speed = B2400;		break;
+			case 4800:		speed = B4800;		break;
+			case 9600:		speed = B9600;		break;
+			case 19200:		speed = B19200;		break;
+			case 38400:		speed = B38400;		break;
+			case 57600:		speed = B57600;		break;
+			case 115200:	speed = B115200;	break;
+#ifdef B230400
+			case 230400:	speed = B230400;	break;
+#endif
+			default:
+				return false;
+			}
+
+			// non-blocking, so that open does not wait for carrier detect
+			// and reads return at once with whatever has arrived
+			int fd = open( device, O_RDWR | O_NOCTTY | O_NONBLOCK );
+			if( fd < 0 )
+				return false;
+
+			termios tio;
+			if( tcgetattr( fd, &tio ) ) {
+				close( fd );
+				return false;
+			}
+
+			// raw binary: no echo, no line editing, no translation of CR or LF, 8 data bits
+			cfmakeraw( &tio );
+			tio.c_cflag |= CLOCAL | CREAD;
+			tio.c_cflag &= ~( PARENB | PARODD | CSTOPB );
+#ifdef CRTSCTS
+			tio.c_cflag &= ~CRTSCTS;
+#endif
+			switch( parity ) {
+			case 'N':								break;
+			case 'E':	tio.c_cflag |= PARENB;			break;
+			case 'O':	tio.c_cflag |= PARENB | PARODD;	break;
+			default:
+				close( fd );
+				return false;
+			}
+			if( stop_bits == 2 )
+				tio.c_cflag |= CSTOPB;
+
+			// hand over every byte as soon as it arrives, cPort times the frames
+			tio.c_cc[ VMIN ] = 0;
+			tio.c_cc[ VTIME ] = 0;
+
+			cfsetispeed( &tio, speed );
+			cfsetospeed( &tio, speed );
+			if( tcsetattr( fd, TCSANOW, &tio ) ) {
+				close( fd );
+				return false;
+			}
+			tcflush( fd, TCIOFLUSH );
+
+			// low latency mode, where the driver has it
+			// pseudo terminals and some USB adapters do not, which is harmless
+			myLowLatency = false;
+#ifdef ASYNC_LOW_LATENCY
+			serial_struct serial;
+			if( ioctl( fd, TIOCGSERIAL, &serial ) == 0 ) {
+				serial.flags |= ASYNC_LOW_LATENCY;
+				myLowLatency = ( ioctl( fd, TIOCSSERIAL, &serial ) == 0 );
+			}
+#endif
+
+			myFD = fd;
+			myDevice = device;
+			myBaud = baud;
+			myParity = parity;
+			myStopBits = stop_bits;
+			myHave = 0;
+			return true;
+		}
+
+		void cSerialPosix::Close()
+		{
+			if( myFD >= 0 )
+				close( myFD );
+			myFD = -1;
+			myHave = 0;
+		}
+
+		void cSerialPosix::getConfig( std::wstring& text )
+		{
+			char buf[ 300 ];
+			snprintf( buf, sizeof( buf ), "%s %d 8%c%d%s",
+				myDevice.c_str(), myBaud, myParity, myStopBits,
+				myLowLatency ? " low latency" : "" );
+			text.assign( buf, buf + strlen( buf ) );
+		}
+
+		int cSerialPosix::SendData( const unsigned char * msg, int length )
+		{
+			if( myFD < 0 )
+				return 0;
+			int sent = 0;
+			while( sent < length ) {
+				int n = (int) write( myFD, msg + sent, length - sent );
+				if( n > 0 ) {
+					sent += n;
+					continue;
+				}
+				if( n < 0 && errno == EINTR )
+					continue;
+				if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+					return 0;
+
+				// output buffer full, wait for room
+				pollfd p;
+				p.fd = myFD;
+				p.events = POLLOUT;
+				p.revents = 0;
+				if( poll( &p, 1, 1000 ) <= 0 )
+					return 0;
+			}
+			return sent;
+		}
+
+		/**
+
+		Read whatever has arrived into the buffer, without waiting
+
+		*/
+		void cSerialPosix::Fill()
+		{
+			for( ; ; ) {
+				int room = (int) sizeof( myBuffer ) - myHave;
+				if( room <= 0 )
+					return;
+				int n = (int) read( myFD, myBuffer + myHave, room );
+				if( n > 0 ) {
+					myHave += n;
+					continue;
+				}
+				if( n < 0 && errno == EINTR )
+					continue;
+				return;
+			}
+		}
+
+		int cSerialPosix::WaitForData( int len, int msec )
+		{
+			if( myFD < 0 )
+				return 0;
+			if( len > (int) sizeof( myBuffer ) )
+				len = (int) sizeof( myBuffer );
+			time_point_t deadline = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( msec );
+			for( ; ; ) {
+				Fill();
+				if( myHave >= len )
+					return 1;
+
+				long long remaining = boost::chrono::duration_cast< boost::chrono::microseconds >(
+					deadline - boost::chrono::steady_clock::now() ).count();
+				if( remaining <= 0 )
+					return 0;
+
+				// sleep until more data arrives, or deadline
+				pollfd p;
+				p.fd = myFD;
+				p.events = POLLIN;
+				p.revents = 0;
+				int ret = poll( &p, 1, (int)( ( remaining + 999 ) / 1000 ) );
+				if( ret < 0 && errno != EINTR )
+					return 0;
+				if( ret > 0 && ( p.revents & ( POLLERR | POLLHUP | POLLNVAL ) ) ) {
+					// the line has gone, take anything that arrived first
+					Fill();
+					return myHave >= len;
+				}
+			}
+		}
+
+		int cSerialPosix::ReadData( void * buffer, int limit )
+		{
+			if( myFD < 0 )
+				return 0;
+			Fill();
+			int n = std::min( limit, myHave );
+			memcpy( buffer, myBuffer, n );
+			myHave -= n;
+			memmove( myBuffer, myBuffer + n, myHave );
+			return n;
+		}
+#endif
+
+		error cStation::Read( cWriteWaiting& W )
+		{
+			cPollRange range( W.getFirstReg(), W.getCount() );
+			unsigned char pdu[256];
+			int length = ReadRequest( pdu, range );
+
+			// send the query and wait for reply
+			int reply_length = 0;
+			cResult result;
+			time_point_t start = boost::chrono::steady_clock::now();
+			result.err = myPort.Transaction(
+				myAddress,
+				pdu, length,
+				pdu, reply_length,
+				myTimeout );
+			Measure( result.err, start, length, pdu, reply_length );
+			if( result.err == OK )
+				result.err = ReplyError( pdu, reply_length, range );
+			if( result.err == OK ) {
+
+				// refresh the cache, for any of these registers that are also polled
+				Decode( pdu, reply_length, range );
+
+				for( int k = 0; k < range.count; k++ )
+					result.value.push_back( DecodeRegister( pdu + 2 + k * 2 ) );
+			}
+
+			W.Complete( result );
+			return result.err;
+		}
+
+		void cStation::Measure(
+			error err,
+			time_point_t start,
+			int request_length,
+			const unsigned char * reply,
+			int reply_length )
+		{
+			if( err == port_not_open )
+				return;
+			cMetrics& port = myPort.getMetrics();
+			cMetrics::Count( myMetrics.requests );
+			cMetrics::Count( port.requests );
+			cMetrics::Count( myMetrics.bytes_out, request_length );
+
+			if( err == timed_out ) {
+				cMetrics::Count( myMetrics.timeouts );
+				cMetrics::Count( port.timeouts );
+				TimedOut();
+				return;
+			}
+
+			// the device replied, even if the reply was an error
+			int usec = (int) boost::chrono::duration_cast< boost::chrono::microseconds >(
+				boost::chrono::steady_clock::now() - start ).count();
+			myMetrics.rtt.Add( usec );
+			port.rtt.Add( usec );
+			if( err == crc_error ) {
+				cMetrics::Count( myMetrics.crc_errors );
+				cMetrics::Count( port.crc_errors );
+			} else if( err != OK ) {
+				cMetrics::Count( myMetrics.bad_replies );
+				cMetrics::Count( port.bad_replies );
+			} else {
+				cMetrics::Count( myMetrics.replies );
+				cMetrics::Count( port.replies );
+				cMetrics::Count( myMetrics.bytes_in, reply_length );
+				if( reply_length >= 1 && ( reply[0] & 0x80 ) ) {
+					cMetrics::Count( myMetrics.exceptions );
+					cMetrics::Count( port.exceptions );
+				}
+			}
+			RoundTrip( usec );
+		}
+
+		/**
+
+		Update the round trip estimates, and the timeout derived from them
+
+		The same smoothing as a TCP retransmission timer ( RFC 6298 ):
+		the smoothed round trip time moves 1/8 of the way to each measurement,
+		its variation 1/4 of the way to the difference, and the timeout
+		is the smoothed time plus four times the variation.
+
+		*/
+		void cStation::RoundTrip( int usec )
+		{
+			if( mySRTT == 0 ) {
+				// first measurement
+				mySRTT = usec;
+				myRTTVAR = usec / 2;
+			} else {
+				int difference = mySRTT - usec;
+				if( difference < 0 )
+					difference = -difference;
+				myRTTVAR = ( 3 * myRTTVAR + difference ) / 4;
+				mySRTT = ( 7 * mySRTT + usec ) / 8;
+			}
+			int timeout = ( mySRTT + 4 * myRTTVAR + 999 ) / 1000;
+			if( timeout < theConfig.TimeoutFloor )
+				timeout = theConfig.TimeoutFloor;
+			if( timeout > theConfig.TimeoutCeiling )
+				timeout = theConfig.TimeoutCeiling;
+			myTimeout = timeout;
+
+			// the station has answered, so is healthy
+			myMissed = 0;
+			if( myHealth == down ) {
+				// back into the poll sequence, with every block due now
+				{
+					boost::mutex::scoped_lock lock( myMutex );
+					time_point_t now = boost::chrono::steady_clock::now();
+					foreach( cPollRange& range, myPlan )
+						range.due = now;
+					myProbeDue = time_point_t::max();
+					myHealth = healthy;
+				}
+				myPort.Reschedule( this );
+			}
+			myHealth = healthy;
+		}
+
+		void cStation::TimedOut()
+		{
+			// back off, in case the device has slowed down
+			// rather than stopped, so its replies can be measured again
+			int timeout = 2 * myTimeout;
+			if( timeout > theConfig.TimeoutCeiling )
+				timeout = theConfig.TimeoutCeiling;
+			myTimeout = timeout;
+
+			myMissed++;
+			if( myHealth == down )
+				return;
+			if( myMissed < theConfig.DownAfter ) {
+				myHealth = suspect;
+				return;
+			}
+
+			// stop polling, and probe instead
+			boost::mutex::scoped_lock lock( myMutex );
+			myHealth = down;
+			myProbes = 0;
+			myProbeDue = boost::chrono::steady_clock::now() +
+				boost::chrono::milliseconds( ProbeInterval() );
+		}
+
+		/**
+
+		Milliseconds until the next probe of a down station
+
+		The interval doubles with each probe, from ProbeMin up to ProbeMax,
+		and is then shortened by a random amount up to half of it ( "equal jitter" ),
+		so that the stations on a bus which went down together drift apart.
+
+		*/
+		int cStation::ProbeInterval()
+		{
+			int interval = theConfig.ProbeMin;
+			for( int k = 0; k < myProbes && interval < theConfig.ProbeMax; k++ )
+				interval *= 2;
+			if( interval > theConfig.ProbeMax )
+				interval = theConfig.ProbeMax;
+			int half = interval / 2;
+			return interval - half + rand() % ( half + 1 );
+		}
+
+		void cStation::setError( error err )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			myValue.BeginWrite();
+			for( unsigned int k = 0; k < myRange.size(); k++ ) {
+				for( int reg = myRange[k].first; reg <= myRange[k].second; reg++ )
+					myValue.setStatus( reg, err );
+			}
+			myValue.EndWrite();
+		}
+
+		void cStation::setError( error err, const cPollRange& range )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			myValue.BeginWrite();
+			for( int reg = range.first; reg <= range.last(); reg++ )
+				myValue.setStatus( reg, err );
+			myValue.EndWrite();
+		}
+
+		void cStation::Poll()
+		{
+			raven::set::cRunWatch runwatch("cStation::Poll");
+
+			std::vector< cPollRange > due;
+			Due( due, boost::chrono::steady_clock::now() );
+
+			unsigned char pdu[256];
+			foreach( cPollRange& range, due ) {
+
+				// writes go first
+				myPort.Write();
+
+				// send the query, assembled when the plan was made, and wait for reply
+				int reply_length = 0;
+				time_point_t start = boost::chrono::steady_clock::now();
+				error err = myPort.Transaction(
+					range.frame, cPollRange::frame_length,
+					pdu, reply_length,
+					myTimeout );
+				Measure( err, start, cPollRange::frame_length - 3, pdu, reply_length );
+				if( err != OK ) {
+					// no point asking for the rest if the device is not answering
+					setError( err );
+					return;
+				}
+
+				Decode( pdu, reply_length, range );
+			}
+		}
+
+		error cStation::Write( cWriteWaiting& W )
+		{
+			// loop over commands needed for the write
+			for( int done = 0; done < W.getCount(); ) {
+
+				int reg = W.getFirstReg() + done;
+				int count = W.getCount() - done;
+				if( count > cWriteWaiting::max_count )
+					count = cWriteWaiting::max_count;
+
+				// assemble the modbus write command
+				unsigned char pdu[256];
+				int length;
+				if( count == 1 ) {
+					pdu[0] = 6;				// single register write command
+					pdu[1] = reg >> 8;
+					pdu[2] = 0xFF & reg;
+					pdu[3] = W.getValue( done ) >> 8;
+					pdu[4] = 0xFF & W.getValue( done );
+					length = 5;
+				} else {
+					pdu[0] = 16;			// multiple register write command
+					pdu[1] = reg >> 8;
+					pdu[2] = 0xFF & reg;
+					pdu[3] = count >> 8;
+					pdu[4] = 0xFF & count;
+					pdu[5] = 2 * count;
+					for( int k = 0; k < count; k++ ) {
+						pdu[6+2*k] = W.getValue( done + k ) >> 8;
+						pdu[7+2*k] = 0xFF & W.getValue( done + k );
+					}
+					length = 6 + 2 * count;
+				}
+				unsigned char command = pdu[0];
+
+				// send the command and wait for reply
+				int reply_length = 0;
+				time_point_t start = boost::chrono::steady_clock::now();
+				error err = myPort.Transaction(
+					myAddress,
+					pdu, length,
+					pdu, reply_length,
+					myTimeout );
+				Measure( err, start, length, pdu, reply_length );
+				if( err == OK ) {
+					if( reply_length < 1 || pdu[0] != command ) {
+						if( reply_length >= 1 && ( pdu[0] & 0x80 ) )
+							err = device_exception;
+						else
+							err = device_error;
+					}
+				}
+				if( err != OK ) {
+					myWriteError = err;
+					W.Complete( err );
+					return err;
+				}
+
+				done += count;
+			}
+
+			// record how long the write took, from being queued by the application
+			int latency = (int) boost::chrono::duration_cast< boost::chrono::microseconds >(
+				boost::chrono::steady_clock::now() - W.getQueued() ).count();
+			myWriteLatency = latency;
+			if( latency > myWriteLatencyMax )
+				myWriteLatencyMax = latency;
+			if( latency > 1000 * theConfig.WriteLatency )
+				myWriteLate++;
+
+			W.Complete( OK );
+			return OK;
+
+		}
+
+
+		cFarmodbus::cFarmodbus(void)
+		{
+			// ensure that the app only creates one of these
+			myLastID++;
+		}
+		void cFarmodbus::Set( cFarmodbusConfig& config )
+		{
+			theConfig = config;
+
+			// the plans were made with the old configuration
+			foreach( cStation * station, myStation )
+				station->Replan();
+		}
+
+		void cFarmodbusConfig::Set( const char* system_name )
+		{
+			if( std::string( system_name ) == std::string("T3000") ) {
+
+				// Change configuration defaults to T3000 settings
+				ModbusReadCommand = 3;
+			}
+		}
+
+		error cFarmodbus::Add( port_handle_t& handle, ::raven::cSerial& port )
+		{
+#ifdef _WIN32
+			return Add( handle, port, 9600 );
+#else
+			// the port knows the rate it was opened with
+			return Add( handle, port, port.IsOpened() ? port.getBaud() : 9600 );
+#endif
+		}
+
+		error cFarmodbus::Add( port_handle_t& handle, ::raven::cSerial& port, int baud )
+		{ 
+			return AddPort( handle, std::vector< cPort * >( 1, new cPort( port, baud ) ) );
+		}
+
+		error cFarmodbus::Add( port_handle_t& handle, SOCKET port )
+		{
+			return AddPort( handle, std::vector< cPort * >( 1, new cPort( port ) ) );
+
+		}
+
+		error cFarmodbus::AddModbusTCP( port_handle_t& handle, SOCKET port, int in_flight )
+		{
+			return AddPort( handle, std::vector< cPort * >( 1, new cPort( port, in_flight ) ) );
+		}
+
+		error cFarmodbus::Add( port_handle_t& handle, const char * endpoint, int connections )
+		{
+			std::string host, service;
+			if( ! cPort::ParseEndpoint( endpoint, host, service ) )
+				return bad_endpoint;
+			if( connections < 1 )
+				connections = 1;
+			std::vector< cPort * > connection;
+			for( int k = 0; k < connections; k++ ) {
+				connection.push_back( new cPort( INVALID_SOCKET ) );
+				connection.back()->setEndpoint( host, service );
+			}
+			return AddPort( handle, connection );
+		}
+
+		error cFarmodbus::AddModbusTCP( port_handle_t& handle, const char * endpoint, int in_flight, int connections )
+		{
+			std::string host, service;
+			if( ! cPort::ParseEndpoint( endpoint, host, service ) )
+				return bad_endpoint;
+			if( connections < 1 )
+				connections = 1;
+			std::vector< cPort * > connection;
+			for( int k = 0; k < connections; k++ ) {
+				connection.push_back( new cPort( INVALID_SOCKET, in_flight ) );
+				connection.back()->setEndpoint( host, service );
+			}
+			return AddPort( handle, connection );
+		}
+
+		error cFarmodbus::AddPort( port_handle_t& handle, const std::vector< cPort * >& connection )
+		{
+			myPort.push_back( connection );
+			handle = (port_handle_t) myPort.size() - 1;
+			if( IsSingleton() ) {
+				// each connection is polled in its own thread
+				foreach( cPort * port, connection )
+					port->Start();
+			}
+			return OK;
+		}
+
+		error cFarmodbus::getConnection( bool& connected, int& connects, port_handle_t port )
+		{
+			if( 0 > port || port >= (int) myPort.size() )
+				return bad_port_handle;
+			connected = true;
+			connects = 0;
+			foreach( cPort * P, myPort[ port ] ) {
+				if( ! P->IsConnected() )
+					connected = false;
+				connects += P->getConnects();
+			}
+			return OK;
+		}
+
+error 
+cFarmodbus::Add(
+		station_handle_t& station_handle,
+		port_handle_t port_handle,
+		int address  )
+{
+	if( 0 > port_handle || port_handle >= (int) myPort.size() )
 		return bad_port_handle;
 
-	/* Construct a new station and store a pointer to it
+	// the connection to the port that carries this station,
+	// shared out by address if the port has several
+	std::vector< cPort * >& connection = myPort[port_handle];
+	cPort * port = connection[ ( 0xFF & address ) % connection.size() ];
+
+	/* Construct a new station and store a pointer to it
+
+	The stations will exist for the lifetime of the program
+
+	( if this causes a memory leak, then we will need to add
+	  a method to remove the station )
+
+	  Storing a pointer is neccessary because the mutex protecting
+	  the cached values makes the station class non-copyable
+    */
+	myStation.push_back( new cStation( address, 
+									*port ) );
+
+	// tell the port to start polling the new station
+	port->Add( myStation.back() );
+
+	station_handle = (port_handle_t) myStation.size() - 1;
+
+	return OK;
+}
+
+
+error cFarmodbus::Query(
+		unsigned short& value,
+		station_handle_t station,
+		int reg )
+{ 
+	raven::set::cRunWatch runwatch("cFarmodbus::Query-1");
+	// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+	if( 0 > reg || reg > 65535 )
+		return bad_register_address;
+
+	return myStation[station]->Query( value, reg );
+
+}
+error cFarmodbus::Query(
+	unsigned short* value,
+	station_handle_t station,
+	int first_reg,
+	int reg_count )
+{
+	raven::set::cRunWatch runwatch("cFarmodbus::Query-2");
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+	if( 0 > first_reg || first_reg > 65535 )
+		return bad_register_address;
+	if( first_reg + reg_count - 1 > 65535 )
+		return bad_register_address;
+
+	return myStation[station]->Query( value, first_reg, reg_count );
+}
+
+error cFarmodbus::Snapshot(
+	unsigned short* value,
+	std::vector< cSlice >& slice )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+
+	error first_err = OK;
+	foreach( cSlice& S, slice ) {
+		if( 0 > S.station || S.station >= (int) myStation.size() )
+			S.err = bad_station_handle;
+		else if( 0 > S.first || S.count < 1 || S.first + S.count - 1 > 65535 )
+			S.err = bad_register_address;
+		else
+			S.err = myStation[ S.station ]->Snapshot( value, S.first, S.count, S.epoch );
+		if( first_err == OK )
+			first_err = S.err;
+		if( S.count > 0 )
+			value += S.count;
+	}
+	return first_err;
+}
+
+error cFarmodbus::Write(
+			station_handle_t station,
+		int first_reg,
+		int reg_count,
+		unsigned short * value )
+ { 
+	 		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+	if( 0 > first_reg || first_reg > 65535 )
+		return bad_register_address;
+	if( first_reg + reg_count - 1 > 65535 )
+		return bad_register_address;
+
+	if( reg_count < 1 )
+		return bad_register_address;
+
+	// Add the write to the end of the write queue of the station's port
+	// This will be executed in the port's polling thread
+	// next time it wakes up
+	// Writes too long for one command are split, and queued whole or not at all
+	if( ! myStation[ station ]->getPort().Push(
+		station, first_reg, reg_count, value ) )
+		return write_queue_full;
+
+	// return immediatly, with error return from PREVIOUS poll
+	return myStation[ station ]->getWriteError(); 
+}
+
+error cFarmodbus::Write(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		unsigned short * value,
+		completion_t done )
+{
+	return Queue( station, first_reg, reg_count, value, done, false );
+}
+
+error cFarmodbus::Read(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		completion_t done )
+{
+	return Queue( station, first_reg, reg_count, 0, done, true );
+}
 
-	The stations will exist for the lifetime of the program
+error cFarmodbus::Queue(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		const completion_t& done,
+		bool read )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+	if( 0 > first_reg || first_reg > 65535 )
+		return bad_register_address;
+	if( reg_count < 1 || reg_count > cWriteWaiting::max_count ||
+		first_reg + reg_count - 1 > 65535 )
+		return bad_register_address;
 
-	( if this causes a memory leak, then we will need to add
-	  a method to remove the station )
+	if( ! myStation[ station ]->getPort().Push(
+		station, first_reg, reg_count, value, done, read ) )
+		return write_queue_full;
 
-	  Storing a pointer is neccessary because the mutex protecting
-	  the cached values makes the station class non-copyable
-    */
-	myStation.push_back( new cStation( address, 
-									myPort[port_handle] ) );
+	return OK;
+}
 
-	station_handle = (port_handle_t) myStation.size() - 1;
+/// Completion callback that delivers the result through a promise
+class cFulfil {
+public:
+	cFulfil( const boost::shared_ptr< boost::promise< cResult > >& promise )
+		: myPromise( promise )
+	{}
+	void operator()( const cResult& result )
+	{
+		myPromise->set_value( result );
+	}
+private:
+	boost::shared_ptr< boost::promise< cResult > > myPromise;
+};
 
-	return OK;
+boost::shared_future< cResult > cFarmodbus::QueueAsync(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		bool read )
+{
+	boost::shared_ptr< boost::promise< cResult > > promise(
+		new boost::promise< cResult > );
+	boost::shared_future< cResult > future( promise->get_future() );
+
+	error err = Queue( station, first_reg, reg_count, value,
+		cFulfil( promise ), read );
+	if( err != OK ) {
+		// the request never reached the queue, so report the error now
+		cResult result;
+		result.err = err;
+		result.time = boost::chrono::steady_clock::now();
+		promise->set_value( result );
+	}
+	return future;
 }
 
+boost::shared_future< cResult > cFarmodbus::WriteAsync(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		unsigned short * value )
+{
+	return QueueAsync( station, first_reg, reg_count, value, false );
+}
 
-error cFarmodbus::Query(
-		unsigned short& value,
+boost::shared_future< cResult > cFarmodbus::ReadAsync(
 		station_handle_t station,
-		int reg )
-{ 
-	raven::set::cRunWatch runwatch("cFarmodbus::Query-1");
-	// firewall
+		int first_reg,
+		int reg_count )
+{
+	return QueueAsync( station, first_reg, reg_count, 0, true );
+}
+
+error cFarmodbus::Write(
+		station_handle_t station,
+		int reg,
+		unsigned short value )
+ {
+	 // Convert this to a block write of count 1
+	 return Write( station, reg, 1, &value );
+}
+
+error cFarmodbus::SetPollPeriod(
+		station_handle_t station,
+		int msec )
+{
+		// firewall
 	if( ! IsSingleton() )
 		return not_singleton;
 	if( 0 > station || station >= (int) myStation.size() )
 		return bad_station_handle;
-	if( 0 > reg || reg > 255 )
-		return bad_register_address;
-
-	return myStation[station]->Query( value, reg );
 
+	myStation[ station ]->setPeriod( msec < 1 ? 1 : msec );
+	return OK;
 }
-error cFarmodbus::Query(
-	unsigned short* value,
-	station_handle_t station,
-	int first_reg,
-	int reg_count )
+
+error cFarmodbus::SetPollPeriod(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		int msec )
 {
-	raven::set::cRunWatch runwatch("cFarmodbus::Query-2");
 		// firewall
 	if( ! IsSingleton() )
 		return not_singleton;
 	if( 0 > station || station >= (int) myStation.size() )
 		return bad_station_handle;
-	if( 0 > first_reg || first_reg > 255 )
+	if( 0 > first_reg || first_reg > 65535 )
 		return bad_register_address;
-	if( first_reg + reg_count - 1 > 255 )
+	if( reg_count < 1 || first_reg + reg_count - 1 > 65535 )
 		return bad_register_address;
 
-	return myStation[station]->Query( value, first_reg, reg_count );
+	myStation[ station ]->setPeriod( first_reg, reg_count, msec < 1 ? 1 : msec );
+	return OK;
 }
 
+error cFarmodbus::SetMaxReadCount(
+		station_handle_t station,
+		int count )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
 
-error cFarmodbus::Write(
-			station_handle_t station,
+	myStation[ station ]->setMaxReadCount( count > 125 ? 125 : count );
+	return OK;
+}
+
+error cFarmodbus::getPollOverruns(
+		int& count,
+		station_handle_t station )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+
+	count = myStation[ station ]->getOverrunCount();
+	return OK;
+}
+error cFarmodbus::getRoundTrip(
+		int& srtt,
+		int& rttvar,
+		int& timeout,
+		station_handle_t station )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+
+	myStation[ station ]->getRoundTrip( srtt, rttvar, timeout );
+	return OK;
+}
+error cFarmodbus::getHealth(
+		health& state,
+		int& missed,
+		station_handle_t station )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+
+	state = myStation[ station ]->getHealth();
+	missed = myStation[ station ]->getMissed();
+	return OK;
+}
+error cFarmodbus::Subscribe(
+		subscription_handle_t& handle,
+		station_handle_t station,
 		int first_reg,
 		int reg_count,
-		unsigned short * value )
- { 
-	 		// firewall
+		int deadband,
+		notify_t notify )
+{
+		// firewall
 	if( ! IsSingleton() )
 		return not_singleton;
 	if( 0 > station || station >= (int) myStation.size() )
 		return bad_station_handle;
-	if( 0 > first_reg || first_reg > 255 )
+	if( 0 > first_reg || first_reg > 65535 )
 		return bad_register_address;
-	if( first_reg + reg_count - 1 > 255 )
+	if( reg_count < 1 || first_reg + reg_count - 1 > 65535 )
 		return bad_register_address;
 
-	// Add the write to the end of the write queue
-	// This will be executed in the polling thread
-	// next time it wakes up
+	boost::mutex::scoped_lock lock( mySubscriptionMutex );
+	mySubscription.push_back( station );
+	handle = (subscription_handle_t) mySubscription.size() - 1;
+	myStation[ station ]->Subscribe( handle, first_reg, reg_count, deadband, notify );
+	return OK;
+}
+error cFarmodbus::Unsubscribe( subscription_handle_t handle )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	boost::mutex::scoped_lock lock( mySubscriptionMutex );
+	if( 0 > handle || handle >= (int) mySubscription.size() )
+		return bad_subscription_handle;
 
-	boost::mutex::scoped_lock lock( myWriteQueueMutex );
-	myWriteQueue.push( cWriteWaiting( station, first_reg, reg_count, value ) );
+	if( ! myStation[ mySubscription[ handle ] ]->Unsubscribe( handle ) )
+		return bad_subscription_handle;
+	return OK;
+}
+error cFarmodbus::getWriteLatency(
+		int& last,
+		int& max,
+		int& late,
+		station_handle_t station )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
 
-	// return immediatly, with error return from PREVIOUS poll
-	return myStation[ station ]->getWriteError(); 
+	myStation[ station ]->getWriteLatency( last, max, late );
+	return OK;
 }
+error cFarmodbus::getPortMetrics( cMetricsSnapshot& metrics, port_handle_t port )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > port || port >= (int) myPort.size() )
+		return bad_port_handle;
 
-error cFarmodbus::Write(
-		station_handle_t station,
-		int reg,
-		unsigned short value )
- {
-	 // Convert this to a block write of count 1
-	 return Write( station, reg, 1, &value );
+	metrics = cMetricsSnapshot();
+	foreach( cPort * connection, myPort[ port ] ) {
+		cMetricsSnapshot M;
+		connection->getMetrics().Get( M );
+		metrics.Add( M );
+	}
+	return OK;
+}
+error cFarmodbus::getStationMetrics( cMetricsSnapshot& metrics, station_handle_t station )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+	if( 0 > station || station >= (int) myStation.size() )
+		return bad_station_handle;
+
+	myStation[ station ]->getMetrics().Get( metrics );
+	return OK;
+}
+
+	// the metrics of a port or station, with its labels
+	typedef std::pair< std::string, cMetricsSnapshot > labelled_t;
+
+/**
+
+  Append a counter to the text exposition
+
+  @param[in,out] text
+  @param[in] source metrics of the ports, then the stations
+  @param[in] ports number of ports in source, the rest are stations
+  @param[in] name of the counter
+  @param[in] help what it counts
+  @param[in] counter the counter in the snapshot
+  @param[in] port_only true if the counter is not kept for stations
+
+*/
+static void TextCounter(
+	std::string& text,
+	const std::vector< labelled_t >& source,
+	int ports,
+	const char * name,
+	const char * help,
+	unsigned long long cMetricsSnapshot::* counter,
+	bool port_only = false )
+{
+	char line[ 200 ];
+	sprintf( line, "# HELP farmodbus_%s_total %s\n# TYPE farmodbus_%s_total counter\n", name, help, name );
+	text += line;
+	int count = port_only ? ports : (int) source.size();
+	for( int k = 0; k < count; k++ ) {
+		sprintf( line, "farmodbus_%s_total{%s} %llu\n",
+			name, source[k].first.c_str(), source[k].second.*counter );
+		text += line;
+	}
+}
+
+/**
+
+  Append a histogram to the text exposition
+
+  @param[in,out] text
+  @param[in] source metrics of the ports and stations
+  @param[in] name of the histogram
+  @param[in] help what it counts
+  @param[in] histogram the histogram in the snapshot
+
+*/
+static void TextHistogram(
+	std::string& text,
+	const std::vector< labelled_t >& source,
+	const char * name,
+	const char * help,
+	cHistogramSnapshot cMetricsSnapshot::* histogram )
+{
+	char line[ 200 ];
+	sprintf( line, "# HELP farmodbus_%s %s\n# TYPE farmodbus_%s histogram\n", name, help, name );
+	text += line;
+	foreach( const labelled_t& L, source ) {
+		const cHistogramSnapshot& H = L.second.*histogram;
+		unsigned long long below = 0;
+		for( int b = 0; b < cHistogram::bucket_count; b++ ) {
+			below += H.count[b];
+			long long bound = cHistogram::Bound( b );
+			if( bound < 0 )
+				sprintf( line, "farmodbus_%s_bucket{%s,le=\"+Inf\"} %llu\n",
+					name, L.first.c_str(), below );
+			else
+				sprintf( line, "farmodbus_%s_bucket{%s,le=\"%lld\"} %llu\n",
+					name, L.first.c_str(), bound, below );
+			text += line;
+		}
+		sprintf( line, "farmodbus_%s_sum{%s} %llu\nfarmodbus_%s_count{%s} %llu\n",
+			name, L.first.c_str(), H.sum,
+			name, L.first.c_str(), below );
+		text += line;
+	}
+}
+
+error cFarmodbus::getMetricsText( std::string& text )
+{
+		// firewall
+	if( ! IsSingleton() )
+		return not_singleton;
+
+	// the ports, then the stations labelled with their port
+	std::vector< labelled_t > source;
+	char label[ 100 ];
+	for( int p = 0; p < (int) myPort.size(); p++ ) {
+		sprintf( label, "port=\"%d\"", p );
+		source.push_back( labelled_t( label, cMetricsSnapshot() ) );
+		getPortMetrics( source.back().second, p );
+	}
+	int ports = (int) source.size();
+	for( int s = 0; s < (int) myStation.size(); s++ ) {
+		int port = -1;
+		for( int p = 0; p < (int) myPort.size() && port < 0; p++ ) {
+			foreach( cPort * connection, myPort[p] ) {
+				if( connection == &myStation[s]->getPort() )
+					port = p;
+			}
+		}
+		sprintf( label, "port=\"%d\",station=\"%d\",address=\"%d\"",
+			port, s, myStation[s]->getAddress() );
+		source.push_back( labelled_t( label, cMetricsSnapshot() ) );
+		myStation[s]->getMetrics().Get( source.back().second );
+	}
+
+	text.clear();
+	TextCounter( text, source, ports, "requests", "Transactions answered or timed out.", &cMetricsSnapshot::requests );
+	TextCounter( text, source, ports, "replies", "Transactions answered with an intact reply.", &cMetricsSnapshot::replies );
+	TextCounter( text, source, ports, "timeouts", "Transactions not answered in time.", &cMetricsSnapshot::timeouts );
+	TextCounter( text, source, ports, "exceptions", "Replies that were modbus exceptions.", &cMetricsSnapshot::exceptions );
+	TextCounter( text, source, ports, "crc_errors", "Replies that failed the CRC check.", &cMetricsSnapshot::crc_errors );
+	TextCounter( text, source, ports, "bad_replies", "Replies broken off or from the wrong station.", &cMetricsSnapshot::bad_replies );
+	TextCounter( text, source, ports, "bytes_out", "Bytes sent, on the line for ports, PDU for stations.", &cMetricsSnapshot::bytes_out );
+	TextCounter( text, source, ports, "bytes_in", "Bytes received, on the line for ports, PDU for stations.", &cMetricsSnapshot::bytes_in );
+	TextCounter( text, source, ports, "busy_usec", "Microseconds the polling thread was not asleep.", &cMetricsSnapshot::busy_usec, true );
+	TextHistogram( text, source, "rtt_usec", "Round trip time of the transactions answered, microseconds.", &cMetricsSnapshot::rtt );
+	TextHistogram( text, source, "poll_period_usec", "Time between polls of each block of registers, microseconds.", &cMetricsSnapshot::period );
+	return OK;
 }
 cWriteWaiting::cWriteWaiting(
 		station_handle_t station,
 		int first_reg,
 		int reg_count,
-		unsigned short* value )
-		: myStation( station )
-		, myFirstReg( first_reg )
-		, myCount( reg_count )
+		const unsigned short* value,
+		const completion_t& done,
+		bool read )
+{
+	Set( station, first_reg, reg_count, value, done, read );
+}
+void cWriteWaiting::Set(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short* value,
+		const completion_t& done,
+		bool read )
 {
 	// Copy the values to be written into our own attribute
 
-	/* We use an STL vector to store the values.
-	This is convenient and safe, requiring the minimum of code
-	and almost nothing can go wrong!
-	It is not especially efficient.  This class is going to be copied,
-	so the vector will be copied also.  If huge numbers of large block
-	writes cause a problem, then it might be neccessary to allocate a buffer
-	and use a pointer to the buffer, saving the vector copies, but requiring
-	careful coding to prevent memory leaks.
+	/* The values are stored in a fixed array, big enough for
+	the longest write command, so that writes can wait in the
+	queue without any memory being allocated.
+	Longer writes are split up before they are queued.
 	*/
-	for( int k = 0; k< myCount; k++ ) {
-		myValue.push_back( *value++ );
+	if( reg_count > max_count )
+		reg_count = max_count;
+	myStation = station;
+	myFirstReg = first_reg;
+	myCount = reg_count;
+	myQueued = boost::chrono::steady_clock::now();
+	myDone = done;
+	myRead = read;
+	if( ! read )
+		memcpy( myValue, value, reg_count * sizeof( unsigned short ) );
+}
+void cWriteWaiting::Complete( cResult& result ) const
+{
+	if( ! myDone )
+		return;
+	result.time = boost::chrono::steady_clock::now();
+	myDone( result );
+}
+void cWriteWaiting::Complete( error err ) const
+{
+	if( ! myDone )
+		return;
+	cResult result;
+	result.err = err;
+	Complete( result );
+}
+bool cWriteWaiting::Merge( const cWriteWaiting& W )
+{
+	if( W.myStation != myStation )
+		return false;
+	if( myRead || W.myRead || myDone || W.myDone )
+		return false;		// each completion reports its own transaction
+
+	int last = myFirstReg + myCount - 1;
+	int W_last = W.myFirstReg + W.myCount - 1;
+	if( W.myFirstReg > last + 1 || W_last + 1 < myFirstReg )
+		return false;
+
+	int first = std::min( myFirstReg, W.myFirstReg );
+	int count = std::max( last, W_last ) - first + 1;
+	if( count > max_count )
+		return false;		// too long for a write multiple registers command
+
+	// move our values up, if the later write starts lower
+	if( first < myFirstReg )
+		memmove( myValue + ( myFirstReg - first ), myValue, myCount * sizeof( unsigned short ) );
+	for( int k = 0; k < W.myCount; k++ )
+		myValue[ W.myFirstReg - first + k ] = W.myValue[k];
+
+	myFirstReg = first;
+	myCount = count;
+	if( W.myQueued < myQueued )
+		myQueued = W.myQueued;
+	return true;
+}
+cWriteQueue::cWriteQueue( int capacity )
+	: myEnqueue( 0 )
+	, myDequeue( 0 )
+{
+	unsigned int size = 2;
+	while( (int) size < capacity )
+		size *= 2;
+	myMask = size - 1;
+	myCell = new cCell[ size ];
+
+	// each cell is free for the producer at its own position in the first lap
+	for( unsigned int k = 0; k < size; k++ )
+		myCell[k].sequence.store( k, boost::memory_order_relaxed );
+}
+cWriteQueue::~cWriteQueue()
+{
+	delete [] myCell;
+}
+bool cWriteQueue::Push(
+	station_handle_t station,
+	int first_reg,
+	int reg_count,
+	const unsigned short * value,
+	const completion_t& done,
+	bool read )
+{
+	// a write too long for one command takes a cell for each command,
+	// all claimed together, so that it is queued whole or not at all
+	int cells = ( reg_count + cWriteWaiting::max_count - 1 ) / cWriteWaiting::max_count;
+	if( cells < 1 )
+		cells = 1;
+	if( cells > (int) myMask + 1 )
+		return false;
+
+	unsigned int pos = myEnqueue.load( boost::memory_order_relaxed );
+	for( ; ; ) {
+		unsigned int sequence = myCell[ pos & myMask ].sequence.load( boost::memory_order_acquire );
+		int dif = (int)( sequence - pos );
+		if( dif == 0 ) {
+			// cell is free, check there is room for the whole write
+			int k = 1;
+			while( k < cells &&
+				myCell[ ( pos + k ) & myMask ].sequence.load( boost::memory_order_acquire ) == pos + k )
+				k++;
+			if( k < cells ) {
+				// a cell is still in use, by the previous lap, unless another producer has moved on
+				unsigned int now = myEnqueue.load( boost::memory_order_relaxed );
+				if( now == pos )
+					return false;
+				pos = now;
+				continue;
+			}
+			// try to claim these positions
+			if( myEnqueue.compare_exchange_weak( pos, pos + cells, boost::memory_order_relaxed ) )
+				break;
+		} else if( dif < 0 ) {
+			// cell still holds a write from the previous lap
+			return false;
+		} else {
+			// another producer claimed this position
+			pos = myEnqueue.load( boost::memory_order_relaxed );
+		}
 	}
+
+	// fill the cells and hand them to the consumer, in order
+	for( int k = 0; k < cells; k++ ) {
+		int offset = k * cWriteWaiting::max_count;
+		int count = reg_count - offset;
+		if( count > cWriteWaiting::max_count )
+			count = cWriteWaiting::max_count;
+		cCell * cell = &myCell[ ( pos + k ) & myMask ];
+		cell->write.Set( station, first_reg + offset, count,
+			value ? value + offset : 0, done, read );
+		cell->sequence.store( pos + k + 1, boost::memory_order_release );
+	}
+	return true;
+}
+cWriteWaiting * cWriteQueue::Front()
+{
+	cCell * cell = &myCell[ myDequeue & myMask ];
+	if( cell->sequence.load( boost::memory_order_acquire ) != myDequeue + 1 )
+		return 0;
+	return &cell->write;
+}
+void cWriteQueue::Pop()
+{
+	// free the cell for the producer in the next lap
+	cCell * cell = &myCell[ myDequeue & myMask ];
+	cell->write.ClearCompletion();
+	cell->sequence.store( myDequeue + myMask + 1, boost::memory_order_release );
+	myDequeue++;
 }
 void cWriteWaiting::Print()
 {
@@ -623,8 +3264,92 @@ void cWriteWaiting::Print()
 }
 
 
-unsigned short cStation::CyclicalRedundancyCheck(
-	unsigned char * msg, int len )
+/**
+
+  Tables for calculating the CRC several bytes at a time
+
+  Entry [0][b] is the CRC register after shifting byte b through it,
+  entry [k][b] is the same followed by k zero bytes,
+  so the contributions of 8 message bytes can be looked up independently
+  and combined with exclusive or.
+
+  Built when the program starts, before any polling thread runs.
+
+*/
+class cCRCTable {
+public:
+	unsigned short t[8][256];
+
+	cCRCTable()
+	{
+		for( int b = 0; b < 256; b++ ) {
+			unsigned short crc = b;
+			for( int bit = 0; bit < 8; bit++ )
+				crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0xA001 : crc >> 1;
+			t[0][b] = crc;
+		}
+		for( int k = 1; k < 8; k++ ) {
+			for( int b = 0; b < 256; b++ )
+				t[k][b] = ( t[k-1][b] >> 8 ) ^ t[0][ 0xFF & t[k-1][b] ];
+		}
+	}
+};
+static cCRCTable theCRCTable;
+
+/**
+
+  Convert the CRC register to the order used by the frame,
+  low byte of the register is sent first
+
+*/
+static unsigned short CRCFrameOrder( unsigned short crc )
+{
+	return ( ( 0xFF & crc ) << 8 ) | ( crc >> 8 );
+}
+
+unsigned short cPort::CyclicalRedundancyCheck(
+	const unsigned char * msg, int len )
+{
+	// short frames, a request or exception, are quicker a byte at a time
+	if( len < 16 )
+		return CyclicalRedundancyCheckBytewise( msg, len );
+	return CyclicalRedundancyCheckSlice8( msg, len );
+}
+
+unsigned short cPort::CyclicalRedundancyCheckSlice4(
+	const unsigned char * msg, int len )
+{
+	const unsigned short (*t)[256] = theCRCTable.t;
+	unsigned short crc = 0xFFFF;
+	for( ; len >= 4; len -= 4, msg += 4 ) {
+		crc ^= msg[0] | ( msg[1] << 8 );
+		crc = t[3][ 0xFF & crc ] ^ t[2][ crc >> 8 ] ^
+			t[1][ msg[2] ] ^ t[0][ msg[3] ];
+	}
+	while( len-- )
+		crc = ( crc >> 8 ) ^ t[0][ 0xFF & ( crc ^ *msg++ ) ];
+	return CRCFrameOrder( crc );
+}
+
+unsigned short cPort::CyclicalRedundancyCheckSlice8(
+	const unsigned char * msg, int len )
+{
+	const unsigned short (*t)[256] = theCRCTable.t;
+	unsigned short crc = 0xFFFF;
+	for( ; len >= 8; len -= 8, msg += 8 ) {
+		crc ^= msg[0] | ( msg[1] << 8 );
+		crc = t[7][ 0xFF & crc ] ^ t[6][ crc >> 8 ] ^
+			t[5][ msg[2] ] ^ t[4][ msg[3] ] ^
+			t[3][ msg[4] ] ^ t[2][ msg[5] ] ^
+			t[1][ msg[6] ] ^ t[0][ msg[7] ];
+	}
+	while( len-- )
+		crc = ( crc >> 8 ) ^ t[0][ 0xFF & ( crc ^ *msg++ ) ];
+	return CRCFrameOrder( crc );
+}
+
+unsigned short cPort::CyclicalRedundancyCheckBytewise(
+	const unsigned char * msg, int len )
 {
 	/* Table of CRC values for highorder byte */
 	static unsigned char auchCRCHi[] = {
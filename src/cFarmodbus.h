@@ -23,12 +23,24 @@
 #pragma once
 
 namespace raven {
+#ifdef _WIN32
 	class cSerial;
+#else
+	// on POSIX systems serial ports are driven through termios
+	namespace farmodbus { class cSerialPosix; }
+	typedef farmodbus::cSerialPosix cSerial;
+#endif
 	namespace farmodbus {
 
+	class cStation;
+
 		// the port and station handles
 	typedef int port_handle_t;
 	typedef int station_handle_t;
+	typedef int subscription_handle_t;
+
+		// time used to schedule polls
+	typedef boost::chrono::steady_clock::time_point time_point_t;
 
 	/**
 
@@ -47,12 +59,794 @@ namespace raven {
 		not_singleton,				///< the application must only create ONE cFarmodbus
 		device_exception,			///< modbus device returned well formatted reply with error message
 		device_error,				///< modbus device reply unrecognized
+		write_queue_full,			///< too many writes waiting for the port, write discarded
+		bad_subscription_handle,
+		crc_error,					///< reply failed the CRC check
+		bad_endpoint,				///< TCP endpoint is not host:port
+	};
+
+	/**
+
+	Health of a station, from whether it has been answering
+
+	*/
+	enum health {
+		healthy,					///< answered its last transaction
+		suspect,					///< has missed a few replies, still polled as usual
+		down,						///< has missed cFarmodbusConfig::DownAfter replies in a row, probed with backoff instead of polled
+	};
+
+
+/**
+
+  Sparse storage for register values, anywhere in the 16 bit address space
+
+  Storage is allocated in pages of 256 registers, and only for the pages
+  holding registers that the application is interested in, so a station
+  polling a few registers up at 30000 does not need 60 KB.
+
+  Each register has a status, the error from its last poll,
+  or unregistered if the application has not asked for it.
+
+  The values can be read by any number of application threads
+  without locking, while the polling thread updates them.
+  Updates are bracketed by BeginWrite() and EndWrite(), which bump a
+  sequence count ( a seqlock ).  A reader that sees the count change
+  while it was copying simply copies again, so it always gets values
+  all from the same poll and never blocks the polling thread.
+  Updates must be serialized by the caller.
+
+  The page table is never changed once published.  Allocating a new page
+  publishes a new copy of the table, and the old copy is kept until
+  the store is destroyed, since a reader may still be using it.
+
+  Do not use this class directly in application code.
+
+*/
+class cRegisterStore {
+public:
+	/// status of a register the application has not asked for
+	static const unsigned char unregistered = 0xFF;
+
+	cRegisterStore();
+	~cRegisterStore();
+
+	/**
+
+	Allocate storage for a block of registers
+
+	@param[in] first register
+	@param[in] last register
+
+	*/
+	void Allocate( int first, int last );
+
+	/// Start an update
+	void BeginWrite()
+	{
+		mySequence.store( mySequence.load( boost::memory_order_relaxed ) + 1,
+			boost::memory_order_relaxed );
+		boost::atomic_thread_fence( boost::memory_order_release );
+	}
+
+	/// Finish an update
+	void EndWrite()
+	{
+		mySequence.store( mySequence.load( boost::memory_order_relaxed ) + 1,
+			boost::memory_order_release );
+	}
+
+	/// Mark registers as wanted by the application, status not_ready until polled
+	void Register( int first, int last );
+
+	/// Store register value read from device, status OK if registered
+	void Set( int reg, unsigned short value )
+	{
+		cPage * page = Page( reg );
+		if( ! page )
+			return;
+		page->value[ 0xFF & reg ] = value;
+		if( page->status[ 0xFF & reg ] != unregistered )
+			page->status[ 0xFF & reg ] = OK;
+	}
+
+	/**
+
+	Store values of a block of registers, straight from a modbus reply
+
+	@param[in] first register
+	@param[in] data register values in network byte order ( MSB first ), 2 bytes per register
+	@param[in] count number of registers
+
+	The 16 bits of each register are stored exactly as read,
+	a page at a time.  Registered registers get status OK.
+	Values for pages not allocated are discarded.
+
+	*/
+	void Set( int first, const unsigned char * data, int count );
+
+	/**
+
+	Convert register values from network byte order
+
+	@param[out] value the register values
+	@param[in] data the register values as read, MSB first
+	@param[in] count number of registers
+
+	Uses SSE2, 8 registers at a time, if the compiler targets it.
+
+	*/
+	static void Swap( unsigned short * value, const unsigned char * data, int count );
+
+	/// Convert register values from network byte order, a register at a time
+	static void SwapScalar( unsigned short * value, const unsigned char * data, int count );
+
+	/// Set error from poll of register, ignored if not registered
+	void setStatus( int reg, error err )
+	{
+		cPage * page = Page( reg );
+		if( page && page->status[ 0xFF & reg ] != unregistered )
+			page->status[ 0xFF & reg ] = (unsigned char) err;
+	}
+
+	/**
+
+	Copy values of a block of registers, without locking
+
+	@param[out] value buffer for values
+	@param[in] first register
+	@param[in] count number of registers
+	@param[out] err first error found in status of registers
+
+	@return false if any register in block is not registered
+
+	*/
+	bool Snapshot(
+		unsigned short * value,
+		int first,
+		int count,
+		error& err );
+
+	/**
+
+	Copy values of a block of registers, without locking, with the update epoch
+
+	@param[out] value buffer for values
+	@param[in] first register
+	@param[in] count number of registers
+	@param[out] err first error found in status of registers
+	@param[out] epoch number of updates to the store before the copy was made
+
+	@return false if any register in block is not registered
+
+	The values are copied a page at a time.  All the values copied
+	were stored by the same update, or earlier, so two snapshots with
+	the same epoch are identical.
+
+	*/
+	bool Snapshot(
+		unsigned short * value,
+		int first,
+		int count,
+		error& err,
+		unsigned int& epoch );
+
+private:
+	class cPage {
+	public:
+		unsigned short value[256];
+		unsigned char status[256];
 	};
+	typedef std::vector< cPage * > directory_t;
+
+	boost::atomic< directory_t * > myDirectory;	///< page table, null for pages not allocated
+	std::vector< directory_t * > myRetired;			///< old page tables, that readers may still be using
+	boost::atomic< unsigned int > mySequence;		///< odd while an update is in progress
+
+	cPage * Page( int reg )
+	{
+		directory_t * directory = myDirectory.load( boost::memory_order_acquire );
+		unsigned int index = reg >> 8;
+		if( index >= directory->size() )
+			return 0;
+		return (*directory)[ index ];
+	}
+
+	// prevent copying, which would double free the pages
+	cRegisterStore( const cRegisterStore& );
+	cRegisterStore& operator=( const cRegisterStore& );
+};
+/**
+
+  A block of registers read from a station in one transaction
+
+  Do not use this class directly in application code.
+
+*/
+class cPollRange {
+public:
+	int first;			///< first register
+	int count;			///< number of registers
+	int period;			///< milliseconds between polls
+	time_point_t due;	///< when next poll is due
+	time_point_t polled;	///< when last polled, to measure the period achieved
+	unsigned char frame[ 8 ];	///< RTU request frame, address, PDU and CRC, built when the plan is made
+
+	/// number of bytes in frame
+	static const int frame_length = 8;
+
+	cPollRange()
+		: first( 0 ), count( 0 ), period( 0 )
+	{}
+	cPollRange( int f, int c, int p = 0 )
+		: first( f ), count( c ), period( p )
+	{}
+	int last() const { return first + count - 1; }
+};
+/**
+
+  The result of one write or on-demand read
+
+  Passed to the request's completion callback,
+  or delivered through the future returned by cFarmodbus::WriteAsync() and cFarmodbus::ReadAsync()
+
+*/
+class cResult {
+public:
+	error err;								///< OK, or why the request failed
+	time_point_t time;						///< when the request completed
+	std::vector< unsigned short > value;	///< values read, empty for writes
+
+	cResult()
+		: err( OK )
+	{}
+};
+
+/**
+
+  Completion callback for a write or on-demand read
+
+  Called by the port's polling thread when the request completes.
+  It must return quickly, and must not wait for another request,
+  since nothing more is done on the port until it returns.
+
+*/
+typedef boost::function< void ( const cResult& ) > completion_t;
+
+/**
+
+  A write request, waiting in the write queue
+
+  Do not use this class directly in application code.
 
+*/
+class cWriteWaiting {
+public:
+	/// Most registers that can be written by one command
+	static const int max_count = 123;
+
+private:
+	station_handle_t myStation;
+	int myFirstReg;
+	int myCount;
+	unsigned short myValue[ max_count ];
+	time_point_t myQueued;				///< when the write was queued by the application
+	completion_t myDone;				///< called when complete, may be empty
+	bool myRead;						///< true for an on-demand read, rather than a write
+
+public:
+	cWriteWaiting()
+		: myStation( -1 ), myFirstReg( 0 ), myCount( 0 ), myRead( false )
+	{}
+
+	/** Constructor
+
+	@param[in] station handle
+	@param[in] first_reg offset of first register to be written to
+	@param[in] reg_count number of registers to be written to
+	@param[in] value pointer to buffer containg values to write, one 16bit value per register
+	@param[in] done called when the write completes, may be empty
+	@param[in] read true for an on-demand read of the registers, value is ignored
+
+	No more than max_count registers are stored.
+	The time is recorded, so the latency of the write can be measured.
+	*/
+	cWriteWaiting(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short* value,
+		const completion_t& done = completion_t(),
+		bool read = false );
+
+	/// Set the write request, see constructor
+	void Set(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short* value,
+		const completion_t& done = completion_t(),
+		bool read = false );
+
+	/**
+
+	Report the result to the application, if it asked for a completion
+
+	@param[in] result of the request, the completion time is set here
+
+	*/
+	void Complete( cResult& result ) const;
+
+	/// Report an error to the application, if it asked for a completion
+	void Complete( error err ) const;
+
+	/// Release the completion callback
+	void ClearCompletion() { myDone.clear(); }
+
+	void Print();
+
+	/**
+
+	Merge a later write into this one
+
+	@param[in] W the later write
+
+	@return true if merged
+
+	The writes are merged if they are to the same station and their
+	registers overlap or are adjacent, and the merged block is no longer
+	than a single write multiple registers command can carry.
+	Where the registers overlap, the later write's values win.
+	The merged write keeps the earlier queued time.
+	Writes with a completion callback, and reads, are never merged
+	so that each completion reports its own transaction.
+
+	*/
+	bool Merge( const cWriteWaiting& W );
+
+	station_handle_t getStation() const	{ return myStation; }
+	int getFirstReg() const			{ return myFirstReg; }
+	unsigned short getValue() const	{ return myValue[0]; }
+	unsigned short getValue( int k ) const	{ return myValue[k]; }
+	int getCount() const				{ return myCount; }
+	time_point_t getQueued() const		{ return myQueued; }
+	bool IsRead() const					{ return myRead; }
+};
+
+/**
+
+  A queue of writes waiting for a port
+
+  Any number of application threads can add writes, and the port's
+  polling thread removes them, without locks and without allocating memory.
+
+  The queue is a ring of cells, each holding a write and a sequence number
+  which says whether the cell is free for the producer at a position in the ring,
+  or filled and ready for the consumer.  Producers claim a position by
+  atomically incrementing the enqueue count, fill the cell in place,
+  then publish it by updating its sequence number.
+
+  Do not use this class directly in application code.
+
+*/
+class cWriteQueue {
+public:
+	/**
+
+	Construct queue
+
+	@param[in] capacity maximum number of writes waiting, rounded up to a power of 2
+
+	*/
+	cWriteQueue( int capacity );
+	~cWriteQueue();
+
+	/**
+
+	Add write to end of queue.  Any thread may call this.
+
+	@param[in] station handle
+	@param[in] first_reg first register to be written to
+	@param[in] reg_count number of registers
+	@param[in] value pointer to values to write
+	@param[in] done called when the write completes, may be empty
+	@param[in] read true for an on-demand read
+
+	@return false if the queue is full
+
+	A write of more than cWriteWaiting::max_count registers is split
+	into commands, each in its own cell, next to each other in the queue.
+	Either all of them are queued, or none if there is not room for them all.
+
+	*/
+	bool Push(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		const completion_t& done = completion_t(),
+		bool read = false );
+
+	/**
+
+	The write at the front of the queue, or null if the queue is empty
+
+	Only the polling thread may call this.
+
+	*/
+	cWriteWaiting * Front();
+
+	/// Remove the write at the front of the queue.  Only the polling thread may call this.
+	void Pop();
+
+	/// True if the queue is empty.  Only the polling thread may call this.
+	bool Empty() { return Front() == 0; }
+
+private:
+	class cCell {
+	public:
+		boost::atomic< unsigned int > sequence;
+		cWriteWaiting write;
+	};
+	cCell * myCell;
+	unsigned int myMask;
+	boost::atomic< unsigned int > myEnqueue;		///< next position for producers
+	unsigned int myDequeue;							///< next position for consumer
+
+	// prevent copying, which would double free the ring
+	cWriteQueue( const cWriteQueue& );
+	cWriteQueue& operator=( const cWriteQueue& );
+};
+
+/**
+
+  A change in a register value, reported to subscribers
+
+*/
+class cChange {
+public:
+	station_handle_t station;
+	int reg;					///< register offset
+	unsigned short value;		///< new value
+	unsigned short previous;	///< value last reported, same as value on the first report
+	time_point_t time;			///< when the new value was read
+};
+
+/**
+
+  Subscription callback
+
+  Called by the notification thread with a batch of changes
+  from one poll reply.  It may take as long as it likes,
+  polling is not held up, though other subscribers must wait.
+
+*/
+typedef boost::function< void ( const std::vector< cChange >& ) > notify_t;
+
+/**
+
+  A subscription to changes in a block of registers on one station
+
+  Do not use this class directly in application code.
+
+*/
+class cSubscription {
+public:
+	subscription_handle_t handle;
+	int first;								///< first register
+	int count;								///< number of registers
+	int deadband;							///< changes no larger than this are not reported
+	notify_t notify;
+	std::vector< unsigned short > reported;	///< values last reported
+	std::vector< bool > valid;				///< true once a value has been reported
+};
+
+/**
+
+  The notification thread
+
+  Batches of changes are posted by the polling threads
+  and passed to the subscribers' callbacks in this thread,
+  so that a slow subscriber does not hold up polling.
+
+  Do not use this class directly in application code.
+
+*/
+class cNotifier {
+public:
+	cNotifier();
+
+	/**
+
+	Post a batch of changes to a subscriber
+
+	@param[in] notify the subscriber's callback
+	@param[in,out] batch the changes, emptied by this call
+
+	The thread is started the first time this is called.
+
+	*/
+	void Post( const notify_t& notify, std::vector< cChange >& batch );
+
+private:
+	typedef std::pair< notify_t, std::vector< cChange > > post_t;
+	std::vector< post_t > myQueue;
+	boost::mutex myMutex;
+	boost::condition_variable myWake;
+	bool myStarted;
+
+	void Run();
+};
+
+/**
+
+  A count of times, in fixed buckets
+
+  The buckets go up in steps of 1, 2 and 5, from 50 microseconds to 10 seconds,
+  with one more for anything longer, so histograms from different ports,
+  stations and runs can be added and compared bucket by bucket.
+
+  Adding a time is lock free, a few relaxed atomic increments,
+  so the polling thread never waits for a thread reading the histogram.
+
+  Do not use this class directly in application code, use cHistogramSnapshot.
+
+*/
+class cHistogram {
+public:
+	static const int bucket_count = 18;
+
+	cHistogram();
+
+	/// Count a time, microseconds
+	void Add( long long usec );
+
+	/// Copy the counts
+	void Get( class cHistogramSnapshot& snapshot ) const;
+
+	/// Upper bound of a bucket, microseconds, -1 for the last bucket, which has none
+	static long long Bound( int bucket );
+
+private:
+	boost::atomic< unsigned long long > myCount[ bucket_count ];
+	boost::atomic< unsigned long long > mySum;		///< microseconds
+
+	cHistogram( const cHistogram& );
+	cHistogram& operator=( const cHistogram& );
+};
+
+/**
+
+  A copy of a histogram's counts
+
+*/
+class cHistogramSnapshot {
+public:
+	unsigned long long count[ cHistogram::bucket_count ];	///< times in each bucket
+	unsigned long long sum;									///< microseconds, all times added together
+
+	cHistogramSnapshot();
+
+	/// Number of times counted
+	unsigned long long Total() const;
+
+	/**
+
+	Estimate a percentile
+
+	@param[in] fraction of the times, 0.5 for the median, 0.99 for the 99th percentile
+
+	@return upper bound, microseconds, of the bucket the percentile falls in,
+		-1 if it falls in the last bucket, 0 if nothing has been counted
+
+	*/
+	long long Percentile( double fraction ) const;
+
+	/// Add the counts of another histogram
+	void Add( const cHistogramSnapshot& other );
+};
+
+/**
+
+  A copy of the metrics of a port or station
+
+  The counters run from when the port or station was added,
+  so rates come from the difference between two snapshots.
+
+*/
+class cMetricsSnapshot {
+public:
+	unsigned long long requests;		///< transactions sent that were answered or timed out, polls, writes and on-demand reads
+	unsigned long long replies;			///< transactions answered with an intact reply, including exceptions
+	unsigned long long timeouts;		///< transactions not answered in time
+	unsigned long long exceptions;		///< replies that were modbus exceptions
+	unsigned long long crc_errors;		///< replies that failed the CRC check
+	unsigned long long bad_replies;		///< replies broken off, or from the wrong station
+	unsigned long long bytes_out;		///< ports: bytes sent on the line, stations: request PDU bytes
+	unsigned long long bytes_in;		///< ports: bytes received on the line, stations: reply PDU bytes
+	unsigned long long busy_usec;		///< ports only: microseconds the polling thread spent working rather than asleep
+	cHistogramSnapshot rtt;				///< round trip times of the transactions answered
+	cHistogramSnapshot period;			///< time between the starts of successive polls of each block of registers
+
+	cMetricsSnapshot();
+
+	/// Add the metrics of another port or station
+	void Add( const cMetricsSnapshot& other );
+};
+
+/**
+
+  The metrics of a port or station
+
+  Updated by the port's polling thread, lock free,
+  and read at any time by cFarmodbus::getPortMetrics() and getStationMetrics().
+
+  Do not use this class directly in application code.
+
+*/
+class cMetrics {
+public:
+	boost::atomic< unsigned long long > requests;
+	boost::atomic< unsigned long long > replies;
+	boost::atomic< unsigned long long > timeouts;
+	boost::atomic< unsigned long long > exceptions;
+	boost::atomic< unsigned long long > crc_errors;
+	boost::atomic< unsigned long long > bad_replies;
+	boost::atomic< unsigned long long > bytes_out;
+	boost::atomic< unsigned long long > bytes_in;
+	boost::atomic< unsigned long long > busy_usec;
+	cHistogram rtt;
+	cHistogram period;
+
+	cMetrics();
+
+	/// Increase a counter
+	static void Count( boost::atomic< unsigned long long >& counter, unsigned long long n = 1 )
+	{
+		counter.fetch_add( n, boost::memory_order_relaxed );
+	}
+
+	/// Copy the metrics
+	void Get( cMetricsSnapshot& snapshot ) const;
+
+private:
+	cMetrics( const cMetrics& );
+	cMetrics& operator=( const cMetrics& );
+};
+
+#ifndef _WIN32
+/**
+
+  A serial port on a POSIX system, through termios
+
+  This has the same interface as raven::cSerial, which is Windows only,
+  and takes its place when the farm is built for Linux.
+
+  The line is set raw, with VMIN and VTIME both zero, so that
+  the driver hands over each byte as soon as it arrives and never
+  waits for more: cPort times the frames itself, from the t3.5 silence.
+  The descriptor is non-blocking, and waits are made in poll().
+  Bytes are read into a buffer as they arrive, so poll()
+  wakes only for new bytes, not for those already counted.
+
+  Where the driver supports it, the UART is put in low latency mode
+  ( ASYNC_LOW_LATENCY ), which also drops the latency timer of
+  FTDI USB adapters from 16 msecs to 1.
+
+*/
+class cSerialPosix {
+public:
+	cSerialPosix();
+	~cSerialPosix();
+
+	/**
+
+	Open and configure a serial port
+
+	@param[in] device path, e.g. "/dev/ttyUSB0"
+	@param[in] baud rate
+	@param[in] parity 'N', 'E' or 'O'
+	@param[in] stop_bits 1 or 2
+
+	@return false if the port could not be opened or configured
+
+	Any port already open is closed first.
+
+	*/
+	bool Open(
+		const char * device,
+		int baud = 9600,
+		char parity = 'N',
+		int stop_bits = 1 );
+
+	void Close();
+	bool IsOpened() { return myFD >= 0; }
+
+	/// True if the UART was put in low latency mode
+	bool IsLowLatency() { return myLowLatency; }
+
+	/// Baud rate the port was last opened with, 0 if never opened
+	int getBaud() { return myBaud; }
+
+	/// Describe the port configuration, e.g. "/dev/ttyUSB0 9600 8N1"
+	void getConfig( std::wstring& text );
+
+	int getHandle() { return myFD; }
+
+	/**
+
+	Send data to the port
+
+	@param[in] msg pointer to data
+	@param[in] length number of bytes
+
+	@return number of bytes sent, 0 if error
+
+	*/
+	int SendData( const unsigned char * msg, int length );
+
+	/**
+
+	Wait for data to arrive
+
+	@param[in] len number of bytes to wait for
+	@param[in] msec milliseconds to wait
+
+	@return 1 if data ready, 0 if timeout
+
+	*/
+	int WaitForData( int len, int msec );
+
+	/**
+
+	Read data that has arrived
+
+	@param[out] buffer for data
+	@param[in] limit maximum number of bytes to read
+
+	@return number of bytes read
+
+	*/
+	int ReadData( void * buffer, int limit );
+
+private:
+	int myFD;
+	bool myLowLatency;
+	std::string myDevice;
+	int myBaud;
+	char myParity;
+	int myStopBits;
+	unsigned char myBuffer[ 1024 ];		///< bytes read from the port, not yet taken by ReadData()
+	int myHave;							///< number of bytes in myBuffer
+
+	void Fill();
+
+	// prevent copying, which would close the port twice
+	cSerialPosix( const cSerialPosix& );
+	cSerialPosix& operator=( const cSerialPosix& );
+};
+#endif
 
 	/**
 	
 	A wrapper for a serial port or a TCP socket
+
+	Requests are framed for the wire by the port.  Serial ports and
+	plain TCP sockets use RTU framing ( device address and CRC ).
+	Modbus TCP ports use MBAP headers, with a transaction ID
+	so that several requests can be in flight at once
+	and the replies matched back to the stations that sent them.
+
+	Each port owns the stations connected through it,
+	a queue of writes waiting for those stations,
+	and runs its own polling thread so that a slow or dead
+	device on one port does not hold up polling on the others.
+
+	The polling thread keeps a schedule, a priority queue of the stations
+	ordered by when their next poll is due, and sleeps until the earliest
+	deadline or until woken by a write.  Writes are not held up
+	by the polls, the polling thread checks for waiting writes
+	between every read transaction.
 	
 	*/
 class cPort {
@@ -60,14 +854,91 @@ class cPort {
 	int			myID;
 	static int	myLastID;
 	cSerial*	mySerial;
-	SOCKET		mySocket;
+	boost::atomic< SOCKET > mySocket;			///< changed by the polling thread, read by IsConnected() from any thread
 	bool		myFlagTCP;
+	bool		myFlagMBAP;
+	int			myInFlight;
+	unsigned short myTransactionID;
+	unsigned char myTX[ 300 ];					///< frame being sent, only used by polling thread
+	unsigned char myRX[ 1000 ];					///< frame being received, only used by polling thread
+	int			myCharTime;						///< microseconds to send one character, 0 if not a serial line
+	int			mySilence35;					///< microseconds of silence, t3.5, between frames
+	time_point_t myFrameEnd;					///< when the last frame on the line ended
+	std::string	myHost;							///< host of TCP endpoint owned by the port, empty if socket supplied by application
+	std::string	myService;						///< port number, or service name, of TCP endpoint
+	time_point_t myReconnectDue;				///< when to try again to connect the endpoint
+	int			myReconnectDelay;				///< milliseconds to wait after the next failed connect
+	boost::atomic< int > myConnects;			///< number of times the endpoint has been connected
+	unsigned char myReceived[ 1024 ];			///< bytes read from the socket, not yet taken by ReadData()
+	int			myReceivedHave;					///< number of bytes in myReceived
+	int			myDiscard;						///< bytes of a Modbus TCP reply given up on, still to be thrown away
+	cMetrics	myMetrics;
+	std::vector< cStation * > myStation;
+	boost::mutex myStationMutex;
+	cWriteQueue myWriteQueue;
+	std::vector< cWriteWaiting > myMerged;		///< writes merged from queue, ready to execute
+	std::vector< cStation * > myReschedule;		///< stations whose poll plan has changed
+	boost::mutex myQueueMutex;					///< protects the reschedule list and sleeping
+	boost::condition_variable myWake;			///< wakes polling thread when something is queued
+	boost::atomic< bool > mySleeping;			///< true while polling thread may be waiting on myWake
+	std::priority_queue<
+		std::pair< time_point_t, cStation * >,
+		std::vector< std::pair< time_point_t, cStation * > >,
+		std::greater< std::pair< time_point_t, cStation * > > > mySchedule;
 
 public:
-	/// Construct serial port
-	cPort( cSerial& serial );
-	/// Construct TCP port
+	/**
+
+	Construct serial port
+
+	@param[in] serial the port
+	@param[in] baud its baud rate, used to time the silent intervals between frames
+
+	*/
+	cPort( cSerial& serial, int baud = 9600 );
+	/// Construct TCP port, RTU framing
 	cPort( SOCKET s );
+	/// Construct Modbus TCP port, MBAP framing with up to in_flight requests outstanding
+	cPort( SOCKET s, int in_flight );
+
+	/**
+
+	Make the port own its TCP connection, to an endpoint
+
+	@param[in] host name or address
+	@param[in] service port number or service name
+
+	The port's polling thread connects, and whenever the connection
+	is found broken, closes it and connects again.
+	Construct the port with INVALID_SOCKET, and call this before Start().
+
+	*/
+	void setEndpoint( const std::string& host, const std::string& service );
+
+	/**
+
+	Split a TCP endpoint into host and port
+
+	@param[in] endpoint "host:port", an IPv6 address in brackets "[::1]:502"
+	@param[out] host
+	@param[out] service
+
+	@return false if endpoint is not in that form
+
+	*/
+	static bool ParseEndpoint(
+		const char * endpoint,
+		std::string& host,
+		std::string& service );
+
+	/// True if the port's TCP connection is up, or its socket was supplied by the application
+	bool IsConnected() { return myHost.empty() || mySocket != INVALID_SOCKET; }
+
+	/// Number of times the port has connected its TCP endpoint
+	int getConnects() { return myConnects; }
+
+	/// Metrics of the port, updated by its polling thread and by its stations
+	cMetrics& getMetrics() { return myMetrics; }
 
 	int getID() { return myID; }
 	cSerial* getSerial() { return mySerial; }
@@ -76,45 +947,202 @@ public:
 	int WaitForData( int len, int msec );
 	int ReadData( void *buffer, int limit );
 
-private:
-	int TCPReadDataWaiting( void );
-};
-/**
+	/**
+
+	Send a request to a station and wait for the reply
+
+	@param[in] address modbus device address
+	@param[in] request the request PDU ( function code and data )
+	@param[in] length number of bytes in request
+	@param[out] reply buffer for the reply PDU, at least 256 bytes
+	@param[out] reply_length number of bytes in reply PDU
+	@param[in] msec number of milliseconds to wait for reply
+
+	@return error
+
+	This should ONLY be called from the polling thread,
+	never from any application thread.
+
+	*/
+	error Transaction(
+		int address,
+		const unsigned char * request,
+		int length,
+		unsigned char * reply,
+		int& reply_length,
+		int msec );
+
+	/**
+
+	Send a request frame, already assembled, and wait for the reply
+
+	@param[in] frame the RTU frame, address, PDU and CRC
+	@param[in] frame_length number of bytes in frame
+	@param[out] reply buffer for the reply PDU, at least 256 bytes
+	@param[out] reply_length number of bytes in reply PDU
+	@param[in] msec number of milliseconds to wait for reply
+
+	@return error
+
+	Used for the poll requests, which are assembled once when the poll plan is made.
+	On Modbus TCP ports the address and PDU are sent with an MBAP header, and the CRC ignored.
+
+	This should ONLY be called from the polling thread,
+	never from any application thread.
+
+	*/
+	error Transaction(
+		const unsigned char * frame,
+		int frame_length,
+		unsigned char * reply,
+		int& reply_length,
+		int msec );
+
+	/**
+
+	Add a station to the list polled through this port
+
+	@param[in] station pointer to station connected through this port
+
+	*/
+	void Add( cStation * station );
+
+	/**
+
+	Add a write to the end of this port's write queue
+
+	@param[in] station handle
+	@param[in] first_reg first register to be written to
+	@param[in] reg_count number of registers, a write of more than cWriteWaiting::max_count is split
+	@param[in] value pointer to values to write
+	@param[in] done called when the write completes, may be empty
+	@param[in] read true for an on-demand read of the registers
+
+	@return false if the queue is full, nothing is queued
+
+	This will be executed by the port's polling thread
+	as soon as the transaction in progress is complete.
+
+	This never blocks, unless the polling thread is asleep and must be woken.
+
+	*/
+	bool Push(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		const completion_t& done = completion_t(),
+		bool read = false );
+
+	/**
+
+	Perform the writes, and on-demand reads, waiting in the queue
+
+	The polling thread calls this between every read transaction,
+	so that a write waits for at most the transaction in progress.
+
+	This should ONLY be called from the polling thread.
+
+	*/
+	void Write();
+
+	/**
+
+	Ask the polling thread to reschedule a station
+
+	@param[in] station whose poll plan has changed
+
+	*/
+	void Reschedule( cStation * station );
+
+	/**
+
+	Start the polling thread for this port
+
+	*/
+	void Start();
+
+	/**
+
+	Calculate the modbus CRC of a message
+
+	@param[in] msg the message, address and PDU
+	@param[in] len number of bytes in message
+
+	@return the CRC, the high byte is sent first
+
+	Chooses the quickest method for the length of the message.
+	The other methods are public so they can be compared by the benchmark.
+
+	*/
+	static unsigned short CyclicalRedundancyCheck(
+		const unsigned char * msg, int len );
 
-  A write request, waiting in the write queue
+	/**
 
-  Do not use this class directly in application code.
+	Length of an RTU reply frame, from its first bytes
 
-*/
-class cWriteWaiting {
-private:
-	station_handle_t myStation;
-	int myFirstReg;
-	int myCount;
-	std::vector< unsigned short > myValue;
+	@param[in] frame the bytes received so far
+	@param[in] have number of bytes received so far
 
-public:
-	/** Constructor
+	@return number of bytes in the whole frame, address to CRC,
+		0 if more bytes are needed to tell, -1 if the function code is not known
 
-	@param[in] station handle
-	@param[in] first_reg offset of first register to be written to
-	@param[in] reg_count number of registers to be written to
-	@param[in] value pointer to buffer containg values to write, one 16bit value per register
 	*/
-	cWriteWaiting(
-		station_handle_t station,
-		int first_reg,
-		int reg_count,
-		unsigned short* value );
+	static int ReplyLength( const unsigned char * frame, int have );
 
-	void Print();
+	/// Calculate CRC a byte at a time, with the tables from the modbus specification
+	static unsigned short CyclicalRedundancyCheckBytewise(
+		const unsigned char * msg, int len );
 
-	station_handle_t getStation()	{ return myStation; }
-	int getFirstReg()				{ return myFirstReg; }
-	unsigned short getValue()		{ return myValue[0]; }
-	int getCount()					{ return myCount; }
-};
+	/// Calculate CRC 4 bytes at a time, slicing by 4
+	static unsigned short CyclicalRedundancyCheckSlice4(
+		const unsigned char * msg, int len );
+
+	/// Calculate CRC 8 bytes at a time, slicing by 8
+	static unsigned short CyclicalRedundancyCheckSlice8(
+		const unsigned char * msg, int len );
+
+private:
+	int TCPReadDataWaiting( void );
+	bool TCPFill( void );
+	void Poll();
+	void PollPipelined( std::vector< cStation * >& stations );
+	void Schedule( cStation * station );
+	cStation * Find( station_handle_t station );
+	error TransactionRTU(
+		const unsigned char * frame,
+		int frame_length,
+		unsigned char * reply,
+		int& reply_length,
+		int msec );
+	error ReceiveRTU(
+		const unsigned char * request,
+		int& length,
+		int msec );
+	void Flush();
+	void Connect();
+	static SOCKET Connect( const addrinfo * address );
+	void Disconnect();
+	error TransactionMBAP(
+		int address,
+		const unsigned char * request,
+		int length,
+		unsigned char * reply,
+		int& reply_length,
+		int msec );
+	bool SendMBAP(
+		unsigned short tid,
+		int address,
+		const unsigned char * request,
+		int length );
+	int ReadMBAP(
+		unsigned short& tid,
+		int& unit,
+		unsigned char * reply,
+		int msec );
 
+};
 /**
 
   A modbus station
@@ -145,6 +1173,9 @@ public:
 
 	@return error found on last poll, or invalid parameters
 
+	This does not lock, unless the register is novel
+	and has to be added to the poll plan.
+
 	*/
 	error Query( 
 		unsigned short& value,
@@ -167,12 +1198,34 @@ public:
 
 	/**
 
+	Return value read from a block of registers, with the update epoch
+
+	@param[in] value pointer to buffer long enough to contain values read
+	@param[in] first_reg first register offset
+	@param[in] reg_count number of registers to be read
+	@param[out] epoch number of updates to the cached values when they were copied
+
+	@return error found on last poll, or not_ready
+
+	*/
+	error Snapshot(
+		unsigned short* value,
+		int first_reg,
+		int reg_count,
+		unsigned int& epoch );
+
+	/**
+
 	Execute a write that has been popped off the write queue
 
 	@param[in] W The write request
 
 	@return error
 
+	A single register is written with function code 6,
+	a block of registers with function code 16, split into
+	several commands if the block is too long for one.
+
 	This should ONLY be called from the polling thread,
 	never from any application thread.
 
@@ -181,18 +1234,273 @@ public:
 
 	/**
 
-	Read all registers that the application is interested in.
+	Read a block of registers on demand, outside the poll plan
+
+	@param[in] W The read request
+
+	@return error
+
+	The values are passed to the request's completion callback.
+	Registers that are also polled have their cached values updated.
+
+	This should ONLY be called from the polling thread,
+	never from any application thread.
+
+	*/
+	error Read( cWriteWaiting& W );
+
+	/**
+
+	Subscribe to changes in a block of registers
+
+	@param[in] handle of the subscription
+	@param[in] first_reg first register
+	@param[in] reg_count number of registers
+	@param[in] deadband changes no larger than this are not reported
+	@param[in] notify called on the notification thread with the changes
+
+	The registers are added to those polled.
+
+	*/
+	void Subscribe(
+		subscription_handle_t handle,
+		int first_reg,
+		int reg_count,
+		int deadband,
+		const notify_t& notify );
+
+	/**
+
+	Cancel subscription
+
+	@param[in] handle of the subscription
+
+	@return false if the station has no such subscription
+
+	*/
+	bool Unsubscribe( subscription_handle_t handle );
+
+	/**
+
+	Read all registers that the application is interested in that are due to be polled.
 
 	This should ONLY be called from the polling thread,
 	never from any application thread.
 
-	The values read are stored in the private attribute myValue
+	The values read are stored in the private attribute myValue, a sparse register store
 
 	*/
 	void Poll();
 
 	/**
 
+	Get the blocks of registers that are due to be polled
+
+	@param[out] due the blocks due, added to the end of the vector
+	@param[in] now the current time
+
+	The blocks returned are scheduled for their next poll,
+	one period after they were due so that the poll rate does not drift.
+	If a block has fallen more than a whole period behind,
+	the overrun is counted and the missed polls are skipped.
+
+	If the station is down, only the first block is returned,
+	as a probe, and only when the probe is due.
+
+	This should ONLY be called from the polling thread,
+	never from any application thread.
+
+	*/
+	void Due( std::vector< cPollRange >& due, time_point_t now );
+
+	/// When the next poll of any block of registers on this station is due, or its next probe if it is down
+	time_point_t NextDue();
+
+	/**
+
+	Assemble a read request PDU
+
+	@param[out] pdu buffer for request, at least 5 bytes
+	@param[in] range registers to be requested
+
+	@return number of bytes in request
+
+	*/
+	int ReadRequest( unsigned char * pdu, const cPollRange& range );
+
+	/**
+
+	Set the poll period for the station
+
+	@param[in] msec milliseconds between polls
+
+	This applies to registers which have not had their own period set.
+
+	*/
+	void setPeriod( int msec );
+
+	/**
+
+	Plan the polling again, after the configuration has changed
+
+	The read command is in the request frames built by the plan,
+	and the transactions depend on the read limit and overhead.
+
+	*/
+	void Replan();
+
+	/**
+
+	Set the poll period for a block of registers
+
+	@param[in] first_reg first register
+	@param[in] reg_count number of registers
+	@param[in] msec milliseconds between polls
+
+	*/
+	void setPeriod( int first_reg, int reg_count, int msec );
+
+	/**
+
+	Set the most registers read in one transaction
+
+	@param[in] count most registers read, 0 for theConfig.MaxReadCount
+
+	*/
+	void setMaxReadCount( int count );
+
+	/// Number of times polling has fallen a whole period behind schedule
+	int getOverrunCount() { return myOverruns; }
+
+	/// Milliseconds to wait for a reply from this station
+	int getTimeout() { return myTimeout; }
+
+	/**
+
+	Get round trip estimates
+
+	@param[out] srtt smoothed round trip time, microseconds, 0 if not yet measured
+	@param[out] rttvar smoothed variation of round trip time, microseconds
+	@param[out] timeout milliseconds to wait for a reply
+
+	Safe to call from any thread, while the polling thread updates them,
+	though the three may be from successive measurements.
+
+	*/
+	void getRoundTrip( int& srtt, int& rttvar, int& timeout )
+	{
+		srtt = mySRTT;
+		rttvar = myRTTVAR;
+		timeout = myTimeout;
+	}
+
+	/**
+
+	Record the outcome of a transaction with the station
+
+	@param[in] err from the port's Transaction()
+	@param[in] start when the request was sent
+	@param[in] request_length number of bytes in the request PDU
+	@param[in] reply the reply PDU, if err is OK
+	@param[in] reply_length number of bytes in reply
+
+	Updates the round trip estimates or the health of the station,
+	and the metrics of the station and its port.
+	Nothing is recorded if the request could not be sent.
+
+	This should ONLY be called from the polling thread.
+
+	*/
+	void Measure(
+		error err,
+		time_point_t start,
+		int request_length,
+		const unsigned char * reply,
+		int reply_length );
+
+	/**
+
+	Record the round trip time of a transaction that was answered
+
+	@param[in] usec microseconds from sending the request to receiving the reply
+
+	The timeout is derived from the smoothed round trip time and its variation,
+	between cFarmodbusConfig::TimeoutFloor and TimeoutCeiling.
+
+	This should ONLY be called from the polling thread.
+
+	*/
+	void RoundTrip( int usec );
+
+	/**
+
+	Record a transaction that was not answered
+
+	The timeout doubles, up to the ceiling.
+	After cFarmodbusConfig::DownAfter unanswered transactions in a row
+	the station is down: it is dropped from the poll sequence and
+	probed with one read, at intervals that back off exponentially
+	with random jitter, until it answers.
+
+	This should ONLY be called from the polling thread.
+
+	*/
+	void TimedOut();
+
+	/// Whether the station has been answering
+	health getHealth() { return myHealth; }
+
+	/// Metrics of the station
+	cMetrics& getMetrics() { return myMetrics; }
+
+	/// Number of unanswered transactions in a row
+	int getMissed() { return myMissed; }
+
+	/**
+
+	Get latency of writes, from the application queueing a write
+	until the station acknowledged it
+
+	@param[out] last microseconds taken by the most recent write
+	@param[out] max microseconds taken by the slowest write
+	@param[out] late number of writes that took longer than cFarmodbusConfig::WriteLatency
+
+	*/
+	void getWriteLatency( int& last, int& max, int& late )
+	{
+		last = myWriteLatency;
+		max = myWriteLatencyMax;
+		late = myWriteLate;
+	}
+
+	/// Deadline of the station in its port's schedule, used only by the port's polling thread
+	time_point_t getScheduled() { return myScheduled; }
+	void setScheduled( time_point_t t ) { myScheduled = t; }
+
+	/**
+
+	Decode the reply PDU to a request assembled by ReadRequest()
+
+	@param[in] pdu the reply PDU
+	@param[in] length number of bytes in reply
+	@param[in] range registers requested
+
+	This should ONLY be called from the polling thread,
+	never from any application thread.
+
+	The values read are stored in the private attribute myValue, a sparse register store
+
+	*/
+	void Decode( const unsigned char * pdu, int length, const cPollRange& range );
+
+	/// Set error found when polling all registers on this station
+	void setError( error err );
+
+	/// Set error found when polling a block of registers on this station
+	void setError( error err, const cPollRange& range );
+
+	/**
+
 	Get error flag from previous poll write on this station
 
 	@return error flag
@@ -209,6 +1517,7 @@ public:
 
 	int getHandle() { return myHandle; }
 	int getAddress() { return myAddress; }
+	cPort& getPort() { return myPort; }
 
 	/**
 
@@ -219,37 +1528,102 @@ public:
 
 	@return True if polled registers are as expected.
 
-	The station maintains a range of registers that are polled.
-	The list is updated when a novel read request is received for the station.
-	This is used by the unit tests to ensure that the list is correctly updated,
+	The station maintains a poll plan, the blocks of registers that are polled.
+	The plan is updated when a novel read request is received for the station.
+	This is used by the unit tests to ensure that the plan is correctly updated,
 	it is not used by production code.
 
+	This checks that the plan is a single block, as expected
+
+	*/
+	bool CheckPolledRegisters(
+		int expected_first,
+		int expected_count )
+	{
+		return ( myPlan.size() == 1 &&
+			CheckPolledRegisters( 0, expected_first, expected_count ) );
+	}
+	/**
+
+	True if a block in the poll plan is as expected.
+
+	@param[in] index of block in poll plan
+	@param[in] expected_first
+	@param[in] expected_count
+
+	@return True if block is as expected.
+
+	This is used by the unit tests, it is not used by production code.
+
 	*/
 	bool CheckPolledRegisters(
+		int index,
 		int expected_first,
 		int expected_count )
 	{
-		return ( expected_first == myFirstReg &&
-			expected_count == myCount );
+		return ( 0 <= index && index < (int) myPlan.size() &&
+			expected_first == myPlan[index].first &&
+			expected_count == myPlan[index].count );
 	}
+	/// Number of transactions needed to poll this station
+	int getPlanSize() { return (int) myPlan.size(); }
 
 private:
 
 	int myHandle;
 	static int myLastHandle;
 	int myAddress;
-	int myFirstReg;
-	int myCount;
-	error myError;
+	std::vector< std::pair< int, int > > myRange;	///< registers application is interested in, first and last
+	std::vector< cPollRange > myPlan;				///< blocks of registers read on each poll
+	int myPeriod;									///< milliseconds between polls
+	int myMaxReadCount;								///< most registers read in one transaction, 0 for theConfig.MaxReadCount
+	std::vector< cPollRange > myPeriodBlock;		///< blocks of registers with their own poll period
+	boost::atomic< int > myOverruns;				///< counted under myMutex, read by getOverrunCount without it
+	time_point_t myScheduled;
 	error myWriteError;
+	// write latency, written by the polling thread and read by application threads
+	boost::atomic< int > myWriteLatency;			///< microseconds from queue to acknowledgement, last write
+	boost::atomic< int > myWriteLatencyMax;			///< microseconds from queue to acknowledgement, slowest write
+	boost::atomic< int > myWriteLate;				///< number of writes slower than the configured bound
+	// round trip estimates, written by the polling thread and read by application threads
+	boost::atomic< int > mySRTT;					///< smoothed round trip time, microseconds, 0 until measured
+	boost::atomic< int > myRTTVAR;					///< smoothed variation of round trip time, microseconds
+	boost::atomic< int > myTimeout;					///< milliseconds to wait for a reply
+	boost::atomic< health > myHealth;				///< written by the polling thread, read by application threads
+	boost::atomic< int > myMissed;					///< unanswered transactions in a row
+	int myProbes;									///< probes sent since the station went down
+	time_point_t myProbeDue;						///< when the next probe of a down station is due
 	cPort& myPort;
-	unsigned short myValue[255];
+	cMetrics myMetrics;
+	cRegisterStore myValue;
+	std::vector< cSubscription > mySubscription;
 	boost::mutex myMutex;
 
-	unsigned short CyclicalRedundancyCheck(
-		unsigned char * msg, int len );
+	bool AddRange( int first, int last );
+	void Plan();
+	error ReplyError( const unsigned char * pdu, int length, const cPollRange& range );
+	void Notify( const unsigned char * pdu, const cPollRange& range );
+	int ProbeInterval();
+	static unsigned short DecodeRegister( const unsigned char * p );
+
+};
+
+/**
 
+  A block of registers on one station, to be copied by cFarmodbus::Snapshot()
 
+*/
+class cSlice {
+public:
+	station_handle_t station;
+	int first;				///< first register
+	int count;				///< number of registers
+	error err;				///< set by Snapshot(), error found on last poll, or not_ready
+	unsigned int epoch;		///< set by Snapshot(), changes whenever the station's cached values are updated
+
+	cSlice( station_handle_t s, int f, int c )
+		: station( s ), first( f ), count( c ), err( not_ready ), epoch( 0 )
+	{}
 };
 
 /**
@@ -274,7 +1648,133 @@ private:
 	 The simodbus station simulator responds to both
 
 	 */
-	 int ModbusReadCommand;
+	 int ModbusReadCommand;
+
+	 /**
+	 Maximum number of registers read in one transaction
+
+	 Defaults to 125, the limit set by the modbus specification.
+	 Stations may have their own with cFarmodbus::SetMaxReadCount()
+	 */
+	 int MaxReadCount;
+
+	 /**
+	 Cost of an extra read transaction, in bytes
+
+	 Defaults to 20, the request frame plus the reply header and CRC
+	 plus the silent intervals around them.
+
+	 When planning the polls, two blocks of registers separated by a gap
+	 are read together if the extra reply bytes ( 2 per register in the gap )
+	 cost less than this.
+	 */
+	 int PollOverhead;
+
+	 /**
+	 Milliseconds between polls of each station
+
+	 Defaults to 1000.  Stations and blocks of registers can be given
+	 their own period with cFarmodbus::SetPollPeriod()
+	 Periods shorter than 1 are taken as 1, polling as fast as the port can.
+	 */
+	 int PollPeriod;
+
+	 /**
+	 Maximum number of writes waiting for each port
+
+	 Defaults to 256.  Writes are discarded, and the application told so,
+	 if the polling thread falls this far behind.
+	 */
+	 int WriteQueueLength;
+
+	 /**
+	 Bound on write latency, milliseconds
+
+	 Defaults to 100.  Writes are performed between read transactions,
+	 so normally wait for no more than the transaction in progress.
+	 Writes that take longer than this, from being queued by the application
+	 until acknowledged by the station, are counted as late.
+	 If writes are often late, reduce MaxReadCount, so that
+	 the read transactions are shorter, or the number of requests
+	 in flight on Modbus TCP ports.
+	 */
+	 int WriteLatency;
+
+	 /**
+	 Allowance for buffering in serial drivers and USB adapters, milliseconds
+
+	 Defaults to 20.  While a reply frame is arriving, the wait for the rest
+	 of it is the time to send the bytes still expected, plus the t3.5 silence,
+	 plus this.  Some USB adapters hold bytes for 16 msecs before passing them on.
+	 RTU frames over TCP have no silence to end them, a frame split by the network
+	 has until the reply deadline, or this if that has passed.
+	 */
+	 int SerialLatency;
+
+	 /**
+	 Shortest time to wait for a reply, milliseconds
+
+	 Defaults to 200.  Each station's timeout adapts to its measured round trip time,
+	 but is never shorter than this, so that a few quick replies
+	 do not cut off a device whose reply time varies.
+	 */
+	 int TimeoutFloor;
+
+	 /**
+	 Longest time to wait for a reply, milliseconds
+
+	 Defaults to 6000.  This is also the timeout until the first reply from a station
+	 has been measured.  The timeout doubles, up to this, each time a station does not reply.
+	 */
+	 int TimeoutCeiling;
+
+	 /**
+	 Unanswered transactions in a row before a station is down
+
+	 Defaults to 3.  A down station is no longer polled, so that it does not
+	 hold up the other stations on its port while it waits for a timeout each poll.
+	 Instead it is probed with a single read until it answers.
+	 */
+	 int DownAfter;
+
+	 /**
+	 Interval between the first probes of a down station, milliseconds
+
+	 Defaults to 1000.  The interval doubles with each unanswered probe,
+	 up to ProbeMax, and each interval is randomly shortened by up to half,
+	 so that stations that went down together are not probed together.
+	 */
+	 int ProbeMin;
+
+	 /**
+	 Longest interval between probes of a down station, milliseconds
+
+	 Defaults to 60000.
+	 */
+	 int ProbeMax;
+
+	 /**
+	 Longest time to wait for a TCP connection to an endpoint, milliseconds
+
+	 Defaults to 1000.  Connections are made without blocking,
+	 so a gateway that is down costs only this much.
+	 */
+	 int ConnectTimeout;
+
+	 /**
+	 Delay before reconnecting a TCP endpoint, milliseconds
+
+	 Defaults to 100.  The delay doubles with each failed connect, up to ReconnectMax,
+	 and returns to this once connected.
+	 */
+	 int ReconnectMin;
+
+	 /**
+	 Longest delay before reconnecting a TCP endpoint, milliseconds
+
+	 Defaults to 5000.
+	 */
+	 int ReconnectMax;
 
 	 /**
 
@@ -284,6 +1784,20 @@ private:
 	 cFarmodbusConfig()
 		 :
 	 ModbusReadCommand( 4 )
+	 , MaxReadCount( 125 )
+	 , PollOverhead( 20 )
+	 , PollPeriod( 1000 )
+	 , WriteQueueLength( 256 )
+	 , WriteLatency( 100 )
+	 , SerialLatency( 20 )
+	 , TimeoutFloor( 200 )
+	 , TimeoutCeiling( 6000 )
+	 , DownAfter( 3 )
+	 , ProbeMin( 1000 )
+	 , ProbeMax( 60000 )
+	 , ConnectTimeout( 1000 )
+	 , ReconnectMin( 100 )
+	 , ReconnectMax( 5000 )
 	 {}
 
 	 /**
@@ -313,8 +1827,9 @@ public:
 
 	Construct modbus farm
 
-	The constructor starts polling.  Until you add some stations
-	the polling does nothing, bit is always going on and will do more and more work
+	Polling starts when a port is added.  Each port is polled
+	in its own thread.  Until you add some stations
+	the polling does nothing, but is always going on and will do more and more work
 	as stations are added.
 
 	*/
@@ -327,6 +1842,9 @@ public:
 
 	@param[in] config  the new configuration
 
+	Every station's polling is planned again, since the plans
+	and their request frames are made from the configuration.
+
 	*/
 
 	void Set( cFarmodbusConfig& config );
@@ -341,14 +1859,36 @@ public:
 	@return error
 
 	Once a port is added to the modbus farm with some stations
-	then polling will start and continue on the port.  NOTHING ELSE
+	then polling will start and continue on the port, in its own thread.  NOTHING ELSE
 	SHOULD access the port once this begins.
 
+	On POSIX systems a port already opened supplies its own baud rate,
+	otherwise 9600 baud is assumed, as explained below.
+
 	*/
 	error Add( port_handle_t& handle, cSerial& port );
 
 	/**
 
+	Add COM port, with its baud rate
+
+	@param[out] handle  Use when defining which port a modbus station is connected through
+	@param[in]  port    The COM port through which modbus stations can be connected
+	@param[in]  baud    The baud rate the port has been opened with
+
+	@return error
+
+	The baud rate sets the silent interval between RTU frames,
+	3.5 character times ( fixed at 1750 microseconds above 19200 baud ),
+	and how long the rest of a reply may take once it has started.
+	Without it 9600 baud is assumed, the slowest usual modbus rate, which only makes
+	the wait between frames longer than necessary on faster lines.
+
+	*/
+	error Add( port_handle_t& handle, cSerial& port, int baud );
+
+	/**
+
 	Add TCP port
 
 	@param[out] handle  Use when defining which port a modbus station is connected through
@@ -366,6 +1906,83 @@ public:
 
 	/**
 
+	Add Modbus TCP port
+
+	@param[out] handle  Use when defining which port a modbus station is connected through
+	@param[in]  socket  The TCP socket, connected to a Modbus TCP server or gateway
+	@param[in]  in_flight  Maximum number of requests sent before waiting for a reply
+
+	@return error
+
+	Requests are framed with MBAP headers rather than the RTU address and CRC.
+	Each request carries a transaction ID, and the replies are matched
+	to the stations by transaction ID, so one connection can poll many
+	unit IDs without waiting for each reply before sending the next request.
+
+	*/
+
+	error AddModbusTCP( port_handle_t& handle, SOCKET port, int in_flight );
+
+	/**
+
+	Add TCP port, connecting to an endpoint
+
+	@param[out] handle  Use when defining which port a modbus station is connected through
+	@param[in]  endpoint  "host:port" of a device or gateway using RTU framing over TCP
+	@param[in]  connections  Number of connections to open to the endpoint
+
+	@return error, bad_endpoint if not host:port
+
+	The farm owns the connection.  It is made without blocking,
+	by the port's own polling thread, so several ports connect in parallel.
+	A broken connection is closed as soon as it is noticed,
+	the stations on the port get port_not_open,
+	and it is reconnected after a delay that backs off from
+	cFarmodbusConfig::ReconnectMin to ReconnectMax.
+
+	A gateway fronting several buses can answer requests on several
+	connections at once.  With more than one connection, each is
+	polled by its own thread, with its own transaction in progress,
+	and the stations added to the port are shared out between them
+	by their address: the station with address a uses connection a % connections.
+
+	*/
+	error Add( port_handle_t& handle, const char * endpoint, int connections = 1 );
+
+	/**
+
+	Add Modbus TCP port, connecting to an endpoint
+
+	@param[out] handle  Use when defining which port a modbus station is connected through
+	@param[in]  endpoint  "host:port" of a Modbus TCP server or gateway, usually port 502
+	@param[in]  in_flight  Maximum number of requests sent on each connection before waiting for a reply
+	@param[in]  connections  Number of connections to open to the endpoint
+
+	@return error, bad_endpoint if not host:port
+
+	The farm owns, and reconnects, the connections, and shares the stations out
+	between them by unit ID, as for Add( handle, endpoint, connections ).
+	Each connection has its own transaction IDs and its own requests in flight,
+	so up to in_flight * connections requests can be waiting at the gateway.
+
+	*/
+	error AddModbusTCP( port_handle_t& handle, const char * endpoint, int in_flight, int connections = 1 );
+
+	/**
+
+	Get the state of a port's TCP connections
+
+	@param[out] connected true if every connection is up, always true for sockets supplied by the application
+	@param[out] connects number of times the farm has connected the port's endpoint, over all its connections
+	@param[in] port handle
+
+	@return error
+
+	*/
+	error getConnection( bool& connected, int& connects, port_handle_t port );
+
+	/**
+
 	Add modbus station
 
 	@param[out] handle Use when requesting access to this station
@@ -418,6 +2035,32 @@ public:
 		station_handle_t station,
 		int first_reg,
 		int reg_count );
+
+	/**
+
+	Copy many blocks of registers, on any stations, in one call
+
+	@param[out] value buffer long enough to hold the values of all the slices, one after another
+	@param[in,out] slice the blocks of registers to copy, the error and epoch of each are set
+
+	@return first error found in any slice, or farm errors
+
+	The values of each slice are copied to the buffer in turn, with no gaps,
+	without locking and without checking the farm configuration again for each slice.
+	The values in each slice were all current at the same time,
+	and the slice's epoch identifies the update of the station's cached values that they came from:
+	while the epoch of a slice stays the same, so do its values.
+	Slices on different stations are copied one after the other,
+	so they may come from different poll cycles.
+
+	As with Query(), registers not yet polled are added to the poll plan
+	and their slice reports not_ready.
+
+	*/
+	error Snapshot(
+		unsigned short* value,
+		std::vector< cSlice >& slice );
+
 	/**
 
 	Write value to register
@@ -426,7 +2069,7 @@ public:
 	@param[in] reg register to write
 	@param[in] value to write
 
-	@return error from PREVIOUS poll, or parameter errors
+	@return error from PREVIOUS poll, or parameter errors, or write_queue_full
 
 	*/
 
@@ -443,34 +2086,364 @@ public:
 	@param[in] reg_count number of registers to write
 	@param[in] value pointer to buffer of values to write
 
-	@return error from PREVIOUS poll, or parameter errors
+	@return error from PREVIOUS poll, or parameter errors, or write_queue_full
+
+	A write too long for one command is split into several,
+	and on write_queue_full none of them has been queued.
 
 	This adds the write request to the write queue.  
-	It will be executed at the beginning of the next poll.
+	It will be executed as soon as the port finishes the transaction
+	in progress, without waiting for the polls due.
+	Writes waiting in the queue for the same station, to registers
+	that overlap or are adjacent, are merged into one command.
 	If there is an error in the parameters, then the error return
 	will indicate so.  If there was an error executing a read on
 	a previous poll, then the error return from this call
 	will indicate that.  Any error from this read will
 	be returned on the NEXT call to this method.
+	To find the result of a particular write, use WriteAsync()
+	or pass a completion callback.
+
+	*/
+	error Write(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		unsigned short * value );
+
+	/**
+
+	Write values to block of registers, with completion callback
+
+	@param[in] station handle
+	@param[in] first_reg first register offset to write to
+	@param[in] reg_count number of registers to write, no more than cWriteWaiting::max_count
+	@param[in] value pointer to buffer of values to write
+	@param[in] done called by the port's polling thread with the result of this write
+
+	@return parameter errors, or write_queue_full.  If there is an error, done is not called.
+
+	Unlike the write without a callback, this is never merged with other writes,
+	so the result passed to done is that of this write's own command.
 
 	*/
 	error Write(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		unsigned short * value,
+		completion_t done );
+
+	/**
+
+	Write values to block of registers, returning a future
+
+	@param[in] station handle
+	@param[in] first_reg first register offset to write to
+	@param[in] reg_count number of registers to write, no more than cWriteWaiting::max_count
+	@param[in] value pointer to buffer of values to write
+
+	@return future that becomes ready with the result of the write, including any parameter error
+
+	Application threads can wait for the write to complete with the future's get() or timed_wait().
+
+	*/
+	boost::shared_future< cResult > WriteAsync(
 		station_handle_t station,
 		int first_reg,
 		int reg_count,
 		unsigned short * value );
 
+	/**
+
+	Read block of registers from the device now, with completion callback
+
+	@param[in] station handle
+	@param[in] first_reg first register offset to read
+	@param[in] reg_count number of registers to read, no more than cWriteWaiting::max_count
+	@param[in] done called by the port's polling thread with the values read
+
+	@return parameter errors, or write_queue_full.  If there is an error, done is not called.
+
+	The read is queued with the writes, so it is done as soon as
+	the port finishes the transaction in progress.  The registers
+	need not be in the poll plan, and are not added to it.
+
+	*/
+	error Read(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		completion_t done );
+
+	/**
+
+	Read block of registers from the device now, returning a future
+
+	@param[in] station handle
+	@param[in] first_reg first register offset to read
+	@param[in] reg_count number of registers to read, no more than cWriteWaiting::max_count
+
+	@return future that becomes ready with the values read, or the error
+
+	*/
+	boost::shared_future< cResult > ReadAsync(
+		station_handle_t station,
+		int first_reg,
+		int reg_count );
+
+	/**
+
+	Set poll period for a station
+
+	@param[in] station handle
+	@param[in] msec milliseconds between polls
+
+	@return error
+
+	The station is polled at a fixed rate, each poll is scheduled
+	one period after the previous one was due, so the rate does not
+	drift however long the polls take.
+
+	*/
+	error SetPollPeriod(
+		station_handle_t station,
+		int msec );
+
+	/**
+
+	Set poll period for a block of registers
+
+	@param[in] station handle
+	@param[in] first_reg first register
+	@param[in] reg_count number of registers
+	@param[in] msec milliseconds between polls
+
+	@return error
+
+	Use this to poll, for example, a control loop at 100 msec
+	and nameplate data once a minute, on the same station.
+
+	*/
+	error SetPollPeriod(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		int msec );
+
+	/**
+
+	Set the most registers read from a station in one transaction
+
+	@param[in] station handle
+	@param[in] count most registers read, up to the modbus limit of 125,
+	           0 to go back to cFarmodbusConfig::MaxReadCount
+
+	@return error
+
+	For a device that answers only shorter reads than the specification
+	allows, or is slow to answer long ones, without breaking up the polls
+	of the other stations.
+
+	*/
+	error SetMaxReadCount(
+		station_handle_t station,
+		int count );
+
+	/**
+
+	Get number of poll overruns
+
+	@param[out] count number of times polling of the station has fallen
+	            a whole period behind schedule
+	@param[in] station handle
+
+	@return error
+
+	*/
+	error getPollOverruns(
+		int& count,
+		station_handle_t station );
+
+	/**
+
+	Get write latency, from queueing a write until the station acknowledges it
+
+	@param[out] last microseconds taken by the most recent write
+	@param[out] max microseconds taken by the slowest write
+	@param[out] late number of writes that took longer than cFarmodbusConfig::WriteLatency
+	@param[in] station handle
+
+	@return error
+
+	*/
+	error getWriteLatency(
+		int& last,
+		int& max,
+		int& late,
+		station_handle_t station );
+
+	/**
+
+	Get round trip time estimates, and the timeout derived from them
+
+	@param[out] srtt smoothed round trip time, microseconds, 0 if not yet measured
+	@param[out] rttvar smoothed variation of round trip time, microseconds
+	@param[out] timeout milliseconds the station's port waits for a reply
+	@param[in] station handle
+
+	@return error
+
+	*/
+	error getRoundTrip(
+		int& srtt,
+		int& rttvar,
+		int& timeout,
+		station_handle_t station );
+
+	/**
+
+	Get the health of a station
+
+	@param[out] state healthy, suspect or down
+	@param[out] missed number of transactions in a row the station has not answered
+	@param[in] station handle
+
+	@return error
+
+	*/
+	error getHealth(
+		health& state,
+		int& missed,
+		station_handle_t station );
+
+	/**
+
+	Subscribe to changes in a block of registers
+
+	@param[out] handle Use to cancel the subscription
+	@param[in] station handle
+	@param[in] first_reg first register offset
+	@param[in] reg_count number of registers
+	@param[in] deadband changes no larger than this are not reported, 0 to report every change
+	@param[in] notify called with each batch of changes
+
+	@return error
+
+	After each poll reply is decoded, the new values are compared
+	to those last reported to this subscriber.  Registers that have
+	changed by more than the deadband are passed to notify,
+	in one batch per reply, from a notification thread shared by all subscribers.
+	The first value read from each register is always reported.
+
+	The deadband applies to each register separately.  The values are
+	compared as signed 16 bit integers.  A register drifting slowly is reported
+	once it has moved more than the deadband from the value last reported.
+
+	The registers are added to those polled, so there is no need to Query them.
+
+	*/
+	error Subscribe(
+		subscription_handle_t& handle,
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		int deadband,
+		notify_t notify );
+
+	/**
+
+	Cancel subscription
+
+	@param[in] handle of the subscription
+
+	@return error
+
+	Batches of changes already posted to the notification thread may still be delivered.
+
+	*/
+	error Unsubscribe( subscription_handle_t handle );
+
+	/**
+
+	Get the metrics of a port
+
+	@param[out] metrics counts and histograms since the port was added
+	@param[in] port handle
+
+	@return error
+
+	The metrics of a gateway's connections are added together.
+	Requests, replies, timeouts and errors are those of the port's stations,
+	bytes are counted on the line, including framing and anything flushed.
+	busy_usec, compared with the time between two snapshots,
+	shows how close the port is to its limit.
+
+	*/
+	error getPortMetrics( cMetricsSnapshot& metrics, port_handle_t port );
+
+	/**
+
+	Get the metrics of a station
+
+	@param[out] metrics counts and histograms since the station was added
+	@param[in] station handle
+
+	@return error
+
+	Bytes are those of the request and reply PDUs.
+
+	*/
+	error getStationMetrics( cMetricsSnapshot& metrics, station_handle_t station );
+
+	/**
+
+	Get the metrics of every port and station as text
+
+	@param[out] text the metrics, in the Prometheus text exposition format
+
+	@return error
+
+	Each line is a metric name, labels and value, e.g.
+
+	farmodbus_timeouts_total{port="0",station="3",address="17"} 12
+
+	Port lines have only the port label.  Histograms have cumulative
+	_bucket lines, with the upper bound in microseconds as the le label,
+	then _sum and _count.
+
+	*/
+	error getMetricsText( std::string& text );
+
 
 private:
 	static int myLastID;
-	std::vector< cPort > myPort;
+	std::vector< std::vector< cPort * > > myPort;		///< the connections of each port, more than one only for a gateway endpoint
 	std::vector< cStation * > myStation;
-	std::queue< cWriteWaiting > myWriteQueue;
-	boost::mutex myWriteQueueMutex;
+	std::vector< station_handle_t > mySubscription;	///< station of each subscription
+	boost::mutex mySubscriptionMutex;				///< protects mySubscription, used from any thread
 
-	void Poll();
-	cWriteWaiting PopWriteFromQueue();
 	bool IsSingleton() { return myLastID == 1; }
+
+	/// Add a port, with its connections, and start polling them
+	error AddPort( port_handle_t& handle, const std::vector< cPort * >& connection );
+
+	/// Check parameters and queue a write or on-demand read with completion callback
+	error Queue(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		const completion_t& done,
+		bool read );
+
+	/// Queue a write or on-demand read, returning a future for the result
+	boost::shared_future< cResult > QueueAsync(
+		station_handle_t station,
+		int first_reg,
+		int reg_count,
+		const unsigned short * value,
+		bool read );
 };
 	}
 }
\ No newline at end of file
@@ -0,0 +1,621 @@
+/*
+ *  Implement simulated modbus devices, to load test the modbus farm
+ *
+ * Copyright (c) 2013 by James Bremner
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by James Bremner. The name "James Bremner" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include "stdafx.h"
+#include "cFarmodbus.h"
+#include "cSimodbus.h"
+
+namespace raven {
+	namespace simodbus {
+
+		// the farm's port frames the RTU replies
+		using raven::farmodbus::cPort;
+		typedef raven::farmodbus::time_point_t time_point_t;
+
+		long long ThreadCPU()
+		{
+#ifdef _WIN32
+			FILETIME create, exit, kernel, user;
+			if( ! GetThreadTimes( GetCurrentThread(), &create, &exit, &kernel, &user ) )
+				return 0;
+			ULARGE_INTEGER k, u;
+			k.LowPart = kernel.dwLowDateTime;
+			k.HighPart = kernel.dwHighDateTime;
+			u.LowPart = user.dwLowDateTime;
+			u.HighPart = user.dwHighDateTime;
+			return (long long)( ( k.QuadPart + u.QuadPart ) / 10 );		// 100 nanosecond units
+#else
+			timespec t;
+			if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &t ) )
+				return 0;
+			return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+#endif
+		}
+
+		bool cLatency::Parse( const char * text )
+		{
+			char name[ 16 ];
+			double a = 0;
+			double b = 0;
+			int n = sscanf( text, "%15[a-z]:%lf:%lf", name, &a, &b );
+			if( n < 2 || a < 0 || b < 0 )
+				return false;
+			std::string s( name );
+			if( s == "fixed" && n == 2 ) {
+				*this = cLatency( fixed, (int)( 1000 * a ) );
+			} else if( s == "uniform" && n == 3 && b >= a ) {
+				*this = cLatency( uniform, (int)( 1000 * a ), (int)( 1000 * b ) );
+			} else if( s == "exp" && n == 3 ) {
+				*this = cLatency( exponential, (int)( 1000 * a ),
+					(int)( 1000 * ( a + 10 * b ) ), (int)( 1000 * b ) );
+			} else {
+				return false;
+			}
+			return true;
+		}
+
+		int cLatency::Draw()
+		{
+			// uniform in [0,1), fine enough for any range, whatever RAND_MAX is
+			double u = ( rand() + rand() / ( RAND_MAX + 1.0 ) ) / ( RAND_MAX + 1.0 );
+			switch( myShape ) {
+			case uniform:
+				return myMin + (int)( u * ( myMax - myMin + 1 ) );
+			case exponential: {
+				int usec = myMin + (int)( -myMean * log( 1 - u ) );
+				if( myMax > 0 && usec > myMax )
+					usec = myMax;
+				return usec; }
+			default:
+				return myMin;
+			}
+		}
+
+		std::string cLatency::Text() const
+		{
+			char buf[ 100 ];
+			switch( myShape ) {
+			case uniform:
+				sprintf( buf, "uniform %d to %d usecs", myMin, myMax );
+				break;
+			case exponential:
+				sprintf( buf, "%d usecs plus exponential, mean %d usecs, up to %d",
+					myMin, myMean, myMax );
+				break;
+			default:
+				sprintf( buf, "fixed %d usecs", myMin );
+				break;
+			}
+			return std::string( buf );
+		}
+
+		cSimStation::cSimStation( int address )
+			: myAddress( address )
+			, myDrop( 0 )
+		{
+			for( int k = 0; k < 128; k++ )
+				myFunction[k] = ( k == 3 || k == 4 || k == 6 || k == 16 );
+		}
+
+		void cSimStation::Map( int first, int count )
+		{
+			int last = first + count - 1;
+			if( first < 0 || count < 1 || last > 65535 )
+				return;
+
+			// merge with any blocks that overlap or touch, keeping their values
+			std::vector< cBlock > merged;
+			unsigned int k = 0;
+			for( ; k < myBlock.size() && myBlock[k].last() + 1 < first; k++ )
+				merged.push_back( myBlock[k] );
+			unsigned int touch = k;
+			for( ; k < myBlock.size() && myBlock[k].first <= last + 1; k++ ) {
+				first = std::min( first, myBlock[k].first );
+				last = std::max( last, myBlock[k].last() );
+			}
+			cBlock B;
+			B.first = first;
+			for( int reg = first; reg <= last; reg++ )
+				B.value.push_back( (unsigned short) reg );
+			for( unsigned int j = touch; j < k; j++ ) {
+				std::copy( myBlock[j].value.begin(), myBlock[j].value.end(),
+					B.value.begin() + ( myBlock[j].first - first ) );
+			}
+			merged.push_back( B );
+			for( ; k < myBlock.size(); k++ )
+				merged.push_back( myBlock[k] );
+			myBlock.swap( merged );
+		}
+
+		void cSimStation::setFunctions( const std::vector< int >& code )
+		{
+			for( int k = 0; k < 128; k++ )
+				myFunction[k] = false;
+			foreach( int c, code ) {
+				if( 0 < c && c < 128 )
+					myFunction[c] = true;
+			}
+		}
+
+		/**
+
+		The values of a block of registers, null if any is not in the register map
+
+		*/
+		unsigned short * cSimStation::Find( int first, int count )
+		{
+			foreach( cBlock& B, myBlock ) {
+				if( B.first <= first && first + count - 1 <= B.last() )
+					return &B.value[ first - B.first ];
+			}
+			return 0;
+		}
+
+		bool cSimStation::getValue( unsigned short& value, int reg )
+		{
+			unsigned short * p = Find( reg, 1 );
+			if( ! p )
+				return false;
+			value = *p;
+			return true;
+		}
+
+		int cSimStation::Exception( unsigned char * reply, int function, int code )
+		{
+			reply[0] = 0x80 | function;
+			reply[1] = code;
+			return 2;
+		}
+
+		int cSimStation::Answer(
+			const unsigned char * request,
+			int length,
+			unsigned char * reply,
+			int& delay )
+		{
+			delay = myLatency.Draw();
+			if( myDrop > 0 && rand() < myDrop * ( RAND_MAX + 1.0 ) )
+				return 0;
+			if( length < 1 )
+				return 0;
+
+			int function = request[0];
+			if( function >= 128 || ! myFunction[ function ] )
+				return Exception( reply, function, 1 );		// illegal function
+
+			int first = 0;
+			int count = 0;
+			if( length >= 5 ) {
+				first = request[1] << 8 | request[2];
+				count = request[3] << 8 | request[4];
+			}
+			unsigned short * value;
+			switch( function ) {
+
+			case 3:
+			case 4:
+				// read holding or input registers, the same registers either way
+				if( length < 5 || count < 1 || count > 125 )
+					return Exception( reply, function, 3 );		// illegal data value
+				value = Find( first, count );
+				if( ! value )
+					return Exception( reply, function, 2 );		// illegal data address
+				reply[0] = function;
+				reply[1] = 2 * count;
+				for( int k = 0; k < count; k++ ) {
+					reply[ 2 + 2 * k ] = value[k] >> 8;
+					reply[ 3 + 2 * k ] = 0xFF & value[k];
+				}
+				return 2 + 2 * count;
+
+			case 6:
+				// write single register, the reply echoes the request
+				if( length < 5 )
+					return Exception( reply, function, 3 );
+				value = Find( first, 1 );
+				if( ! value )
+					return Exception( reply, function, 2 );
+				*value = (unsigned short) count;
+				memcpy( reply, request, 5 );
+				return 5;
+
+			case 16:
+				// write multiple registers, the reply echoes the register and count
+				if( length < 6 || count < 1 || count > 123 ||
+					request[5] != 2 * count || length < 6 + 2 * count )
+					return Exception( reply, function, 3 );
+				value = Find( first, count );
+				if( ! value )
+					return Exception( reply, function, 2 );
+				for( int k = 0; k < count; k++ )
+					value[k] = (unsigned short)( request[ 6 + 2 * k ] << 8 | request[ 7 + 2 * k ] );
+				memcpy( reply, request, 5 );
+				return 5;
+
+			default:
+				return Exception( reply, function, 1 );
+			}
+		}
+
+		cSimBus::cSimBus()
+			: myAnswered( 0 )
+			, myDropped( 0 )
+			, myWrites( 0 )
+			, myCPU( 0 )
+		{
+			for( int k = 0; k < 256; k++ )
+				myStation[k] = 0;
+		}
+
+		void cSimBus::Add( cSimStation * station )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			int address = 0xFF & station->getAddress();
+			delete myStation[ address ];
+			myStation[ address ] = station;
+		}
+
+		cSimStation * cSimBus::Find( int address )
+		{
+			if( address < 0 || address > 255 )
+				return 0;
+			return myStation[ address ];
+		}
+
+		int cSimBus::Answer(
+			int address,
+			const unsigned char * request,
+			int length,
+			unsigned char * reply,
+			int& delay )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			delay = 0;
+			cSimStation * station = Find( address );
+			int n = station ? station->Answer( request, length, reply, delay ) : 0;
+			if( n ) {
+				myAnswered++;
+				if( request[0] == 6 || request[0] == 16 )
+					myWrites++;
+			} else
+				myDropped++;
+			return n;
+		}
+
+		void cSimBus::getCount( long long& answered, long long& dropped )
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			answered = myAnswered;
+			dropped = myDropped;
+		}
+
+		long long cSimBus::getWriteCount()
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			return myWrites;
+		}
+
+		long long cSimBus::getCPU()
+		{
+			boost::mutex::scoped_lock lock( myMutex );
+			return myCPU;
+		}
+
+		int cSimBus::ServeTCP( int port, bool mbap )
+		{
+			SOCKET listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+			if( listener == INVALID_SOCKET )
+				return 0;
+			int on = 1;
+			setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof( on ) );
+			sockaddr_in address;
+			memset( &address, 0, sizeof( address ) );
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+			address.sin_port = htons( (unsigned short) port );
+			socklen_t address_length = sizeof( address );
+			if( bind( listener, (sockaddr *) &address, sizeof( address ) ) ||
+				listen( listener, SOMAXCONN ) ||
+				getsockname( listener, (sockaddr *) &address, &address_length ) ) {
+				closesocket( listener );
+				return 0;
+			}
+
+			// start accepting connections
+			boost::thread* pThread = new boost::thread(
+				boost::bind(
+				&cSimBus::Accept,		// member function
+				this, listener, mbap ) );
+
+			return ntohs( address.sin_port );
+		}
+
+		/**
+
+		The thread accepting connections to a TCP port, each served by a thread of its own
+
+		This method never returns.
+
+		*/
+		void cSimBus::Accept( SOCKET listener, bool mbap )
+		{
+			for( ; ; ) {
+				SOCKET s = accept( listener, 0, 0 );
+				if( s == INVALID_SOCKET )
+					continue;
+				int on = 1;
+				setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof( on ) );
+				boost::thread* pThread = new boost::thread(
+					boost::bind(
+					&cSimBus::Serve,		// member function
+					this, s, true, mbap ) );
+			}
+		}
+
+#ifndef _WIN32
+		std::string cSimBus::ServePty()
+		{
+			int master = posix_openpt( O_RDWR | O_NOCTTY );
+			if( master < 0 || grantpt( master ) || unlockpt( master ) ) {
+				if( master >= 0 )
+					close( master );
+				return std::string();
+			}
+			std::string path( ptsname( master ) );
+
+			// hold the terminal open, so the master does not see a hangup
+			// before the farm opens it or after the farm closes it,
+			// and make it raw, so that replies are not echoed back as requests
+			int slave = open( path.c_str(), O_RDWR | O_NOCTTY );
+			if( slave >= 0 ) {
+				termios tio;
+				if( tcgetattr( slave, &tio ) == 0 ) {
+					cfmakeraw( &tio );
+					tcsetattr( slave, TCSANOW, &tio );
+				}
+			}
+
+			boost::thread* pThread = new boost::thread(
+				boost::bind(
+				&cSimBus::Serve,		// member function
+				this, (SOCKET) master, false, false ) );
+
+			return path;
+		}
+#endif
+
+		/**
+
+		Length of the request frame at the start of a buffer
+
+		@param[in] buffer the bytes received
+		@param[in] have number of bytes received
+		@param[in] mbap true for Modbus TCP framing
+
+		@return number of bytes in the frame, 0 if more are needed, -1 if the buffer is garbage
+
+		An RTU frame with a function code whose length is not known
+		is taken to be everything received, since an RTU master
+		waits for each reply before sending another request.
+
+		*/
+		int cSimBus::Frame( const unsigned char * buffer, int have, bool mbap )
+		{
+			if( mbap ) {
+				if( have < 7 )
+					return 0;
+				int length = buffer[4] << 8 | buffer[5];
+				if( buffer[2] || buffer[3] || length < 2 || length > 254 )
+					return -1;
+				return have >= 6 + length ? 6 + length : 0;
+			}
+
+			if( have < 2 )
+				return 0;
+			int length;
+			switch( buffer[1] ) {
+			case 1:
+			case 2:
+			case 3:
+			case 4:
+			case 5:
+			case 6:
+				// address, function code, register, count or value, CRC
+				length = 8;
+				break;
+			case 15:
+			case 16:
+				// address, function code, register, count, byte count, data, CRC
+				if( have < 7 )
+					return 0;
+				length = 9 + buffer[6];
+				break;
+			default:
+				length = have;
+				break;
+			}
+			return have >= length ? length : 0;
+		}
+
+		/**
+
+		Assemble the reply to a request frame
+
+		@param[in] frame the request
+		@param[in] length number of bytes in request
+		@param[in] mbap true for Modbus TCP framing
+		@param[out] reply buffer for the reply frame, at least 300 bytes
+		@param[out] delay microseconds to wait before sending the reply
+
+		@return number of bytes in reply, 0 if none
+
+		*/
+		int cSimBus::Reply(
+			const unsigned char * frame,
+			int length,
+			bool mbap,
+			unsigned char * reply,
+			int& delay )
+		{
+			if( mbap ) {
+				int n = Answer( frame[6], frame + 7, length - 7, reply + 7, delay );
+				if( ! n )
+					return 0;
+				memcpy( reply, frame, 4 );			// transaction and protocol IDs
+				reply[4] = ( n + 1 ) >> 8;
+				reply[5] = 0xFF & ( n + 1 );
+				reply[6] = frame[6];				// unit ID
+				return n + 7;
+			}
+
+			// a device ignores a request with a bad CRC
+			unsigned short crc = cPort::CyclicalRedundancyCheck( frame, length - 2 );
+			if( length < 4 || frame[ length - 2 ] != crc >> 8 || frame[ length - 1 ] != ( 0xFF & crc ) ) {
+				boost::mutex::scoped_lock lock( myMutex );
+				myDropped++;
+				return 0;
+			}
+			int n = Answer( frame[0], frame + 1, length - 3, reply + 1, delay );
+			if( ! n )
+				return 0;
+			reply[0] = frame[0];
+			crc = cPort::CyclicalRedundancyCheck( reply, n + 1 );
+			reply[ n + 1 ] = crc >> 8;
+			reply[ n + 2 ] = 0xFF & crc;
+			return n + 3;
+		}
+
+		/**
+
+		The thread serving a connection, or a pseudo terminal
+
+		@param[in] handle the socket, or the terminal's file descriptor
+		@param[in] socket true for a socket
+		@param[in] mbap true for Modbus TCP framing
+
+		Requests are answered as soon as they arrive, and the replies
+		held, in order of when they are due, until their delay has passed.
+		Returns when the connection closes.
+
+		*/
+		void cSimBus::Serve( SOCKET handle, bool socket, bool mbap )
+		{
+			unsigned char buffer[ 4096 ];
+			int have = 0;
+			std::multimap< time_point_t, std::vector< unsigned char > > pending;
+			unsigned char reply[ 300 ];
+			long long cpu = ThreadCPU();
+
+			for( ; ; ) {
+
+				// wait for a request, or until the next reply is due
+				time_point_t now = boost::chrono::steady_clock::now();
+				TIMEVAL timeout;
+				TIMEVAL * ptimeout = 0;
+				if( pending.size() ) {
+					long long usec = boost::chrono::duration_cast< boost::chrono::microseconds >(
+						pending.begin()->first - now ).count();
+					if( usec < 0 )
+						usec = 0;
+					timeout.tv_sec = (long)( usec / 1000000 );
+					timeout.tv_usec = (long)( usec % 1000000 );
+					ptimeout = &timeout;
+				}
+				fd_set fds;
+				FD_ZERO( &fds );
+				FD_SET( handle, &fds );
+				int ready = select( (int) handle + 1, &fds, 0, 0, ptimeout );
+
+				if( ready > 0 ) {
+					int n;
+					if( socket )
+						n = recv( handle, (char *) buffer + have, sizeof( buffer ) - have, 0 );
+#ifndef _WIN32
+					else
+						n = (int) read( handle, buffer + have, sizeof( buffer ) - have );
+#endif
+					if( n <= 0 ) {
+						if( ! socket ) {
+							// no terminal open at the other end, wait for one
+							boost::this_thread::sleep_for( boost::chrono::milliseconds( 10 ) );
+							continue;
+						}
+						closesocket( handle );
+						return;
+					}
+					have += n;
+
+					// answer every whole request received
+					now = boost::chrono::steady_clock::now();
+					for( ; ; ) {
+						int length = Frame( buffer, have, mbap );
+						if( length == 0 )
+							break;
+						if( length < 0 ) {
+							have = 0;
+							break;
+						}
+						int delay;
+						int n = Reply( buffer, length, mbap, reply, delay );
+						if( n ) {
+							pending.insert( std::make_pair(
+								now + boost::chrono::microseconds( delay ),
+								std::vector< unsigned char >( reply, reply + n ) ) );
+						}
+						have -= length;
+						memmove( buffer, buffer + length, have );
+					}
+					if( have == sizeof( buffer ) )
+						have = 0;
+				}
+
+				// send the replies that are due
+				now = boost::chrono::steady_clock::now();
+				while( pending.size() && pending.begin()->first <= now ) {
+					std::vector< unsigned char >& R = pending.begin()->second;
+					if( socket ) {
+						int flags = 0;
+#ifdef MSG_NOSIGNAL
+						flags = MSG_NOSIGNAL;
+#endif
+						send( handle, (const char *) &R[0], (int) R.size(), flags );
+					}
+#ifndef _WIN32
+					else if( write( handle, &R[0], R.size() ) < 0 ) {
+						// nobody reading, the reply is lost as on a real line
+					}
+#endif
+					pending.erase( pending.begin() );
+				}
+
+				// account for the CPU used
+				long long used = ThreadCPU();
+				{
+					boost::mutex::scoped_lock lock( myMutex );
+					myCPU += used - cpu;
+				}
+				cpu = used;
+			}
+		}
+
+	}
+}
@@ -0,0 +1,337 @@
+/*
+ *  Class interface for simulated modbus devices, to load test the modbus farm
+ *
+ * Copyright (c) 2013 by James Bremner
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by James Bremner. The name "James Bremner" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#pragma once
+
+namespace raven {
+	namespace simodbus {
+
+/**
+
+  How long a simulated station takes to reply
+
+  The time is drawn afresh for each request, in microseconds.
+
+*/
+class cLatency {
+public:
+	enum shape {
+		fixed,				///< always the minimum
+		uniform,			///< evenly spread between the minimum and maximum
+		exponential,		///< the minimum plus an exponential delay, averaging the mean, capped at the maximum
+	};
+
+	/// No delay
+	cLatency()
+		: myShape( fixed ), myMin( 0 ), myMax( 0 ), myMean( 0 )
+	{}
+
+	/**
+
+	Construct latency
+
+	@param[in] s the shape of the distribution
+	@param[in] min shortest time, microseconds
+	@param[in] max longest time, microseconds, ignored if fixed
+	@param[in] mean average added to the minimum, microseconds, exponential only
+
+	*/
+	cLatency( shape s, int min, int max = 0, int mean = 0 )
+		: myShape( s ), myMin( min ), myMax( max ), myMean( mean )
+	{}
+
+	/**
+
+	Set latency from text
+
+	@param[in] text "fixed:ms", "uniform:min_ms:max_ms" or "exp:min_ms:mean_ms", fractions allowed
+
+	@return false if the text is not in one of these forms
+
+	An exponential latency parsed from text is capped at ten times its mean.
+
+	*/
+	bool Parse( const char * text );
+
+	/// Draw a reply time, microseconds.  Not thread safe, the caller serializes.
+	int Draw();
+
+	/// Describe the latency, e.g. "uniform 2000 to 10000 usecs"
+	std::string Text() const;
+
+private:
+	shape myShape;
+	int myMin;
+	int myMax;
+	int myMean;
+};
+
+/// CPU time used by the calling thread, microseconds
+long long ThreadCPU();
+
+/**
+
+  A simulated modbus device
+
+  The station holds blocks of registers, the register map, which can be
+  read with function codes 3 and 4 and written with 6 and 16.
+  Both reads see the same registers.  Requests for registers outside
+  the map get exception 2, illegal data address, and function codes
+  the station does not support get exception 1, illegal function.
+
+  Every register starts holding its own address, so a reply can be checked
+  without knowing what else has been written.
+
+*/
+class cSimStation {
+public:
+
+	/**
+
+	Construct station
+
+	@param[in] address modbus device address, or unit ID, 1 to 247
+
+	The station supports function codes 3, 4, 6 and 16, has no registers,
+	and replies without delay.
+
+	*/
+	cSimStation( int address );
+
+	/**
+
+	Add a block of registers to the register map
+
+	@param[in] first register
+	@param[in] count number of registers
+
+	Registers already in the map keep their values.
+
+	*/
+	void Map( int first, int count );
+
+	/**
+
+	Set the function codes the station supports
+
+	@param[in] code the function codes, the others get exception 1
+
+	*/
+	void setFunctions( const std::vector< int >& code );
+
+	/// Set how long the station takes to reply
+	void setLatency( const cLatency& latency ) { myLatency = latency; }
+
+	/**
+
+	Set the fraction of requests the station does not answer
+
+	@param[in] fraction 0 answers everything, 1 is a dead station
+
+	*/
+	void setDrop( double fraction ) { myDrop = fraction; }
+
+	/**
+
+	Answer a request
+
+	@param[in] request the request PDU, function code and data
+	@param[in] length number of bytes in request
+	@param[out] reply buffer for the reply PDU, at least 256 bytes
+	@param[out] delay microseconds to wait before sending the reply
+
+	@return number of bytes in reply, 0 if the request is not answered
+
+	Not thread safe, the caller serializes.
+
+	*/
+	int Answer(
+		const unsigned char * request,
+		int length,
+		unsigned char * reply,
+		int& delay );
+
+	/**
+
+	Get a register value
+
+	@param[out] value
+	@param[in] reg register
+
+	@return false if the register is not in the map
+
+	*/
+	bool getValue( unsigned short& value, int reg );
+
+	int getAddress() { return myAddress; }
+
+private:
+	class cBlock {
+	public:
+		int first;
+		std::vector< unsigned short > value;
+		int last() const { return first + (int) value.size() - 1; }
+	};
+	int myAddress;
+	std::vector< cBlock > myBlock;		///< register map, sorted, no two blocks overlap or touch
+	bool myFunction[ 128 ];				///< true for function codes supported
+	cLatency myLatency;
+	double myDrop;
+
+	unsigned short * Find( int first, int count );
+	static int Exception( unsigned char * reply, int function, int code );
+};
+
+/**
+
+  A bus of simulated stations
+
+  The stations can be reached over TCP, with Modbus TCP ( MBAP ) framing
+  or RTU framing, and, on POSIX systems, over a pseudo terminal with RTU framing,
+  like a serial line.  Any number of connections can be served at once.
+
+  Each connection is served by its own thread, which never blocks
+  waiting for a station's reply time: requests are answered as they arrive,
+  and the replies held back until they are due.  So a Modbus TCP client can have
+  many requests in flight, each station keeping its own latency,
+  while an RTU master sending one request at a time sees each station's latency in turn.
+
+  A bus can serve at most 247 stations, the modbus address limit.
+  Simulate more stations with more buses, each on its own TCP port.
+
+*/
+class cSimBus {
+public:
+	cSimBus();
+
+	/**
+
+	Add station to the bus
+
+	@param[in] station, owned by the bus from now on
+
+	A station with the same address is replaced.
+
+	*/
+	void Add( cSimStation * station );
+
+	/// The station with an address, null if none
+	cSimStation * Find( int address );
+
+	/**
+
+	Answer a request to a station on the bus
+
+	@param[in] address of the station
+	@param[in] request the request PDU
+	@param[in] length number of bytes in request
+	@param[out] reply buffer for the reply PDU, at least 256 bytes
+	@param[out] delay microseconds to wait before sending the reply
+
+	@return number of bytes in reply, 0 if there is no reply
+
+	Thread safe.
+
+	*/
+	int Answer(
+		int address,
+		const unsigned char * request,
+		int length,
+		unsigned char * reply,
+		int& delay );
+
+	/**
+
+	Serve the bus on a TCP port, on the loopback interface
+
+	@param[in] port number, 0 to let the system choose
+	@param[in] mbap true for Modbus TCP framing, false for RTU framing over TCP
+
+	@return the port number, 0 if it could not be opened
+
+	Connections are accepted, and served, by threads that run until the program exits.
+
+	*/
+	int ServeTCP( int port, bool mbap );
+
+#ifndef _WIN32
+	/**
+
+	Serve the bus on a pseudo terminal, with RTU framing
+
+	@return the device path of the terminal to open as a serial port, empty if none
+
+	*/
+	std::string ServePty();
+#endif
+
+	/**
+
+	Get request counts
+
+	@param[out] answered number of requests answered, including with an exception
+	@param[out] dropped number of requests not answered, because the station is
+				dead or dropped it, or there is no such station, or the CRC was bad
+
+	*/
+	void getCount( long long& answered, long long& dropped );
+
+	/**
+
+	Number of write requests answered, including with an exception
+
+	These are counted in the answered count too, so that a benchmark
+	can tell the polls from the writes.
+
+	*/
+	long long getWriteCount();
+
+	/**
+
+	CPU time used serving the bus, microseconds
+
+	Counts the threads serving connections, so that a benchmark running
+	the bus in the same process can tell its own CPU time from the bus's.
+
+	*/
+	long long getCPU();
+
+private:
+	cSimStation * myStation[ 256 ];
+	boost::mutex myMutex;
+	long long myAnswered;
+	long long myDropped;
+	long long myWrites;				///< write requests answered
+	long long myCPU;				///< microseconds of CPU used by the serving threads
+
+	void Accept( SOCKET listener, bool mbap );
+	void Serve( SOCKET handle, bool socket, bool mbap );
+	int Frame( const unsigned char * buffer, int have, bool mbap );
+	int Reply( const unsigned char * frame, int length, bool mbap, unsigned char * reply, int& delay );
+
+	// prevent copying, which would double free the stations
+	cSimBus( const cSimBus& );
+	cSimBus& operator=( const cSimBus& );
+};
+
+	}
+}